@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "base.h"
+#include "grafo.h"
 #include "filtros2d.h"
 
 /*============================================================================*/
@@ -157,44 +158,17 @@ void normLocalSimples (Imagem* in, Imagem* out, float min, float max, int largur
         exit (1);
     }
 
-    Imagem* buffer = criaImagem (in->largura, in->altura, in->n_canais);
-    Imagem* img_max = criaImagem (in->largura, in->altura, in->n_canais);
-    Imagem* img_min = criaImagem (in->largura, in->altura, in->n_canais);
-    Imagem* img_aux = criaImagem (in->largura, in->altura, in->n_canais);
-
-    // Comea encontrando os mximos e mnimos locais. Coloca em uma imagem auxiliar e "borra".
-    int channel, row, col;
-    maxLocal (in, img_aux, largura, largura, buffer);
-    blur (img_aux, img_max, largura, largura, buffer);
-    minLocal (in, img_aux, largura, largura, buffer);
-    blur (img_aux, img_min, largura, largura, buffer);
-
-    // Agora normaliza cada pixel com base na sua vizinhana.
-    float intervalo_in, region_min, region_max, val, intervalo_out = max - min;;
-    for (channel = 0; channel < in->n_canais; channel++)
-    {
-        for (row = 0; row < in->altura; row++)
-        {
-            for (col = 0; col < in->largura; col++)
-            {
-                val = in->dados [channel][row][col];
-                region_min = MIN (img_min->dados [channel][row][col], val);
-                region_max = MAX (img_max->dados [channel][row][col], val);
-
-                intervalo_in = region_max - region_min;
-
-                if (intervalo_in == intervalo_out)
-                    out->dados [channel][row][col] = val; // Regio j est normalizada. Fica como est.
-                else
-                    out->dados [channel][row][col] = (val - region_min) / intervalo_in * intervalo_out + min; // Normaliza.
-            }
-        }
-    }
-
-    destroiImagem (buffer);
-    destroiImagem (img_max);
-    destroiImagem (img_min);
-    destroiImagem (img_aux);
+    // Encontra os mximos e mnimos locais e os "borra"; depois normaliza cada
+    // pixel com base na sua vizinhana. As imagens dos mximos e mnimos no
+    // chegam a ser criadas: o grafo guarda s as linhas necessrias.
+    GrafoImagens* grafo = criaGrafo ();
+    int original = grafoEntrada (grafo, in);
+    int img_max = grafoBlur (grafo, grafoMaxLocal (grafo, original, largura, largura), largura, largura);
+    int img_min = grafoBlur (grafo, grafoMinLocal (grafo, original, largura, largura), largura, largura);
+    int resultado = grafoNormaliza (grafo, original, img_min, img_max, min, max);
+
+    executaGrafo (grafo, resultado, out);
+    destroiGrafo (grafo);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -340,4 +314,29 @@ void criaHistograma8bpp1cNorm (Imagem* in, int canal, float histograma [256])
         histograma [i] = ((float) hist_int [i]) * norm;
 }
 
+/*----------------------------------------------------------------------------*/
+/** Cria um histograma de 256 faixas para um canal de uma imagem de 8 bits. 
+ * o equivalente da criaHistograma8bpp1c, mas sem converses.
+ *
+ * Parmetros: ImagemU8* in: imagem de entrada.
+ *             int canal: canal da imagem de entrada a se analisar.
+ *             int histograma [256]: histograma de sada.
+ *
+ * Valor de retorno: nenhum (o histograma  preenchido). */
+
+void criaHistogramaU8 (ImagemU8* in, int canal, int histograma [256])
+{
+    int i;
+    for (i = 0; i < 256; i++)
+        histograma [i] = 0;
+
+    int row, col;
+    for (row = 0; row < in->altura; row++)
+    {
+        unsigned char* linha = in->dados [canal][row];
+        for (col = 0; col < in->largura; col++)
+            histograma [linha [col]]++;
+    }
+}
+
 /*============================================================================*/
@@ -29,6 +29,7 @@ void normLocalSimples (Imagem* in, Imagem* out, float min, float max, int largur
 /* Histogramas */
 void criaHistograma8bpp1c (Imagem* in, int canal, int histograma [256]);
 void criaHistograma8bpp1cNorm (Imagem* in, int canal, float histograma [256]);
+void criaHistogramaU8 (ImagemU8* in, int canal, int histograma [256]);
 
 /*============================================================================*/
 #endif /* __BASE_H */
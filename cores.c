@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <math.h>
 #include "base.h"
@@ -108,6 +109,82 @@ void cinzaParaRGB (Imagem* in, Imagem* out)
                 out->dados [i][j][k] = in->dados [0][j][k];
 }
 
+/*----------------------------------------------------------------------------*/
+/** Converte uma imagem de 8 bits de RGB para escala de cinza. Usa os mesmos
+ * fatores da RGBParaCinza, em ponto fixo com 16 bits de frao.
+ *
+ * Parmetros: ImagemU8* in: imagem de entrada de 3 canais.
+ *             ImagemU8* out: imagem de sada de 1 canal, com o mesmo tamanho.
+ *
+ * Valor de retorno: nenhum. */
+
+void RGBParaCinzaU8 (ImagemU8* in, ImagemU8* out)
+{
+    if (in->n_canais != 3)
+    {
+        printf ("ERRO: RGBParaCinzaU8: a imagem de origem precisa ter 3 canais.\n");
+        exit (1);
+    }
+
+    if (out->n_canais != 1)
+    {
+        printf ("ERRO: RGBParaCinzaU8: a imagem de destino precisa ter 1 canal.\n");
+        exit (1);
+    }
+
+    if (in->largura != out->largura || in->altura != out->altura)
+    {
+        printf ("ERRO: RGBParaCinzaU8: as imagens precisam ter o mesmo tamanho.\n");
+        exit (1);
+    }
+
+    int i, j;
+    for (i = 0; i < in->altura; i++)
+    {
+        unsigned char* r = in->dados [0][i];
+        unsigned char* g = in->dados [1][i];
+        unsigned char* b = in->dados [2][i];
+        unsigned char* cinza = out->dados [0][i];
+
+        for (j = 0; j < in->largura; j++)
+            cinza [j] = (unsigned char) ((r [j] * 19595 + g [j] * 38470 + b [j] * 7471 + 32768) >> 16);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Converte uma imagem de 8 bits de escala de cinza para RGB.
+ *
+ * Parmetros: ImagemU8* in: imagem de entrada de 1 canal.
+ *             ImagemU8* out: imagem de sada de 3 canais, com o mesmo tamanho.
+ *
+ * Valor de retorno: nenhum. */
+
+void cinzaParaRGBU8 (ImagemU8* in, ImagemU8* out)
+{
+    if (in->n_canais != 1)
+    {
+        printf ("ERRO: cinzaParaRGBU8: a imagem de origem precisa ter 1 canal.\n");
+        exit (1);
+    }
+
+    if (out->n_canais != 3)
+    {
+        printf ("ERRO: cinzaParaRGBU8: a imagem de destino precisa ter 3 canais.\n");
+        exit (1);
+    }
+
+    if (in->largura != out->largura || in->altura != out->altura)
+    {
+        printf ("ERRO: cinzaParaRGBU8: as imagens precisam ter o mesmo tamanho.\n");
+        exit (1);
+    }
+
+    int i, j;
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < in->altura; j++)
+            memcpy (out->dados [i][j], in->dados [0][j], in->largura);
+}
+
 /*----------------------------------------------------------------------------*/
 /** Converso RGB -> HSL. Simplesmente segui as frmulas.
  *
@@ -30,6 +30,8 @@ void RGBParaCinza (Imagem* in, Imagem* out);
 void cinzaParaRGB (Imagem* in, Imagem* out);
 void RGBParaHSL (Imagem* in, Imagem* out);
 void HSLParaRGB (Imagem* in, Imagem* out);
+void RGBParaCinzaU8 (ImagemU8* in, ImagemU8* out);
+void cinzaParaRGBU8 (ImagemU8* in, ImagemU8* out);
 
 /*============================================================================*/
 /* Transformaes de cores. */
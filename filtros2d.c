@@ -9,8 +9,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <string.h>
+#if defined (__AVX__) && defined (__FMA__)
+#include <immintrin.h>
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "base.h"
 #include "filtros2d.h"
+#include "grafo.h"
 
 /*============================================================================*/
 /* FILTRAGEM LINEAR GEN�RICA                                                  */
@@ -46,43 +55,109 @@ void filtro1D (Imagem* in, Imagem* out, float* coef, int n, int vertical)
     float soma;
     int centro = n/2;
 
-    // Para cada centro poss�vel...
-    for (channel = 0; channel < in->n_canais; channel++)
+    // Em vez de somar os coeficientes pixel por pixel, cada coeficiente é
+    // aplicado a uma linha inteira de uma vez (_filtro1DAcumula). A ordem das
+    // somas em cada pixel continua a mesma, então o resultado não muda.
+    if (vertical)
     {
+        // Linha por linha da saída, somando as linhas da entrada. O
+        // espelhamento nas margens só muda qual linha é usada.
+        for (channel = 0; channel < in->n_canais; channel++)
+            for (row = 0; row < in->altura; row++)
+            {
+                float* dest = out->dados [channel][row];
+                for (col = 0; col < in->largura; col++)
+                    dest [col] = 0;
+
+                for (i = -centro; i <= centro; i++)
+                {
+                    pos = row + i;
+                    if (pos < 0)
+                        pos = -pos;
+                    else if (pos >= in->altura)
+                        pos = in->altura*2 - pos - 2;
+
+                    _filtro1DAcumula (dest, in->dados [channel][pos], coef [centro + i], in->largura);
+                }
+            }
+        return;
+    }
+
+    // Na horizontal, as colunas do meio não precisam de espelhamento e são
+    // processadas de uma vez; só as das margens são tratadas uma a uma. A
+    // linha temporária permite que a saída seja a própria entrada.
+    int inicio_meio = MIN (centro, in->largura);
+    int fim_meio = MAX (in->largura - centro, inicio_meio);
+    float* linha = (float*) malloc (sizeof (float) * in->largura);
+
+    for (channel = 0; channel < in->n_canais; channel++)
         for (row = 0; row < in->altura; row++)
         {
+            float* orig = in->dados [channel][row];
+
+            for (col = inicio_meio; col < fim_meio; col++)
+                linha [col] = 0;
+            for (i = -centro; i <= centro; i++)
+                _filtro1DAcumula (linha + inicio_meio, orig + inicio_meio + i, coef [centro + i], fim_meio - inicio_meio);
+
+            // Margens, com imagem espelhada.
             for (col = 0; col < in->largura; col++)
             {
-                soma = 0;
+                if (col == inicio_meio)
+                    col = fim_meio;
+                if (col >= in->largura)
+                    break;
 
-                // Percorre o vetor de coeficientes.
+                soma = 0;
                 for (i = -centro; i <= centro; i++)
                 {
-                    // Tratamento de margens com imagem espelhada.
-                    pos = ((vertical)? row : col) + i;
-
+                    pos = col + i;
                     if (pos < 0)
                         pos = -pos;
-                    else if (!vertical && pos >= in->largura)
+                    else if (pos >= in->largura)
                         pos = in->largura*2 - pos - 2;
-                    else if (vertical && pos >= in->altura)
-                        pos = in->altura*2 - pos - 2;
 
-                    if (vertical)
-                        soma += in->dados [channel][pos][col] * coef [centro + i];
-                    else
-                        soma += in->dados [channel][row][pos] * coef [centro + i];
+                    soma += orig [pos] * coef [centro + i];
                 }
-
-                out->dados [channel][row][col] = soma;
+                linha [col] = soma;
             }
+
+            memcpy (out->dados [channel][row], linha, sizeof (float) * in->largura);
         }
+
+    free (linha);
+}
+
+// Soma src*coef a dest, em n posições. Com SSE2 (ou AVX e FMA), vários
+// pixels são calculados por vez.
+void _filtro1DAcumula (float* dest, float* src, float coef, int n)
+{
+    int i = 0;
+
+#if defined (__AVX__) && defined (__FMA__)
+    const __m256 c8 = _mm256_set1_ps (coef);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps (dest + i, _mm256_fmadd_ps (_mm256_loadu_ps (src + i), c8, _mm256_loadu_ps (dest + i)));
+#elif defined (__SSE2__)
+    const __m128 c4 = _mm_set1_ps (coef);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128 a = _mm_add_ps (_mm_loadu_ps (dest + i), _mm_mul_ps (_mm_loadu_ps (src + i), c4));
+        __m128 b = _mm_add_ps (_mm_loadu_ps (dest + i + 4), _mm_mul_ps (_mm_loadu_ps (src + i + 4), c4));
+        _mm_storeu_ps (dest + i, a);
+        _mm_storeu_ps (dest + i + 4, b);
     }
+#endif
+
+    for (; i < n; i++)
+        dest [i] += src [i] * coef;
 }
 
 /*----------------------------------------------------------------------------*/
-/** Filtragem espacial "for�a bruta", usando uma matriz de coeficientes. Use
- * para aplicar filtros 2D.
+/** Filtragem espacial usando uma matriz de coeficientes. Use para aplicar
+ * filtros 2D. Se a matriz for a soma de poucos produtos entre um vetor coluna
+ * e um vetor linha (ex: os filtros de Sobel), cada produto é aplicado como
+ * dois filtros 1D; senão, a matriz toda é aplicada em cada pixel.
  *
  * Par�metros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
  *               processa cada canal independentemente.
@@ -109,63 +184,321 @@ void filtro2D (Imagem* in, Imagem* out, float** coef, int altura, int largura, i
         exit (1);
     }
 
-    int channel, row, col, i, j, filter_row, filter_col;
-    float soma;
+    // Tenta decompor a matriz. Só vale a pena se os filtros 1D fizerem menos
+    // multiplicações que a matriz inteira. Matrizes de tamanho par ou
+    // transpostas não-quadradas não têm o mesmo centro nos filtros 1D.
+    int max_termos = (altura*largura - 1) / (altura + largura);
+    if (max_termos > 0 && altura % 2 && largura % 2 && (!transposta || altura == largura))
+    {
+        float* verticais = (float*) malloc (sizeof (float) * max_termos * altura);
+        float* horizontais = (float*) malloc (sizeof (float) * max_termos * largura);
+        int n_termos = _filtro2DDecompoe (coef, altura, largura, max_termos, verticais, horizontais);
+
+        if (n_termos)
+        {
+            // Na transposta, os vetores trocam de papel.
+            float* coef_v = (transposta)? horizontais : verticais;
+            float* coef_h = (transposta)? verticais : horizontais;
+
+            // Filtra na vertical e depois na horizontal, somando os termos.
+            Imagem* aux = criaImagem (in->largura, in->altura, in->n_canais);
+            int termo, channel, row;
+            for (termo = 0; termo < n_termos; termo++)
+            {
+                filtro1D (in, aux, coef_v + termo * altura, altura, 1);
+                if (termo == 0)
+                    filtro1D (aux, out, coef_h, largura, 0);
+                else
+                {
+                    filtro1D (aux, aux, coef_h + termo * largura, largura, 0);
+                    for (channel = 0; channel < in->n_canais; channel++)
+                        for (row = 0; row < in->altura; row++)
+                            _filtro1DAcumula (out->dados [channel][row], aux->dados [channel][row], 1.0f, in->largura);
+                }
+            }
+
+            destroiImagem (aux);
+            free (verticais);
+            free (horizontais);
+            return;
+        }
+
+        free (verticais);
+        free (horizontais);
+    }
+
     int centro_x = largura/2;
     int centro_y = altura/2;
 
-    // Para cada centro poss�vel...
-    for (channel = 0; channel < in->n_canais; channel++)
-    {
-        for (row = 0; row < in->altura; row++)
+    // Sem decomposição, aplica a matriz inteira, em blocos. Cada bloco da
+    // entrada é copiado, já com as margens (espelhadas quando saem da
+    // imagem), para um buffer contínuo e pequeno o bastante para ficar no
+    // cache. Assim, cada coeficiente corresponde a um deslocamento fixo no
+    // buffer e o laço interno não tem desvios.
+    int linhas_janela = (transposta)? largura : altura;
+    int colunas_janela = (transposta)? altura : largura;
+    int passo = MAX (FILTRO2D_BLOCO_PASSO, FILTRO2D_BLOCO_LARGURA + colunas_janela - 1);
+    float* bloco = (float*) malloc (sizeof (float) * (FILTRO2D_BLOCO_ALTURA + linhas_janela - 1) * passo);
+    int* colunas = (int*) malloc (sizeof (int) * passo);
+    int* deslocamentos = (int*) malloc (sizeof (int) * altura * largura);
+    float* pesos = (float*) malloc (sizeof (float) * altura * largura);
+
+    // Os coeficientes ficam na mesma ordem em que a matriz é percorrida.
+    int channel, row, col, i, j, pos, altura_bloco, largura_bloco;
+    for (i = 0; i < altura; i++)
+        for (j = 0; j < largura; j++)
         {
-            for (col = 0; col < in->largura; col++)
-            {
-                soma = 0;
+            deslocamentos [i*largura + j] = (transposta)? (j*passo + i) : (i*passo + j);
+            pesos [i*largura + j] = coef [i][j];
+        }
 
-                // Percorre a matriz de coeficientes.
-                for (i = 0; i < altura; i++)
-                    for (j = 0; j < largura; j++)
-                    {
-                        // Pega a linha e a coluna na imagem. Faz ratamento de margens com imagem espelhada.
-                        filter_row = row - centro_y + ((transposta)? j : i);
-                        filter_col = col - centro_x + ((transposta)? i : j);
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (row = 0; row < in->altura; row += FILTRO2D_BLOCO_ALTURA)
+            for (col = 0; col < in->largura; col += FILTRO2D_BLOCO_LARGURA)
+            {
+                altura_bloco = MIN (FILTRO2D_BLOCO_ALTURA, in->altura - row);
+                largura_bloco = MIN (FILTRO2D_BLOCO_LARGURA, in->largura - col);
 
-                        if (filter_row < 0)
-                            filter_row = -filter_row;
-                        else if (filter_row >= in->altura)
-                            filter_row = in->altura*2 - filter_row - 2;
+                // Copia o bloco, com tratamento de margens com imagem espelhada.
+                for (j = 0; j < largura_bloco + colunas_janela - 1; j++)
+                {
+                    pos = col - centro_x + j;
+                    if (pos < 0)
+                        pos = -pos;
+                    else if (pos >= in->largura)
+                        pos = in->largura*2 - pos - 2;
+                    colunas [j] = pos;
+                }
 
-                        if (filter_col < 0)
-                            filter_col = -filter_col;
-                        else if (filter_col >= in->largura)
-                            filter_col = in->largura*2 - filter_col - 2;
+                for (i = 0; i < altura_bloco + linhas_janela - 1; i++)
+                {
+                    pos = row - centro_y + i;
+                    if (pos < 0)
+                        pos = -pos;
+                    else if (pos >= in->altura)
+                        pos = in->altura*2 - pos - 2;
 
-                        soma += in->dados [channel][filter_row][filter_col] * coef [i][j];
+                    float* orig = in->dados [channel][pos];
+                    float* dest = bloco + i*passo;
+                    for (j = 0; j < largura_bloco + colunas_janela - 1; j++)
+                        dest [j] = orig [colunas [j]];
                 }
 
-                out->dados [channel][row][col] = soma;
+                // Filtra as linhas do bloco.
+                for (i = 0; i < altura_bloco; i++)
+                {
+                    float* dest = out->dados [channel][row + i] + col;
+                    float* orig = bloco + i*passo;
+                    if (altura == 3 && largura == 3)
+                        _filtro2DLinha3x3 (dest, orig, pesos, transposta, largura_bloco);
+                    else if (altura == 5 && largura == 5)
+                        _filtro2DLinha5x5 (dest, orig, pesos, transposta, largura_bloco);
+                    else if (altura == 7 && largura == 7)
+                        _filtro2DLinha7x7 (dest, orig, pesos, transposta, largura_bloco);
+                    else
+                        _filtro2DLinha (dest, orig, deslocamentos, pesos, altura*largura, largura_bloco);
+                }
             }
+
+    free (bloco);
+    free (colunas);
+    free (deslocamentos);
+    free (pesos);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Aplica os coeficientes da filtro2D a uma linha de um bloco. As matrizes
+ * 3x3, 5x5 e 7x7 têm versões em que o tamanho da matriz e o passo do bloco
+ * são fixos: o compilador desenrola o laço dos coeficientes e cada um vira
+ * uma leitura com deslocamento constante. As demais usam a versão genérica.
+ *
+ * Parâmetros: float* dest: saída, com n posições.
+ *             float* orig: posição, no bloco, do canto da janela do primeiro
+ *               pixel.
+ *             int* deslocamentos: posição de cada coeficiente no bloco,
+ *               relativa ao canto da janela.
+ *             float* pesos: coeficientes, na ordem em que a matriz é
+ *               percorrida.
+ *             int n_pesos: número de coeficientes.
+ *             int transposta: se != 0, a matriz é percorrida transposta
+ *               (só nas versões fixas; na genérica, já está nos
+ *               deslocamentos).
+ *             int n: número de pixels.
+ *
+ * Valor de retorno: nenhum. */
+
+/* Com SSE2, calcula 8 pixels por vez, em 2 registradores. Em todas as versões,
+ * a ordem das somas em cada pixel é a da matriz. */
+#ifdef __SSE2__
+#define _FILTRO2D_LINHA(N, DESLOCAMENTO) \
+    int x, t; \
+    for (x = 0; x + 8 <= n; x += 8) \
+    { \
+        __m128 a = _mm_setzero_ps (); \
+        __m128 b = _mm_setzero_ps (); \
+        _Pragma ("GCC unroll 49") \
+        for (t = 0; t < (N); t++) \
+        { \
+            __m128 p = _mm_set1_ps (pesos [t]); \
+            a = _mm_add_ps (a, _mm_mul_ps (_mm_loadu_ps (orig + (DESLOCAMENTO) + x), p)); \
+            b = _mm_add_ps (b, _mm_mul_ps (_mm_loadu_ps (orig + (DESLOCAMENTO) + x + 4), p)); \
+        } \
+        _mm_storeu_ps (dest + x, a); \
+        _mm_storeu_ps (dest + x + 4, b); \
+    } \
+    for (; x < n; x++) \
+    { \
+        float soma = 0; \
+        _Pragma ("GCC unroll 49") \
+        for (t = 0; t < (N); t++) \
+            soma += orig [(DESLOCAMENTO) + x] * pesos [t]; \
+        dest [x] = soma; \
+    }
+#else
+#define _FILTRO2D_LINHA(N, DESLOCAMENTO) \
+    int x, t; \
+    for (x = 0; x < n; x++) \
+    { \
+        float soma = 0; \
+        _Pragma ("GCC unroll 49") \
+        for (t = 0; t < (N); t++) \
+            soma += orig [(DESLOCAMENTO) + x] * pesos [t]; \
+        dest [x] = soma; \
+    }
+#endif
+
+/* Deslocamento do coeficiente t de uma matriz TxT nas versões fixas. */
+#define _FILTRO2D_DESLOCAMENTO(T, transposta) ((transposta)? ((t%(T))*FILTRO2D_BLOCO_PASSO + t/(T)) : ((t/(T))*FILTRO2D_BLOCO_PASSO + t%(T)))
+
+void _filtro2DLinha3x3 (float* dest, float* orig, float* pesos, int transposta, int n)
+{
+    if (transposta)
+    {
+        _FILTRO2D_LINHA (9, _FILTRO2D_DESLOCAMENTO (3, 1))
+    }
+    else
+    {
+        _FILTRO2D_LINHA (9, _FILTRO2D_DESLOCAMENTO (3, 0))
+    }
+}
+
+void _filtro2DLinha5x5 (float* dest, float* orig, float* pesos, int transposta, int n)
+{
+    if (transposta)
+    {
+        _FILTRO2D_LINHA (25, _FILTRO2D_DESLOCAMENTO (5, 1))
+    }
+    else
+    {
+        _FILTRO2D_LINHA (25, _FILTRO2D_DESLOCAMENTO (5, 0))
+    }
+}
+
+void _filtro2DLinha7x7 (float* dest, float* orig, float* pesos, int transposta, int n)
+{
+    if (transposta)
+    {
+        _FILTRO2D_LINHA (49, _FILTRO2D_DESLOCAMENTO (7, 1))
+    }
+    else
+    {
+        _FILTRO2D_LINHA (49, _FILTRO2D_DESLOCAMENTO (7, 0))
+    }
+}
+
+void _filtro2DLinha (float* dest, float* orig, int* deslocamentos, float* pesos, int n_pesos, int n)
+{
+    _FILTRO2D_LINHA (n_pesos, deslocamentos [t])
+}
+
+/*----------------------------------------------------------------------------*/
+/** Decompõe uma matriz de coeficientes em uma soma de produtos entre um vetor
+ * coluna e um vetor linha, por eliminação Gaussiana com pivoteamento total: a
+ * cada passo, a linha e a coluna do maior valor que sobrou formam um termo,
+ * que é subtraído da matriz. O número de termos é o posto da matriz.
+ *
+ * Parâmetros: float** coef: matriz de coeficientes.
+ *             int altura: altura da matriz.
+ *             int largura: largura da matriz.
+ *             int max_termos: número máximo de termos.
+ *             float* verticais: saída, com max_termos*altura posições. O
+ *               vetor coluna do termo t começa na posição t*altura.
+ *             float* horizontais: saída, com max_termos*largura posições. O
+ *               vetor linha do termo t começa na posição t*largura.
+ *
+ * Valor de retorno: o número de termos, ou 0 se a matriz não puder ser
+ *                   decomposta em até max_termos termos, com erro de no
+ *                   máximo FILTRO2D_TOLERANCIA. */
+
+int _filtro2DDecompoe (float** coef, int altura, int largura, int max_termos, float* verticais, float* horizontais)
+{
+    double* resto = (double*) malloc (sizeof (double) * altura * largura);
+    int i, j, termo, pivo_i, pivo_j;
+    double maior = 0, pivo;
+
+    for (i = 0; i < altura; i++)
+        for (j = 0; j < largura; j++)
+        {
+            resto [i*largura + j] = coef [i][j];
+            maior = MAX (maior, fabs (coef [i][j]));
+        }
+
+    for (termo = 0; ; termo++)
+    {
+        pivo_i = pivo_j = 0;
+        for (i = 0; i < altura; i++)
+            for (j = 0; j < largura; j++)
+                if (fabs (resto [i*largura + j]) > fabs (resto [pivo_i*largura + pivo_j]))
+                {
+                    pivo_i = i;
+                    pivo_j = j;
+                }
+
+        pivo = resto [pivo_i*largura + pivo_j];
+        if (fabs (pivo) <= FILTRO2D_TOLERANCIA * maior)
+            break; // O que sobrou é desprezível.
+
+        if (termo == max_termos)
+        {
+            termo = 0;
+            break;
         }
+
+        // A coluna do pivô é o vetor vertical, e a linha do pivô dividida pelo
+        // pivô é o vetor horizontal.
+        float* v = verticais + termo * altura;
+        float* h = horizontais + termo * largura;
+        for (i = 0; i < altura; i++)
+            v [i] = resto [i*largura + pivo_j];
+        for (j = 0; j < largura; j++)
+            h [j] = resto [pivo_i*largura + j] / pivo;
+
+        for (i = 0; i < altura; i++)
+            for (j = 0; j < largura; j++)
+                resto [i*largura + j] -= (double) v [i] * h [j];
     }
+
+    free (resto);
+    return (termo);
 }
 
 /*============================================================================*/
 /* FILTRO DA M�DIA                                                            */
 /*============================================================================*/
-/** Implementa��o de box blur usando uma imagem integral.
+/** Implementação de box blur usando somas correntes: cada linha é somada na
+ * horizontal, e a soma das linhas na janela vertical fica em uma única linha
+ * acumuladora (ver _filtroCaixa). Nas margens, a janela é cortada.
  *
- * Par�metros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
+ * Parâmetros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
  *               processa cada canal independentemente.
- *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
- *               imagem de entrada.
+ *             Imagem* out: imagem de saída. Deve ter o mesmo tamanho da
+ *               imagem de entrada. Pode ser a própria entrada.
  *             int altura: altura da janela.
  *             int largura: largura da janela.
- *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
- *               entrada. Pode ser usada quando se quer evitar a aloca��o do
- *               buffer interno. Use NULL se quiser usar o buffer interno.
+ *             Imagem* buffer: não é mais usado, pois a imagem integral não é
+ *               criada. Use NULL.
  *
- * Valor de retorno: nenhum (usa a imagem de sa�da). */
+ * Valor de retorno: nenhum (usa a imagem de saída). */
 
 void blur (Imagem* in, Imagem* out, int altura, int largura, Imagem* buffer)
 {
@@ -188,52 +521,253 @@ void blur (Imagem* in, Imagem* out, int altura, int largura, Imagem* buffer)
         return;
     }
 
-    // Primeiro calcula a imagem integral.
-    Imagem* integral = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+    _filtroCaixa (in, out, altura, largura, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Somas em janelas altura x largura, usadas pela blur e pela
+ * filtroMedianaBinario, sem imagem integral. Cada linha da entrada é somada
+ * na horizontal com uma soma corrente, e o acumulador guarda, para cada
+ * coluna, a soma das linhas na janela vertical: a cada linha da saída, entra
+ * a soma da linha de baixo e sai a da linha de cima, recalculada a partir da
+ * entrada. As somas são em double, para não perder precisão em imagens
+ * grandes. Nas margens, a janela é cortada.
+ *
+ * Parâmetros: Imagem* in: imagem de entrada.
+ *             Imagem* out: imagem de saída. Pode ser a própria entrada.
+ *             int altura: altura da janela (ímpar).
+ *             int largura: largura da janela (ímpar).
+ *             int binario: se 0, a saída é a média na janela; senão, é 1
+ *               onde a soma for maior que a metade da área da janela, e 0
+ *               nos outros pixels.
+ *
+ * Valor de retorno: nenhum. */
+
+void _filtroCaixa (Imagem* in, Imagem* out, int altura, int largura, int binario)
+{
+    int w = largura/2, h = altura/2;
+    int channel, row, col, r;
+    float metade = (largura*altura)/2.0f;
+
+    double* acumulador = (double*) malloc (sizeof (double) * in->largura);
+    double* somas = (double*) malloc (sizeof (double) * in->largura);
+
+    // Se a saída for a entrada, cada linha é guardada antes de ser
+    // sobrescrita, até sair da janela.
+    float* guardadas = (in == out)? (float*) malloc (sizeof (float) * in->largura * (h+1)) : NULL;
 
-    int channel, row, col;
     for (channel = 0; channel < in->n_canais; channel++)
     {
-        // Soma em linhas.
+        for (col = 0; col < in->largura; col++)
+            acumulador [col] = 0;
+        for (r = 0; r < MIN (h, in->altura); r++)
+        {
+            _filtroCaixaLinha (in->dados [channel][r], somas, in->largura, w);
+            for (col = 0; col < in->largura; col++)
+                acumulador [col] += somas [col];
+        }
+
         for (row = 0; row < in->altura; row++)
         {
-            integral->dados [channel][row][0] = in->dados [channel][row][0];
+            // Entra a linha de baixo, sai a de cima.
+            if (row + h < in->altura)
+            {
+                _filtroCaixaLinha (in->dados [channel][row + h], somas, in->largura, w);
+                for (col = 0; col < in->largura; col++)
+                    acumulador [col] += somas [col];
+            }
 
-            for (col = 1; col < in->largura; col++)
-                integral->dados [channel][row][col] = in->dados [channel][row][col] + integral->dados [channel][row][col-1];
+            if (row - h - 1 >= 0)
+            {
+                float* saiu = (guardadas)? guardadas + (row % (h+1)) * in->largura : in->dados [channel][row - h - 1];
+                _filtroCaixaLinha (saiu, somas, in->largura, w);
+                for (col = 0; col < in->largura; col++)
+                    acumulador [col] -= somas [col];
+            }
+
+            if (guardadas)
+                memcpy (guardadas + (row % (h+1)) * in->largura, in->dados [channel][row], sizeof (float) * in->largura);
+
+            float* dest = out->dados [channel][row];
+            if (binario)
+            {
+                for (col = 0; col < in->largura; col++)
+                    dest [col] = (acumulador [col] > metade)? 1.0f : 0; // A maior parte dos pixels é branca.
+            }
+            else
+            {
+                int n_linhas = MIN (in->altura-1, row + h) - MAX (0, row - h) + 1;
+                for (col = 0; col < in->largura; col++)
+                {
+                    int n_colunas = MIN (in->largura-1, col + w) - MAX (0, col - w) + 1;
+                    dest [col] = (float) (acumulador [col] / (n_colunas * n_linhas));
+                }
+            }
         }
+    }
 
-        // Agora soma na vertical.
-        for (row = 1; row < in->altura; row++)
-            for (col = 0; col < in->largura; col++)
-                integral->dados [channel][row][col] += integral->dados [channel][row-1][col];
+    free (acumulador);
+    free (somas);
+    if (guardadas)
+        free (guardadas);
+}
+
+// Função auxiliar da _filtroCaixa: somas de uma linha em janelas com largura w*2+1, cortadas nas margens.
+void _filtroCaixaLinha (float* in, double* somas, int n, int w)
+{
+    int col;
+    double soma = 0;
+
+    for (col = 0; col < MIN (w, n); col++)
+        soma += in [col];
+
+    // Primeiro só entram pixels, depois entram e saem, e no fim só saem.
+    for (col = 0; col < MIN (w+1, n); col++)
+    {
+        if (col + w < n)
+            soma += in [col + w];
+        somas [col] = soma;
     }
+    for (; col < n - w; col++)
+    {
+        soma += (double) in [col + w] - in [col - w - 1];
+        somas [col] = soma;
+    }
+    for (; col < n; col++)
+    {
+        soma -= in [col - w - 1];
+        somas [col] = soma;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Versão do box blur para imagens de 8 bits. As somas são inteiras, então o
+ * resultado é exato (a média é arredondada).
+ *
+ * Parâmetros: os mesmos da versão com floats, sem o buffer. */
+
+void blurU8 (ImagemU8* in, ImagemU8* out, int altura, int largura)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: blurU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    if (altura % 2 == 0 || largura % 2 == 0)
+    {
+        printf ("ERRO: blurU8: a janela deve ter largura e altura impares.\n");
+        exit (1);
+    }
+
+    _filtroCaixaU8 (in, out, altura, largura, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Versão da _filtroCaixa para imagens de 8 bits, com somas inteiras. No modo
+ * binário, conta os pixels brancos (> 127) e a saída é 255 ou 0.
+ *
+ * Parâmetros: os mesmos da versão com floats.
+ *
+ * Valor de retorno: nenhum. */
+
+void _filtroCaixaU8 (ImagemU8* in, ImagemU8* out, int altura, int largura, int binario)
+{
+    int w = largura/2, h = altura/2;
+    int channel, row, col, r;
+    int metade = (largura*altura)/2; // A área é ímpar: soma > metade é o mesmo que soma > área/2.
+
+    int* acumulador = (int*) malloc (sizeof (int) * in->largura);
+    int* somas = (int*) malloc (sizeof (int) * in->largura);
+    unsigned char* guardadas = (in == out)? (unsigned char*) malloc (in->largura * (h+1)) : NULL;
 
-    // Agora calcula as m�dias.
-    int top, left, bottom, right;
-    float soma, area;
     for (channel = 0; channel < in->n_canais; channel++)
-        for (row = 0; row < in->altura; row++)
+    {
+        for (col = 0; col < in->largura; col++)
+            acumulador [col] = 0;
+        for (r = 0; r < MIN (h, in->altura); r++)
+        {
+            _filtroCaixaLinhaU8 (in->dados [channel][r], somas, in->largura, w, binario);
             for (col = 0; col < in->largura; col++)
+                acumulador [col] += somas [col];
+        }
+
+        for (row = 0; row < in->altura; row++)
+        {
+            if (row + h < in->altura)
             {
-                top = MAX (-1, row-altura/2-1);
-                left = MAX (-1, col-largura/2-1);
-                bottom = MIN (in->altura-1, row+altura/2);
-                right = MIN (in->largura-1, col+largura/2);
-
-                soma = ((top >= 0 && left >= 0)? integral->dados [channel][top][left] : 0) +
-                        integral->dados [channel][bottom][right] -
-                        ((left >= 0)? integral->dados [channel][bottom][left] : 0) -
-                        ((top >= 0)? integral->dados [channel][top][right] : 0);
-
-                area = (right-left)*(bottom-top);
-                out->dados [channel][row][col] = soma/area;
+                _filtroCaixaLinhaU8 (in->dados [channel][row + h], somas, in->largura, w, binario);
+                for (col = 0; col < in->largura; col++)
+                    acumulador [col] += somas [col];
             }
 
-    if (!buffer)
-        destroiImagem (integral);
+            if (row - h - 1 >= 0)
+            {
+                unsigned char* saiu = (guardadas)? guardadas + (row % (h+1)) * in->largura : in->dados [channel][row - h - 1];
+                _filtroCaixaLinhaU8 (saiu, somas, in->largura, w, binario);
+                for (col = 0; col < in->largura; col++)
+                    acumulador [col] -= somas [col];
+            }
+
+            if (guardadas)
+                memcpy (guardadas + (row % (h+1)) * in->largura, in->dados [channel][row], in->largura);
+
+            unsigned char* dest = out->dados [channel][row];
+            if (binario)
+            {
+                for (col = 0; col < in->largura; col++)
+                    dest [col] = (acumulador [col] > metade)? 255 : 0;
+            }
+            else
+            {
+                int n_linhas = MIN (in->altura-1, row + h) - MAX (0, row - h) + 1;
+                for (col = 0; col < in->largura; col++)
+                {
+                    int area = (MIN (in->largura-1, col + w) - MAX (0, col - w) + 1) * n_linhas;
+                    dest [col] = (acumulador [col] + area/2) / area;
+                }
+            }
+        }
+    }
+
+    free (acumulador);
+    free (somas);
+    if (guardadas)
+        free (guardadas);
+}
+
+// Função auxiliar da _filtroCaixaU8. No modo binário, soma 1 para cada pixel branco.
+void _filtroCaixaLinhaU8 (unsigned char* in, int* somas, int n, int w, int binario)
+{
+    int col, soma = 0;
+
+    // O modo binário conta os pixels > 127, como 0 ou 1.
+    int limiar = (binario)? 127 : -1;
+#define _FILTRO_CAIXA_U8(v) ((binario)? ((v) > limiar) : (v))
+
+    for (col = 0; col < MIN (w, n); col++)
+        soma += _FILTRO_CAIXA_U8 (in [col]);
+
+    for (col = 0; col < MIN (w+1, n); col++)
+    {
+        if (col + w < n)
+            soma += _FILTRO_CAIXA_U8 (in [col + w]);
+        somas [col] = soma;
+    }
+    for (; col < n - w; col++)
+    {
+        soma += _FILTRO_CAIXA_U8 (in [col + w]) - _FILTRO_CAIXA_U8 (in [col - w - 1]);
+        somas [col] = soma;
+    }
+    for (; col < n; col++)
+    {
+        soma -= _FILTRO_CAIXA_U8 (in [col - w - 1]);
+        somas [col] = soma;
+    }
+#undef _FILTRO_CAIXA_U8
 }
 
+
 /*============================================================================*/
 /* FILTRO GAUSSIANO                                                           */
 /*============================================================================*/
@@ -245,6 +779,12 @@ void blur (Imagem* in, Imagem* out, int altura, int largura, Imagem* buffer)
  * aproxima��o 3x3 com sigma=0.8; 5x5 com sigma=1.1; e 7x7 com sigma=1.4,
  * respectivamente.
  *
+ * A partir de FILTRO_GAUSSIANO_SIGMA_RECURSIVO, o sigma daquela direção é
+ * aplicado pelo filtro recursivo (_filtroGaussianoRecursivo), com custo
+ * constante por pixel. O resultado é uma aproximação da Gaussiana completa,
+ * com o sigma exato e erro de cerca de 1% do pico em cada direção (2% em
+ * 2-D) para qualquer sigma, em vez da Gaussiana truncada em 2 sigmas.
+ *
  * Par�metros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
  *               processa cada canal independentemente.
  *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
@@ -309,53 +849,304 @@ void _filtroGaussianoCalculaCoef (int largura, float sigma, float* coef)
         coef [i] *= total;
 }
 
-// Micro-fun��o que retorna o n�mero de coeficientes para um dado sigma.
-int _filtroGaussianoNCoef (float sigma)
-{
-    // Primeiro, os valores especiais.
-    if (sigma == -3)
-        return (3);
+// Micro-fun��o que retorna o n�mero de coeficientes para um dado sigma.
+int _filtroGaussianoNCoef (float sigma)
+{
+    // Primeiro, os valores especiais.
+    if (sigma == -3)
+        return (3);
+
+    if (sigma == -5)
+        return (5);
+
+    if (sigma == -7)
+        return (7);
+
+    int n = (int) (sigma*4.0f + 0.5f);
+    n |= 1; // Precisa ser �mpar.
+    return (n);
+}
+
+void filtroGaussiano (Imagem* in, Imagem* out, float sigmax, float sigmay, Imagem* buffer)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais ||
+        (buffer && (in->largura != buffer->largura || in->altura != buffer->altura || in->n_canais != buffer->n_canais)))
+    {
+        printf ("ERRO: filtroGaussiano: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    Imagem* img_aux = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+
+    // Calcula o tamanho da matriz de coeficientes.
+    int largura = _filtroGaussianoNCoef (sigmax);
+    int altura = _filtroGaussianoNCoef (sigmay);
+
+    float* coef = malloc (sizeof (float) * MAX (largura, altura));
+
+    // Filtra na horizontal.
+    if (sigmax >= FILTRO_GAUSSIANO_SIGMA_RECURSIVO)
+        _filtroGaussianoRecursivo (in, img_aux, sigmax, 0);
+    else
+    {
+        _filtroGaussianoCalculaCoef (largura, sigmax, coef);
+        filtro1D (in, img_aux, coef, largura, 0);
+    }
+
+    // Agora na vertical.
+    if (sigmay >= FILTRO_GAUSSIANO_SIGMA_RECURSIVO)
+        _filtroGaussianoRecursivo (img_aux, out, sigmay, 1);
+    else
+    {
+        if (sigmax != sigmay)
+            _filtroGaussianoCalculaCoef (altura, sigmay, coef);
+        filtro1D (img_aux, out, coef, altura, 1);
+    }
+
+    free (coef);
+    if (!buffer)
+        destroiImagem (img_aux);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Filtro Gaussiano recursivo (Young, van Vliet e van Ginkel, 2002) em uma
+ * direção. Cada pixel passa por um filtro causal e um anticausal de 3a
+ * ordem, então o custo não depende do sigma. As margens são espelhadas, como na filtro1D,
+ * até 4 sigmas (ou o tamanho da imagem); depois disso, a imagem é estendida
+ * com o último valor, e o estado inicial do filtro anticausal é o exato para
+ * essa extensão (Triggs e Sdika, 2006). O resultado é uma aproximação da
+ * Gaussiana sem truncamento, então não é idêntico ao da filtro1D.
+ *
+ * Parâmetros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
+ *               processa cada canal independentemente.
+ *             Imagem* out: imagem de saída. Deve ter o mesmo tamanho da
+ *               imagem de entrada, e não pode ser a própria entrada.
+ *             float sigma: desvio padrão. Deve ser pelo menos 0.5.
+ *             int vertical: se != 0, filtra na vertical.
+ *
+ * Valor de retorno: nenhum. */
+
+void _filtroGaussianoRecursivo (Imagem* in, Imagem* out, float sigma, int vertical)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais || in == out)
+    {
+        printf ("ERRO: _filtroGaussianoRecursivo: as imagens precisam ter o mesmo tamanho e numero de canais, e ser diferentes.\n");
+        exit (1);
+    }
+
+    if (sigma < 0.5f)
+    {
+        printf ("ERRO: _filtroGaussianoRecursivo: sigma deve ser pelo menos 0.5.\n");
+        exit (1);
+    }
+
+    double coef [4];
+    double m [3][3];
+    _filtroGaussianoRecursivoCoef (sigma, coef, m);
+
+    int n = (vertical)? in->altura : in->largura;
+    int margem = MIN (n-1, (int) ceilf (sigma*4));
+    int fim = n + margem - 1; // Última posição filtrada, contando a margem.
+    int channel, row, col, i, k, pos;
+
+    if (!vertical)
+    {
+        // Cada linha vai para um buffer com as margens, e os dois filtros
+        // são aplicados nele.
+        double* x = (double*) malloc (sizeof (double) * (n + margem*2));
+        double* w = (double*) malloc (sizeof (double) * (n + margem*2));
+        x += margem;
+        w += margem;
+
+        for (channel = 0; channel < in->n_canais; channel++)
+            for (row = 0; row < in->altura; row++)
+            {
+                float* orig = in->dados [channel][row];
+                for (i = -margem; i <= fim; i++)
+                {
+                    pos = (i < 0)? -i : ((i >= n)? n*2 - i - 2 : i);
+                    x [i] = orig [pos];
+                }
+
+                // Causal. Antes da margem, a imagem é constante, e a saída
+                // do filtro é igual à entrada.
+                double w1 = x [-margem], w2 = w1, w3 = w1;
+                for (i = -margem; i <= fim; i++)
+                {
+                    w [i] = coef [0]*x [i] + coef [1]*w1 + coef [2]*w2 + coef [3]*w3;
+                    w3 = w2;
+                    w2 = w1;
+                    w1 = w [i];
+                }
+
+                // Anticausal, a partir do estado exato para a extensão.
+                double u = x [fim];
+                double d0 = w [fim] - u;
+                double d1 = w [MAX (fim-1, -margem)] - u;
+                double d2 = w [MAX (fim-2, -margem)] - u;
+                double y1 = u + m [0][0]*d0 + m [0][1]*d1 + m [0][2]*d2;
+                double y2 = u + m [1][0]*d0 + m [1][1]*d1 + m [1][2]*d2;
+                double y3 = u + m [2][0]*d0 + m [2][1]*d1 + m [2][2]*d2;
+
+                float* dest = out->dados [channel][row];
+                for (i = fim; i >= 0; i--)
+                {
+                    double y = coef [0]*w [i] + coef [1]*y1 + coef [2]*y2 + coef [3]*y3;
+                    y3 = y2;
+                    y2 = y1;
+                    y1 = y;
+                    if (i < n)
+                        dest [i] = (float) y;
+                }
+            }
+
+        free (x - margem);
+        free (w - margem);
+        return;
+    }
+
+    // Na vertical, a imagem é dividida em faixas de colunas, e cada passo dos
+    // filtros é feito em uma linha inteira da faixa. A faixa toda, com as
+    // margens, fica em um buffer com precisão dupla: com sigmas grandes, os
+    // filtros acumulam erros demais em float.
+    int largura = FILTRO_GAUSSIANO_FAIXA;
+    double* buffer = (double*) malloc (sizeof (double) * largura * (n + margem*2 + 6));
+    double* w = buffer + (margem + 3) * largura; // Linha 0.
+    int inicio, fim_faixa;
+
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (inicio = 0; inicio < in->largura; inicio += largura)
+        {
+            fim_faixa = MIN (inicio + largura, in->largura);
+
+            // Causal. Antes da margem de cima, a saída é igual à entrada.
+            float* orig = in->dados [channel][margem];
+            for (k = 1; k <= 3; k++)
+                for (col = inicio; col < fim_faixa; col++)
+                    w [(-margem-k)*largura + col-inicio] = orig [col];
 
-    if (sigma == -5)
-        return (5);
+            for (i = -margem; i <= fim; i++)
+            {
+                pos = (i < 0)? -i : ((i >= n)? n*2 - i - 2 : i);
+                orig = in->dados [channel][pos] + inicio;
+                double* dest = w + i*largura;
+                for (col = 0; col < fim_faixa - inicio; col++)
+                    dest [col] = coef [0]*orig [col] + coef [1]*dest [col-largura] + coef [2]*dest [col-largura*2] + coef [3]*dest [col-largura*3];
+            }
 
-    if (sigma == -7)
-        return (7);
+            // Anticausal, a partir do estado exato para a extensão.
+            pos = (fim >= n)? n*2 - fim - 2 : fim;
+            orig = in->dados [channel][pos] + inicio;
+            for (col = 0; col < fim_faixa - inicio; col++)
+            {
+                double u = orig [col];
+                double d0 = w [fim*largura + col] - u;
+                double d1 = w [(fim-1)*largura + col] - u;
+                double d2 = w [(fim-2)*largura + col] - u;
+                for (k = 0; k < 3; k++)
+                    w [(fim+1+k)*largura + col] = u + m [k][0]*d0 + m [k][1]*d1 + m [k][2]*d2;
+            }
 
-    int n = (int) (sigma*4.0f + 0.5f);
-    n |= 1; // Precisa ser �mpar.
-    return (n);
+            for (i = fim; i >= 0; i--)
+            {
+                double* dest = w + i*largura;
+                for (col = 0; col < fim_faixa - inicio; col++)
+                    dest [col] = coef [0]*dest [col] + coef [1]*dest [col+largura] + coef [2]*dest [col+largura*2] + coef [3]*dest [col+largura*3];
+            }
+
+            for (row = 0; row < n; row++)
+                for (col = inicio; col < fim_faixa; col++)
+                    out->dados [channel][row][col] = (float) w [row*largura + col-inicio];
+        }
+
+    free (buffer);
 }
 
-void filtroGaussiano (Imagem* in, Imagem* out, float sigmax, float sigmay, Imagem* buffer)
+/*----------------------------------------------------------------------------*/
+/** Calcula os coeficientes do filtro Gaussiano recursivo e a matriz do estado
+ * inicial do filtro anticausal.
+ *
+ * Parâmetros: float sigma: desvio padrão.
+ *             double* coef: saída, com 4 posições: o peso da entrada e os
+ *               pesos das 3 saídas anteriores.
+ *             double m [3][3]: saída. Com d = (w [fim] - u, w [fim-1] - u,
+ *               w [fim-2] - u), onde w é a saída do filtro causal e u é o
+ *               último valor da entrada, a saída do anticausal nas posições
+ *               fim+1, fim+2 e fim+3 é u + m*d.
+ *
+ * Valor de retorno: nenhum. */
+
+void _filtroGaussianoRecursivoCoef (float sigma, double* coef, double m [3][3])
 {
-    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais ||
-        (buffer && (in->largura != buffer->largura || in->altura != buffer->altura || in->n_canais != buffer->n_canais)))
+    // Young, van Vliet e van Ginkel, 2002. Os polos do filtro para sigma = 2
+    // são 1.86543 e 1.41650 +- 1.00829i; para outro sigma, cada polo d vira
+    // d^(1/q), com q escolhido para que a variância do filtro seja sigma^2.
+    // As fórmulas de 1995, com um polinômio em q de coeficientes
+    // arredondados, se afastam da Gaussiana com sigmas grandes (com sigma =
+    // 300, o sigma efetivo era 195).
+    double raio = sqrt (1.41650*1.41650 + 1.00829*1.00829);
+    double angulo = atan2 (1.00829, 1.41650);
+    double real, r, t, dr, di, mod2;
+    int iteracao;
+
+    // A partir de q = 0.35 (sigma 0.29), a variância cresce com q, e q = sigma
+    // já dá o dobro do sigma desejado; q é achado por bisseção.
+    double q_min = 0.35, q_max = MAX (sigma, 1.0), q = q_max;
+    for (iteracao = 0; iteracao < 64; iteracao++)
     {
-        printf ("ERRO: filtroGaussiano: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
-        exit (1);
+        q = (q_min + q_max) / 2;
+        real = pow (1.86543, 1/q);
+        r = pow (raio, 1/q);
+        t = angulo / q;
+        dr = r*cos (t) - 1;
+        di = r*sin (t);
+        mod2 = dr*dr + di*di;
+
+        // 2d/(d-1)^2 para o polo real e para o par complexo.
+        double variancia = 2*real / ((real-1)*(real-1)) +
+                           4*(r*cos (t)*(dr*dr - di*di) + r*sin (t)*2*dr*di) / (mod2*mod2);
+        if (variancia < (double) sigma*sigma)
+            q_min = q;
+        else
+            q_max = q;
     }
 
-    Imagem* img_aux = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
-
-    // Calcula o tamanho da matriz de coeficientes.
-    int largura = _filtroGaussianoNCoef (sigmax);
-    int altura = _filtroGaussianoNCoef (sigmay);
+    real = pow (1.86543, 1/q);
+    r = pow (raio, 1/q);
+    t = angulo / q;
+
+    // (1 - w/real)(1 - 2cos(t)/r w + w^2/r^2) = 1 - c1 w - c2 w^2 - c3 w^3.
+    double u = 1/real, a = 2*cos (t)/r, b = 1/(r*r);
+    coef [1] = a + u;
+    coef [2] = -(b + u*a);
+    coef [3] = u*b;
+    coef [0] = 1 - coef [1] - coef [2] - coef [3];
+
+    // A matriz é obtida simulando os filtros depois do fim: com a entrada
+    // constante, o desvio d do filtro causal decai sozinho, e o anticausal é
+    // aplicado a ele de trás para frente, partindo de 0 bem longe do fim.
+    int n = (int) (sigma*10) + 100;
+    double* d = (double*) malloc (sizeof (double) * (n+3));
+    double* e = (double*) malloc (sizeof (double) * (n+6));
+    int i, j;
 
-    float* coef = malloc (sizeof (float) * MAX (largura, altura));
+    for (j = 0; j < 3; j++)
+    {
+        d [0] = d [1] = d [2] = 0;
+        d [2-j] = 1;
+        for (i = 3; i < n+3; i++)
+            d [i] = coef [1]*d [i-1] + coef [2]*d [i-2] + coef [3]*d [i-3];
 
-    // Filtra na horizontal.
-    _filtroGaussianoCalculaCoef (largura, sigmax, coef);
-    filtro1D (in, img_aux, coef, largura, 0);
+        e [n+3] = e [n+4] = e [n+5] = 0;
+        for (i = n+2; i >= 3; i--)
+            e [i] = coef [0]*d [i] + coef [1]*e [i+1] + coef [2]*e [i+2] + coef [3]*e [i+3];
 
-    // Agora na vertical.
-    if (sigmax != sigmay)
-        _filtroGaussianoCalculaCoef (altura, sigmay, coef);
-    filtro1D (img_aux, out, coef, altura, 1);
+        for (i = 0; i < 3; i++)
+            m [i][j] = e [3+i];
+    }
 
-    free (coef);
-    if (!buffer)
-        destroiImagem (img_aux);
+    free (d);
+    free (e);
 }
 
 /*============================================================================*/
@@ -373,9 +1164,11 @@ void filtroGaussiano (Imagem* in, Imagem* out, float sigmax, float sigmay, Image
  *             float threshold: altera apenas regi�es onde a diferen�a � grande.
  *             float mult: multiplica as diferen�as por este valor. Valores
  *               mais altos implicam em bordas mais destacadas.
- *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
- *               entrada. Pode ser usada quando se quer evitar a aloca��o do
- *               buffer interno. Use NULL se quiser usar o buffer interno.
+ *             Imagem* buffer: só é usado quando sigma >=
+ *               FILTRO_GAUSSIANO_SIGMA_RECURSIVO, para guardar a imagem
+ *               borrada; nos outros casos, as imagens intermediárias não são
+ *               criadas. Se for usado, deve ter o mesmo tamanho da imagem de
+ *               entrada. Use NULL se quiser usar o buffer interno.
  *
  * Valor de retorno: nenhum. */
 
@@ -388,21 +1181,32 @@ void unsharpMasking (Imagem* in, Imagem* out, float sigma, float threshold, floa
         exit (1);
     }
 
-    // Come�a borrando a imagem...
-    filtroGaussiano (in, out, sigma, sigma, buffer);
-
-    // Verifica a diferen�a da imagem original para a borrada.
-    soma (in, out, 1, -1, out);
-
-    // Agora percorre a imagem e procura lugares com diferen�a grande. Real�a a imagem nestes locais.
-    int channel, row, col;
-    for (channel = 0; channel < in->n_canais; channel++)
-        for (row = 0; row < in->altura; row++)
-            for (col = 0; col < in->largura; col++)
-                if (out->dados [channel][row][col] > threshold)
-                    out->dados [channel][row][col] = in->dados [channel][row][col] + mult*out->dados [channel][row][col];
-                else
-                    out->dados [channel][row][col] = in->dados [channel][row][col];
+    // Borra a imagem, verifica a diferença da imagem original para a borrada
+    // e realça a imagem onde a diferença for grande. Tudo em um grafo, sem
+    // imagens intermediárias.
+    GrafoImagens* grafo = criaGrafo ();
+    int original = grafoEntrada (grafo, in);
+    int borrada;
+    Imagem* img_borrada = NULL;
+
+    // Com sigmas grandes, a imagem borrada é calculada antes, pelo filtro
+    // recursivo, que não pode ser calculado linha por linha.
+    if (sigma >= FILTRO_GAUSSIANO_SIGMA_RECURSIVO)
+    {
+        img_borrada = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+        filtroGaussiano (in, img_borrada, sigma, sigma, NULL);
+        borrada = grafoEntrada (grafo, img_borrada);
+    }
+    else
+        borrada = grafoGaussiano (grafo, original, sigma, sigma);
+    int diferenca = grafoSoma (grafo, original, borrada, 1, -1);
+    int realcada = grafoSoma (grafo, original, diferenca, 1, mult);
+    int resultado = grafoSeleciona (grafo, diferenca, threshold, realcada, original);
+
+    executaGrafo (grafo, resultado, out);
+    destroiGrafo (grafo);
+    if (img_borrada && !buffer)
+        destroiImagem (img_borrada);
 }
 
 /*============================================================================*/
@@ -534,20 +1338,18 @@ void filtroMediana8bpp (Imagem* in, Imagem* out, int altura, int largura)
 }
 
 /*----------------------------------------------------------------------------*/
-/** Filtro da mediana para imagens bin�rias - implementa��o r�pida com imagem
- * integral. Basta somar os valore em cada vizinhan�a e verificar se a soma
- * � maior do que a metade da �rea da vizinhan�a. O c�digo � *muito* parecido
- * com o do box blur.
+/** Filtro da mediana para imagens binárias. Basta somar os valores em cada
+ * vizinhança e verificar se a soma é maior do que a metade da área da
+ * vizinhança. As somas são as mesmas do box blur (ver _filtroCaixa).
  *
- * Par�metros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
+ * Parâmetros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
  *               processa cada canal independentemente.
- *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
- *               imagem de entrada.
+ *             Imagem* out: imagem de saída. Deve ter o mesmo tamanho da
+ *               imagem de entrada. Pode ser a própria entrada.
  *             int altura: altura da janela.
  *             int largura: largura da janela.
- *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
- *               entrada. Pode ser usada quando se quer evitar a aloca��o do
- *               buffer interno. Use NULL se quiser usar o buffer interno.
+ *             Imagem* buffer: não é mais usado, pois a imagem integral não é
+ *               criada. Use NULL.
  *
  * Valor de retorno: nenhum */
 
@@ -572,55 +1374,33 @@ void filtroMedianaBinario (Imagem* in, Imagem* out, int altura, int largura, Ima
         return;
     }
 
-    // Primeiro calcula a imagem integral.
-    Imagem* integral = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
-
-    int channel, row, col;
-    for (channel = 0; channel < in->n_canais; channel++)
-    {
-        // Soma em linhas.
-        for (row = 0; row < in->altura; row++)
-        {
-            integral->dados [channel][row][0] = in->dados [channel][row][0];
+    _filtroCaixa (in, out, altura, largura, 1);
+}
 
-            for (col = 1; col < in->largura; col++)
-                integral->dados [channel][row][col] = in->dados [channel][row][col] + integral->dados [channel][row][col-1];
-        }
+/*----------------------------------------------------------------------------*/
+/** Versão do filtro da mediana binário para imagens de 8 bits (0 e 255). Um
+ * pixel é considerado branco se for > 127, como na morfologia.
+ *
+ * Parâmetros: os mesmos da versão com floats, sem o buffer. */
 
-        // Agora soma na vertical.
-        for (row = 1; row < in->altura; row++)
-            for (col = 0; col < in->largura; col++)
-                integral->dados [channel][row][col] += integral->dados [channel][row-1][col];
+void filtroMedianaBinarioU8 (ImagemU8* in, ImagemU8* out, int altura, int largura)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: filtroMedianaBinarioU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
     }
 
-    // Agora verifica onde a soma � maior do que a metade da �rea.
-    int top, left, bottom, right;
-    float soma, area = (largura*altura)/2.0f;
-
-    for (channel = 0; channel < in->n_canais; channel++)
-        for (row = 0; row < in->altura; row++)
-            for (col = 0; col < in->largura; col++)
-            {
-                top = MAX (-1, row-altura/2-1);
-                left = MAX (-1, col-largura/2-1);
-                bottom = MIN (in->altura-1, row+altura/2);
-                right = MIN (in->largura-1, col+largura/2);
-
-                soma = ((top >= 0 && left >= 0)? integral->dados [channel][top][left] : 0) +
-                        integral->dados [channel][bottom][right] -
-                        ((left >= 0)? integral->dados [channel][bottom][left] : 0) -
-                        ((top >= 0)? integral->dados [channel][top][right] : 0);
-
-                if (soma > area) // A maior parte dos pixels � branca.
-                    out->dados [channel][row][col] = 1.0f;
-                else
-                    out->dados [channel][row][col] = 0;
-            }
+    if (altura % 2 == 0 || largura % 2 == 0)
+    {
+        printf ("ERRO: filtroMedianaBinarioU8: a janela deve ter largura e altura impares.\n");
+        exit (1);
+    }
 
-    if (!buffer)
-        destroiImagem (integral);
+    _filtroCaixaU8 (in, out, altura, largura, 1);
 }
 
+
 /*============================================================================*/
 /* M�XIMOS E M�NIMOS LOCAIS                                                   */
 /*============================================================================*/
@@ -890,15 +1670,179 @@ Imagem* criaKernelCircular (int largura)
  *
  * Valor de retorno: nenhum. */
 
-void dilata (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out)
+void dilata (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: dilata: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    // Processa cada canal independentemente.
+    int channel, row, col, row2, col2, set;
+    int aesq = centro.x, adir = kernel->largura-1-centro.x, acima = centro.y, abaixo = kernel->altura-1-centro.y;
+
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (row = 0; row < in->altura; row++)
+            for (col = 0; col < in->largura; col++)
+            {
+                // Verifica se tem um pixel branco sob o kernel. Pode parar se encontrar.
+                set = 0;
+                for (row2 = MAX (0, row-acima); !set && row2 <= MIN (in->altura-1, row+abaixo); row2++)
+                    for (col2 = MAX (0, col-aesq); !set && col2 <= MIN (in->largura-1, col+adir); col2++)
+                        if (kernel->dados [0][row2-row+centro.y][col2-col+centro.x] > 0.5f && in->dados [channel][row2][col2] > 0.5f)
+                            set = 1;
+
+                if (set)
+                    out->dados [channel][row][col] = 1.0f;
+                else
+                    out->dados [channel][row][col] = 0;
+            }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Eros�o morfol�gica para imagens bin�rias. Usei aqui uma implementa��o
+ * extremeamente simples (e ineficiente).
+ *
+ * Par�metros: Imagem* in: imagem de entrada.
+ *             Imagem* kernel: kernel para a eros�o.
+ *             Coordenada centro: centro do kernel.
+ *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
+ *               imagem de entrada.
+ *
+ * Valor de retorno: nenhum. */
+
+void erode (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: erode: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    // Processa cada canal independentemente.
+    int channel, row, col, row2, col2, set;
+    int aesq = centro.x, adir = kernel->largura-1-centro.x, acima = centro.y, abaixo = kernel->altura-1-centro.y;
+
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (row = 0; row < in->altura; row++)
+            for (col = 0; col < in->largura; col++)
+            {
+                // Verifica se tem um pixel preto sob o kernel. Pode parar se encontrar.
+                set = 1;
+                for (row2 = MAX (0, row-acima); set && row2 <= MIN (in->altura-1, row+abaixo); row2++)
+                    for (col2 = MAX (0, col-aesq); set && col2 <= MIN (in->largura-1, col+adir); col2++)
+                        if (kernel->dados [0][row2-row+centro.y][col2-col+centro.x] > 0.5f && in->dados [channel][row2][col2] <= 0.5f)
+                            set = 0;
+
+                if (set)
+                    out->dados [channel][row][col] = 1.0f;
+                else
+                    out->dados [channel][row][col] = 0;
+            }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Abertura morfol�gica: eros�o seguida de dilata��o.
+ *
+ * Par�metros: Imagem* in: imagem de entrada.
+ *             Imagem* kernel: kernel para a dilata��o/eros�o.
+ *             Coordenada centro: centro do kernel.
+ *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
+ *               imagem de entrada.
+ *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
+ *               entrada. Pode ser usada quando se quer evitar a aloca��o do
+ *               buffer interno. Use NULL se quiser usar o buffer interno.
+ *
+ * Valor de retorno: nenhum. */
+
+void abertura (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out, Imagem* buffer)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais ||
+        (buffer && (in->largura != buffer->largura || in->altura != buffer->altura || in->n_canais != buffer->n_canais)))
+    {
+        printf ("ERRO: abertura: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    Imagem* img_aux = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+
+    erode (in, kernel, centro, img_aux);
+    dilata (img_aux, kernel, centro, out);
+
+    if (!buffer)
+        destroiImagem (img_aux);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Fechamento morfol�gico: dilata��o seguida de eros�o.
+ *
+ * Par�metros: Imagem* in: imagem de entrada.
+ *             Imagem* kernel: kernel para a dilata��o/eros�o.
+ *             Coordenada centro: centro do kernel.
+ *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
+ *               imagem de entrada.
+ *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
+ *               entrada. Pode ser usada quando se quer evitar a aloca��o do
+ *               buffer interno. Use NULL se quiser usar o buffer interno.
+ *
+ * Valor de retorno: nenhum. */
+
+void fechamento (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out, Imagem* buffer)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais ||
+        (buffer && (in->largura != buffer->largura || in->altura != buffer->altura || in->n_canais != buffer->n_canais)))
+    {
+        printf ("ERRO: fechamento: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    Imagem* img_aux = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+
+    dilata (in, kernel, centro, img_aux);
+    erode (img_aux, kernel, centro, out);
+
+    if (!buffer)
+        destroiImagem (img_aux);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Versões da morfologia para imagens binárias de 8 bits (0 e 255). O kernel
+ * também é uma ImagemU8, e um pixel é considerado branco se for > 127. As
+ * implementações seguem exatamente as versões com floats.
+ *
+ * Parâmetros: os mesmos das versões com floats. */
+
+ImagemU8* criaKernelCircularU8 (int largura)
+{
+    if (largura % 2 == 0)
+    {
+        printf ("ERRO: criaKernelCircularU8: o kernel deve ter largura impar.\n");
+        exit (1);
+    }
+
+    ImagemU8* kernel = criaImagemU8 (largura, largura, 1);
+    int i, j, raio = largura/2, dx, dy;
+
+    for (i = 0; i < largura; i++)
+        for (j = 0; j < largura; j++)
+        {
+            dx = j - raio;
+            dy = i - raio;
+            kernel->dados [0][i][j] = ((int) (sqrtf (dx*dx + dy*dy) + 0.5f) <= raio)? 255 : 0;
+        }
+
+    return (kernel);
+}
+
+void dilataU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out)
 {
     if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
     {
-        printf ("ERRO: dilata: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        printf ("ERRO: dilataU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
         exit (1);
     }
 
-    // Processa cada canal independentemente.
     int channel, row, col, row2, col2, set;
     int aesq = centro.x, adir = kernel->largura-1-centro.x, acima = centro.y, abaixo = kernel->altura-1-centro.y;
 
@@ -910,37 +1854,21 @@ void dilata (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out)
                 set = 0;
                 for (row2 = MAX (0, row-acima); !set && row2 <= MIN (in->altura-1, row+abaixo); row2++)
                     for (col2 = MAX (0, col-aesq); !set && col2 <= MIN (in->largura-1, col+adir); col2++)
-                        if (kernel->dados [0][row2-row+centro.y][col2-col+centro.x] > 0.5f && in->dados [channel][row2][col2] > 0.5f)
+                        if (kernel->dados [0][row2-row+centro.y][col2-col+centro.x] > 127 && in->dados [channel][row2][col2] > 127)
                             set = 1;
 
-                if (set)
-                    out->dados [channel][row][col] = 1.0f;
-                else
-                    out->dados [channel][row][col] = 0;
+                out->dados [channel][row][col] = (set)? 255 : 0;
             }
 }
 
-/*----------------------------------------------------------------------------*/
-/** Eros�o morfol�gica para imagens bin�rias. Usei aqui uma implementa��o
- * extremeamente simples (e ineficiente).
- *
- * Par�metros: Imagem* in: imagem de entrada.
- *             Imagem* kernel: kernel para a eros�o.
- *             Coordenada centro: centro do kernel.
- *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
- *               imagem de entrada.
- *
- * Valor de retorno: nenhum. */
-
-void erode (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out)
+void erodeU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out)
 {
     if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
     {
-        printf ("ERRO: erode: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        printf ("ERRO: erodeU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
         exit (1);
     }
 
-    // Processa cada canal independentemente.
     int channel, row, col, row2, col2, set;
     int aesq = centro.x, adir = kernel->largura-1-centro.x, acima = centro.y, abaixo = kernel->altura-1-centro.y;
 
@@ -952,78 +1880,47 @@ void erode (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out)
                 set = 1;
                 for (row2 = MAX (0, row-acima); set && row2 <= MIN (in->altura-1, row+abaixo); row2++)
                     for (col2 = MAX (0, col-aesq); set && col2 <= MIN (in->largura-1, col+adir); col2++)
-                        if (kernel->dados [0][row2-row+centro.y][col2-col+centro.x] > 0.5f && in->dados [channel][row2][col2] <= 0.5f)
+                        if (kernel->dados [0][row2-row+centro.y][col2-col+centro.x] > 127 && in->dados [channel][row2][col2] <= 127)
                             set = 0;
 
-                if (set)
-                    out->dados [channel][row][col] = 1.0f;
-                else
-                    out->dados [channel][row][col] = 0;
+                out->dados [channel][row][col] = (set)? 255 : 0;
             }
 }
 
-/*----------------------------------------------------------------------------*/
-/** Abertura morfol�gica: eros�o seguida de dilata��o.
- *
- * Par�metros: Imagem* in: imagem de entrada.
- *             Imagem* kernel: kernel para a dilata��o/eros�o.
- *             Coordenada centro: centro do kernel.
- *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
- *               imagem de entrada.
- *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
- *               entrada. Pode ser usada quando se quer evitar a aloca��o do
- *               buffer interno. Use NULL se quiser usar o buffer interno.
- *
- * Valor de retorno: nenhum. */
-
-void abertura (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out, Imagem* buffer)
+void aberturaU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out, ImagemU8* buffer)
 {
     if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais ||
         (buffer && (in->largura != buffer->largura || in->altura != buffer->altura || in->n_canais != buffer->n_canais)))
     {
-        printf ("ERRO: abertura: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        printf ("ERRO: aberturaU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
         exit (1);
     }
 
-    Imagem* img_aux = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+    ImagemU8* img_aux = (buffer)? buffer : criaImagemU8 (in->largura, in->altura, in->n_canais);
 
-    erode (in, kernel, centro, img_aux);
-    dilata (img_aux, kernel, centro, out);
+    erodeU8 (in, kernel, centro, img_aux);
+    dilataU8 (img_aux, kernel, centro, out);
 
     if (!buffer)
-        destroiImagem (img_aux);
+        destroiImagemU8 (img_aux);
 }
 
-/*----------------------------------------------------------------------------*/
-/** Fechamento morfol�gico: dilata��o seguida de eros�o.
- *
- * Par�metros: Imagem* in: imagem de entrada.
- *             Imagem* kernel: kernel para a dilata��o/eros�o.
- *             Coordenada centro: centro do kernel.
- *             Imagem* out: imagem de sa�da. Deve ter o mesmo tamanho da
- *               imagem de entrada.
- *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
- *               entrada. Pode ser usada quando se quer evitar a aloca��o do
- *               buffer interno. Use NULL se quiser usar o buffer interno.
- *
- * Valor de retorno: nenhum. */
-
-void fechamento (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out, Imagem* buffer)
+void fechamentoU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out, ImagemU8* buffer)
 {
     if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais ||
         (buffer && (in->largura != buffer->largura || in->altura != buffer->altura || in->n_canais != buffer->n_canais)))
     {
-        printf ("ERRO: fechamento: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        printf ("ERRO: fechamentoU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
         exit (1);
     }
 
-    Imagem* img_aux = (buffer)? buffer : criaImagem (in->largura, in->altura, in->n_canais);
+    ImagemU8* img_aux = (buffer)? buffer : criaImagemU8 (in->largura, in->altura, in->n_canais);
 
-    dilata (in, kernel, centro, img_aux);
-    erode (img_aux, kernel, centro, out);
+    dilataU8 (in, kernel, centro, img_aux);
+    erodeU8 (img_aux, kernel, centro, out);
 
     if (!buffer)
-        destroiImagem (img_aux);
+        destroiImagemU8 (img_aux);
 }
 
 
@@ -1430,3 +2327,548 @@ void detectorCanny (Imagem* img, int tamanho_sobel, float t_inferior, float t_su
     destroiImagem (mag);
     destroiImagem (ori);
 }
+
+/*============================================================================*/
+/* TRANSFORMADA DE DISTÂNCIA                                                  */
+/*============================================================================*/
+/** Transformada de distância de uma imagem de bordas: cada pixel recebe a
+ * distância até o pixel de borda mais próximo. Todos os tipos são O(N) no
+ * número de pixels, independente de quantas bordas existam.
+ *
+ * - DISTANCIA_CHAMFER_3_4: chamfer com pesos 3 (vizinhos de lado) e 4
+ *   (diagonais), em duas passadas. Erro máximo de uns 8% em relação à
+ *   distância euclidiana.
+ * - DISTANCIA_CHAMFER_5_7_11: chamfer com pesos 5, 7 e 11 (movimentos de
+ *   cavalo), em duas passadas. Erro máximo de uns 2%.
+ * - DISTANCIA_EUCLIDIANA: distância euclidiana exata, separável: uma passada
+ *   por coluna e depois o envelope inferior de parábolas em cada linha
+ *   (Felzenszwalb e Huttenlocher).
+ *
+ * Parâmetros: Imagem* bordas: imagem de bordas, como a saída da
+ *               detectorCanny. Só o canal 0 é usado; pixels > 0.5 são bordas.
+ *             Imagem* out: imagem de saída, do mesmo tamanho. A distância (em
+ *               pixels) é colocada no canal 0. Se não houver nenhuma borda,
+ *               todos os pixels recebem FLT_MAX.
+ *             int tipo: um dos tipos acima.
+ *             int* mais_proximo: se não for NULL, vetor com largura*altura
+ *               posições que recebe, para cada pixel (row*largura+col), a
+ *               posição (no mesmo formato) do pixel de borda mais próximo, ou
+ *               -1 se não houver bordas. Nos chamfers, é a borda que deu
+ *               origem à distância.
+ *
+ * Valor de retorno: nenhum. */
+
+void _distanciaChamfer (Imagem* bordas, Imagem* out, int tipo, int* mais_proximo)
+{
+    // Os buffers têm 2 pixels de margem de cada lado, com distância infinita,
+    // e assim as máscaras não precisam testar os limites da imagem.
+    const int infinito = INT_MAX/2;
+    int largura = bordas->largura + 4, altura = bordas->altura + 4;
+    int* dist = (int*) malloc (sizeof (int) * largura * altura);
+    int* origem = (mais_proximo)? (int*) malloc (sizeof (int) * largura * altura) : NULL;
+    int row, col, k, i;
+
+    for (i = 0; i < largura * altura; i++)
+        dist [i] = infinito;
+    if (origem)
+        for (i = 0; i < largura * altura; i++)
+            origem [i] = -1;
+
+    for (row = 0; row < bordas->altura; row++)
+        for (col = 0; col < bordas->largura; col++)
+            if (bordas->dados [0][row][col] > 0.5f)
+            {
+                dist [(row+2)*largura + col+2] = 0;
+                if (origem)
+                    origem [(row+2)*largura + col+2] = row * bordas->largura + col;
+            }
+
+    // Metade "de trás" da máscara (linhas de cima e o vizinho da esquerda).
+    // A passada de volta usa os deslocamentos com o sinal trocado.
+    int deslocamento [8], custo [8], n_mascara, escala;
+    if (tipo == DISTANCIA_CHAMFER_3_4)
+    {
+        int d [4] = {-largura-1, -largura, -largura+1, -1};
+        int c [4] = {4, 3, 4, 3};
+        n_mascara = 4;
+        escala = 3;
+        for (k = 0; k < n_mascara; k++)
+        {
+            deslocamento [k] = d [k];
+            custo [k] = c [k];
+        }
+    }
+    else
+    {
+        int d [8] = {-2*largura-1, -2*largura+1, -largura-2, -largura-1, -largura, -largura+1, -largura+2, -1};
+        int c [8] = {11, 11, 11, 7, 5, 7, 11, 5};
+        n_mascara = 8;
+        escala = 5;
+        for (k = 0; k < n_mascara; k++)
+        {
+            deslocamento [k] = d [k];
+            custo [k] = c [k];
+        }
+    }
+
+    // Ida: de cima para baixo, da esquerda para a direita.
+    for (row = 2; row < altura-2; row++)
+        for (col = 2; col < largura-2; col++)
+        {
+            int pos = row*largura + col, melhor = pos, d = dist [pos];
+            for (k = 0; k < n_mascara; k++)
+                if (dist [pos + deslocamento [k]] + custo [k] < d)
+                {
+                    d = dist [pos + deslocamento [k]] + custo [k];
+                    melhor = pos + deslocamento [k];
+                }
+            dist [pos] = d;
+            if (origem)
+                origem [pos] = origem [melhor];
+        }
+
+    // Volta: de baixo para cima, da direita para a esquerda.
+    for (row = altura-3; row >= 2; row--)
+        for (col = largura-3; col >= 2; col--)
+        {
+            int pos = row*largura + col, melhor = pos, d = dist [pos];
+            for (k = 0; k < n_mascara; k++)
+                if (dist [pos - deslocamento [k]] + custo [k] < d)
+                {
+                    d = dist [pos - deslocamento [k]] + custo [k];
+                    melhor = pos - deslocamento [k];
+                }
+            dist [pos] = d;
+            if (origem)
+                origem [pos] = origem [melhor];
+        }
+
+    for (row = 0; row < bordas->altura; row++)
+        for (col = 0; col < bordas->largura; col++)
+        {
+            int pos = (row+2)*largura + col+2;
+            out->dados [0][row][col] = (dist [pos] >= infinito)? FLT_MAX : dist [pos] / (float) escala;
+            if (mais_proximo)
+                mais_proximo [row * bordas->largura + col] = origem [pos];
+        }
+
+    free (dist);
+    if (origem)
+        free (origem);
+}
+
+// Coluna onde a parábola de q passa a ficar abaixo da parábola de p (p < q).
+double _distanciaIntersecao (double* f, int p, int q)
+{
+    return ((f [q] + (double) q*q) - (f [p] + (double) p*p)) / (2.0 * (q - p));
+}
+
+void _distanciaEuclidiana (Imagem* bordas, Imagem* out, int* mais_proximo)
+{
+    const int infinito = INT_MAX/2;
+    int largura = bordas->largura, altura = bordas->altura;
+    int row, col, k, q;
+
+    // Primeira passada: distância (e linha) da borda mais próxima na mesma
+    // coluna. As colunas são varridas juntas, linha por linha.
+    int* g = (int*) malloc (sizeof (int) * largura * altura);
+    int* linha_borda = (mais_proximo)? (int*) malloc (sizeof (int) * largura * altura) : NULL;
+
+    for (col = 0; col < largura; col++)
+    {
+        g [col] = (bordas->dados [0][0][col] > 0.5f)? 0 : infinito;
+        if (linha_borda)
+            linha_borda [col] = (g [col] == 0)? 0 : -1;
+    }
+    for (row = 1; row < altura; row++)
+    {
+        int* g_row = g + row*largura;
+        int* g_ant = g_row - largura;
+        for (col = 0; col < largura; col++)
+        {
+            if (bordas->dados [0][row][col] > 0.5f)
+                g_row [col] = 0;
+            else
+                g_row [col] = (g_ant [col] >= infinito)? infinito : g_ant [col] + 1;
+            if (linha_borda)
+                linha_borda [row*largura + col] = (g_row [col] == 0)? row : linha_borda [(row-1)*largura + col];
+        }
+    }
+    for (row = altura-2; row >= 0; row--)
+    {
+        int* g_row = g + row*largura;
+        int* g_prox = g_row + largura;
+        for (col = 0; col < largura; col++)
+            if (g_prox [col] + 1 < g_row [col])
+            {
+                g_row [col] = g_prox [col] + 1;
+                if (linha_borda)
+                    linha_borda [row*largura + col] = linha_borda [(row+1)*largura + col];
+            }
+    }
+
+    // Segunda passada: em cada linha, envelope inferior das parábolas
+    // (x-q)^2 + g(q)^2. v guarda as colunas das parábolas do envelope e z os
+    // limites entre elas.
+    int* v = (int*) malloc (sizeof (int) * largura);
+    double* z = (double*) malloc (sizeof (double) * (largura+1));
+    double* f = (double*) malloc (sizeof (double) * largura);
+
+    for (row = 0; row < altura; row++)
+    {
+        int* g_row = g + row*largura;
+        k = -1;
+        for (q = 0; q < largura; q++)
+        {
+            if (g_row [q] >= infinito)
+                continue; // Coluna sem bordas: não entra no envelope.
+            f [q] = (double) g_row [q] * g_row [q];
+
+            // Tira do envelope as parábolas que a nova esconde. z [0] é
+            // -infinito, então a primeira nunca sai.
+            double s = 0;
+            if (k >= 0)
+            {
+                s = _distanciaIntersecao (f, v [k], q);
+                while (s <= z [k])
+                {
+                    k--;
+                    s = _distanciaIntersecao (f, v [k], q);
+                }
+            }
+            k++;
+            v [k] = q;
+            z [k] = (k == 0)? -HUGE_VAL : s;
+            z [k+1] = HUGE_VAL;
+        }
+
+        if (k < 0) // Não há nenhuma borda na imagem.
+        {
+            for (col = 0; col < largura; col++)
+            {
+                out->dados [0][row][col] = FLT_MAX;
+                if (mais_proximo)
+                    mais_proximo [row*largura + col] = -1;
+            }
+            continue;
+        }
+
+        k = 0;
+        for (col = 0; col < largura; col++)
+        {
+            while (z [k+1] < col)
+                k++;
+            int p = v [k];
+            out->dados [0][row][col] = sqrtf ((float) ((double) (col-p)*(col-p) + f [p]));
+            if (mais_proximo)
+                mais_proximo [row*largura + col] = linha_borda [row*largura + p] * largura + p;
+        }
+    }
+
+    free (v);
+    free (z);
+    free (f);
+    free (g);
+    if (linha_borda)
+        free (linha_borda);
+}
+
+void transformadaDistancia (Imagem* bordas, Imagem* out, int tipo, int* mais_proximo)
+{
+    if (bordas->largura != out->largura || bordas->altura != out->altura)
+    {
+        printf ("ERRO: transformadaDistancia: as imagens precisam ter o mesmo tamanho.\n");
+        exit (1);
+    }
+
+    if (tipo == DISTANCIA_CHAMFER_3_4 || tipo == DISTANCIA_CHAMFER_5_7_11)
+        _distanciaChamfer (bordas, out, tipo, mais_proximo);
+    else if (tipo == DISTANCIA_EUCLIDIANA)
+        _distanciaEuclidiana (bordas, out, mais_proximo);
+    else
+    {
+        printf ("ERRO: transformadaDistancia: tipo invalido.\n");
+        exit (1);
+    }
+}
+
+/*============================================================================*/
+/* PIRÂMIDE GAUSSIANA                                                         */
+/*============================================================================*/
+/** Suaviza e reduz uma imagem pela metade, em uma passada só. Cada pixel da
+ * saída é a média ponderada dos 5x5 pixels ao redor do pixel correspondente
+ * na entrada, com os pesos binomiais (1 4 6 4 1)/16 em cada direção. Só as
+ * colunas e linhas que sobrevivem à redução são calculadas: cada linha da
+ * entrada é filtrada na horizontal (já reduzida) uma única vez, e as 5
+ * últimas ficam em um buffer circular para a passada vertical. Nas bordas, a
+ * imagem é espelhada, como na filtro1D.
+ *
+ * Parâmetros: Imagem* in: imagem de entrada. Se tiver mais que 1 canal,
+ *               processa cada canal independentemente.
+ *             Imagem* out: imagem de saída, com largura (in->largura+1)/2,
+ *               altura (in->altura+1)/2 e o mesmo número de canais.
+ *
+ * Valor de retorno: nenhum. */
+
+void reduzPiramide (Imagem* in, Imagem* out)
+{
+    if (out->largura != (in->largura+1)/2 || out->altura != (in->altura+1)/2 || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: reduzPiramide: a saida precisa ter metade do tamanho da entrada e o mesmo numero de canais.\n");
+        exit (1);
+    }
+
+    int channel, row, col, i;
+    int largura = out->largura;
+    float* buffer = (float*) malloc (sizeof (float) * largura * 5);
+    float* linhas [5];
+
+    for (channel = 0; channel < in->n_canais; channel++)
+    {
+        int proxima = 0; // Próxima linha da entrada a filtrar na horizontal.
+
+        for (row = 0; row < out->altura; row++)
+        {
+            // Garante que as linhas 2*row-2 a 2*row+2 (limitadas à imagem)
+            // estejam no buffer. A linha y fica na posição (y+2)%5.
+            int ultima = MIN (2*row+2, in->altura-1);
+            for (; proxima <= ultima; proxima++)
+            {
+                float* orig = in->dados [channel][proxima];
+                float* dest = buffer + ((proxima+2) % 5) * largura;
+                int w = in->largura;
+
+                for (col = 0; col < largura; col++)
+                {
+                    int x = 2*col;
+                    if (x >= 2 && x+2 < w)
+                        dest [col] = (orig [x-2] + orig [x+2] + 4.0f * (orig [x-1] + orig [x+1]) + 6.0f * orig [x]) * 0.0625f;
+                    else
+                    {
+                        float soma = 0;
+                        for (i = -2; i <= 2; i++)
+                        {
+                            int xi = x+i;
+                            if (xi < 0)
+                                xi = -xi;
+                            else if (xi >= w)
+                                xi = w*2 - xi - 2;
+                            xi = MIN (MAX (xi, 0), w-1); // Menos de 3 colunas.
+                            float peso = (i == 0)? 6.0f : (i == -1 || i == 1)? 4.0f : 1.0f;
+                            soma += peso * orig [xi];
+                        }
+                        dest [col] = soma * 0.0625f;
+                    }
+                }
+            }
+
+            // As linhas espelhadas também estão no buffer: as de cima são
+            // 1 e 2, e as de baixo ficam entre 2*row-2 e a última.
+            for (i = 0; i < 5; i++)
+            {
+                int y = 2*row-2+i;
+                if (y < 0)
+                    y = -y;
+                else if (y >= in->altura)
+                    y = in->altura*2 - y - 2;
+                y = MIN (MAX (y, 0), in->altura-1); // Menos de 3 linhas.
+                linhas [i] = buffer + ((y+2) % 5) * largura;
+            }
+
+            float* saida = out->dados [channel][row];
+            for (col = 0; col < largura; col++)
+                saida [col] = (linhas [0][col] + linhas [4][col] + 4.0f * (linhas [1][col] + linhas [3][col]) + 6.0f * linhas [2][col]) * 0.0625f;
+        }
+    }
+
+    free (buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Cria uma pirâmide Gaussiana sobre uma imagem. Nenhum nível é calculado
+ * aqui: a nivelPiramide calcula cada nível na primeira vez em que ele é
+ * pedido e o guarda, para que etapas diferentes (bordas, máscaras,
+ * gabaritos) usem os mesmos níveis.
+ *
+ * Parâmetros: Imagem* base: imagem de origem (nível 0). Continua sendo do
+ *               chamador, e não pode ser destruída antes da pirâmide.
+ *             int n_niveis: número de níveis, incluindo a base.
+ *             int niveis_por_oitava: 1 para uma pirâmide só com oitavas
+ *               (1, 1/2, 1/4...). Com n > 1, há n-1 níveis intermediários
+ *               entre duas oitavas, em escalas 2^(-k/n).
+ *
+ * Valor de retorno: a pirâmide criada. */
+
+Piramide* criaPiramide (Imagem* base, int n_niveis, int niveis_por_oitava)
+{
+    if (n_niveis < 1 || niveis_por_oitava < 1)
+    {
+        printf ("ERRO: criaPiramide: a piramide precisa de pelo menos 1 nivel e 1 nivel por oitava.\n");
+        exit (1);
+    }
+
+    int i;
+    Piramide* piramide = (Piramide*) malloc (sizeof (Piramide));
+    piramide->base = base;
+    piramide->n_niveis = n_niveis;
+    piramide->niveis_por_oitava = niveis_por_oitava;
+    piramide->niveis = (Imagem**) calloc (n_niveis, sizeof (Imagem*));
+    piramide->escalas = (float*) malloc (sizeof (float) * n_niveis);
+    piramide->validos = (int*) calloc (n_niveis, sizeof (int));
+
+    piramide->niveis [0] = base;
+    piramide->validos [0] = 1;
+    for (i = 0; i < n_niveis; i++)
+        piramide->escalas [i] = powf (2.0f, -i / (float) niveis_por_oitava);
+
+    return (piramide);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói uma pirâmide e os níveis calculados (mas não a base).
+ *
+ * Parâmetros: Piramide* piramide: a pirâmide a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiPiramide (Piramide* piramide)
+{
+    int i;
+
+    for (i = 1; i < piramide->n_niveis; i++)
+        if (piramide->niveis [i])
+            destroiImagem (piramide->niveis [i]);
+
+    free (piramide->niveis);
+    free (piramide->escalas);
+    free (piramide->validos);
+    free (piramide);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Troca a imagem de origem da pirâmide (ou avisa que o conteúdo dela mudou,
+ * se for a mesma). Os níveis já calculados deixam de valer, mas a memória
+ * deles é reaproveitada se o tamanho da base não mudar, então uma pirâmide
+ * pode ser criada uma vez e usada em todos os quadros de um vídeo.
+ *
+ * Parâmetros: Piramide* piramide: a pirâmide.
+ *             Imagem* base: a nova imagem de origem.
+ *
+ * Valor de retorno: nenhum. */
+
+void trocaBasePiramide (Piramide* piramide, Imagem* base)
+{
+    int i;
+
+    if (base->largura != piramide->base->largura || base->altura != piramide->base->altura || base->n_canais != piramide->base->n_canais)
+        for (i = 1; i < piramide->n_niveis; i++)
+            if (piramide->niveis [i])
+            {
+                destroiImagem (piramide->niveis [i]);
+                piramide->niveis [i] = NULL;
+            }
+
+    piramide->base = base;
+    piramide->niveis [0] = base;
+    for (i = 1; i < piramide->n_niveis; i++)
+        piramide->validos [i] = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Retorna um nível da pirâmide, calculando-o (e os níveis de que ele
+ * depende) se ainda não tiver sido calculado. Cada oitava vem da oitava
+ * anterior, pela reduzPiramide. Os níveis intermediários vêm da oitava logo
+ * acima deles: a imagem é suavizada com o sigma necessário para a redução e
+ * redimensionada com interpolação bilinear.
+ *
+ * Parâmetros: Piramide* piramide: a pirâmide.
+ *             int nivel: o nível desejado, de 0 a n_niveis-1.
+ *
+ * Valor de retorno: a imagem do nível. Pertence à pirâmide. */
+
+Imagem* nivelPiramide (Piramide* piramide, int nivel)
+{
+    if (nivel < 0 || nivel >= piramide->n_niveis)
+    {
+        printf ("ERRO: nivelPiramide: nivel invalido.\n");
+        exit (1);
+    }
+
+    if (piramide->validos [nivel])
+        return (piramide->niveis [nivel]);
+
+    int npo = piramide->niveis_por_oitava;
+    int oitava = (nivel / npo) * npo; // Nível da oitava que contém este nível.
+
+    if (nivel == oitava)
+    {
+        Imagem* anterior = nivelPiramide (piramide, nivel - npo);
+        if (!piramide->niveis [nivel])
+            piramide->niveis [nivel] = criaImagem ((anterior->largura+1)/2, (anterior->altura+1)/2, anterior->n_canais);
+        reduzPiramide (anterior, piramide->niveis [nivel]);
+    }
+    else
+    {
+        Imagem* origem = nivelPiramide (piramide, oitava);
+        float fator = powf (2.0f, (nivel - oitava) / (float) npo); // Entre 1 e 2.
+        int largura = MAX ((int) (origem->largura / fator + 0.5f), 1);
+        int altura = MAX ((int) (origem->altura / fator + 0.5f), 1);
+
+        if (!piramide->niveis [nivel])
+            piramide->niveis [nivel] = criaImagem (largura, altura, origem->n_canais);
+
+        // Suaviza o suficiente para a redução (o sigma que, somado ao da
+        // oitava, dá o de uma imagem reduzida pelo fator) e redimensiona.
+        float sigma = 0.5f * sqrtf (fator*fator - 1.0f);
+        int n = _filtroGaussianoNCoef (sigma);
+        if (n == 1 && 3 < origem->largura*2 && 3 < origem->altura*2)
+        {
+            // Com 4 ou mais níveis por oitava, o primeiro nível intermediário
+            // tem sigma abaixo de 0.375, e a Gaussiana amostrada teria um
+            // coeficiente só. O filtro (a, 1-2a, a) com a = sigma^2/2 tem a
+            // mesma variância. Vertical primeiro, para que a horizontal possa
+            // ser feita no próprio buffer.
+            float coef [3];
+            coef [0] = coef [2] = 0.5f * sigma * sigma;
+            coef [1] = 1.0f - 2.0f * coef [0];
+
+            Imagem* suavizada = criaImagem (origem->largura, origem->altura, origem->n_canais);
+            filtro1D (origem, suavizada, coef, 3, 1);
+            filtro1D (suavizada, suavizada, coef, 3, 0);
+            redimensionaBilinear (suavizada, piramide->niveis [nivel]);
+            destroiImagem (suavizada);
+        }
+        else if (n > 1 && n < origem->largura*2 && n < origem->altura*2)
+        {
+            Imagem* suavizada = criaImagem (origem->largura, origem->altura, origem->n_canais);
+            filtroGaussiano (origem, suavizada, sigma, sigma, NULL);
+            redimensionaBilinear (suavizada, piramide->niveis [nivel]);
+            destroiImagem (suavizada);
+        }
+        else
+            redimensionaBilinear (origem, piramide->niveis [nivel]);
+    }
+
+    piramide->validos [nivel] = 1;
+    return (piramide->niveis [nivel]);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Escolhe o nível da pirâmide mais próximo de uma escala, sem ficar menor
+ * que ela. Use para rodar uma etapa em uma resolução mínima (por exemplo,
+ * 0.25 para 1/4 da resolução original).
+ *
+ * Parâmetros: Piramide* piramide: a pirâmide.
+ *             float escala: a escala desejada, em relação à base.
+ *
+ * Valor de retorno: o índice do nível. */
+
+int nivelPiramidePorEscala (Piramide* piramide, float escala)
+{
+    int nivel = 0;
+
+    while (nivel+1 < piramide->n_niveis && piramide->escalas [nivel+1] >= escala * 0.999f)
+        nivel++;
+
+    return (nivel);
+}
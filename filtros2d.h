@@ -19,6 +19,23 @@
 // Gen�ricos.
 void filtro1D (Imagem* in, Imagem* out, float* coef, int n, int vertical);
 void filtro2D (Imagem* in, Imagem* out, float** coef, int altura, int largura, int transposta);
+void _filtro1DAcumula (float* dest, float* src, float coef, int n);
+int _filtro2DDecompoe (float** coef, int altura, int largura, int max_termos, float* verticais, float* horizontais);
+void _filtro2DLinha (float* dest, float* orig, int* deslocamentos, float* pesos, int n_pesos, int n);
+void _filtro2DLinha3x3 (float* dest, float* orig, float* pesos, int transposta, int n);
+void _filtro2DLinha5x5 (float* dest, float* orig, float* pesos, int transposta, int n);
+void _filtro2DLinha7x7 (float* dest, float* orig, float* pesos, int transposta, int n);
+
+// Erro permitido, relativo ao maior coeficiente, para a filtro2D trocar a
+// matriz por uma soma de filtros separáveis.
+#define FILTRO2D_TOLERANCIA 1e-6
+
+// Tamanho dos blocos da saída que a filtro2D calcula de cada vez, quando a
+// matriz não é decomposta, e passo mínimo do buffer dos blocos (com a margem
+// de uma matriz 7x7). Com as margens, um bloco 7x7 ocupa ~20KB.
+#define FILTRO2D_BLOCO_ALTURA 32
+#define FILTRO2D_BLOCO_LARGURA 128
+#define FILTRO2D_BLOCO_PASSO (FILTRO2D_BLOCO_LARGURA + 6)
 
 // Suaviza��o e realce.
 void blur (Imagem* in, Imagem* out, int altura, int largura, Imagem* buffer);
@@ -26,6 +43,23 @@ void filtroGaussiano (Imagem* in, Imagem* out, float sigmax, float sigmay, Image
 void unsharpMasking (Imagem* in, Imagem* out, float sigma, float threshold, float mult, Imagem* buffer);
 void filtroMediana8bpp (Imagem* in, Imagem* out, int altura, int largura);
 void filtroMedianaBinario (Imagem* in, Imagem* out, int altura, int largura, Imagem* buffer);
+void blurU8 (ImagemU8* in, ImagemU8* out, int altura, int largura);
+void filtroMedianaBinarioU8 (ImagemU8* in, ImagemU8* out, int altura, int largura);
+void _filtroCaixa (Imagem* in, Imagem* out, int altura, int largura, int binario);
+void _filtroCaixaU8 (ImagemU8* in, ImagemU8* out, int altura, int largura, int binario);
+void _filtroCaixaLinha (float* in, double* somas, int n, int w);
+void _filtroCaixaLinhaU8 (unsigned char* in, int* somas, int n, int w, int binario);
+void _filtroGaussianoCalculaCoef (int largura, float sigma, float* coef);
+int _filtroGaussianoNCoef (float sigma);
+void _filtroGaussianoRecursivo (Imagem* in, Imagem* out, float sigma, int vertical);
+void _filtroGaussianoRecursivoCoef (float sigma, double* coef, double m [3][3]);
+
+// A partir deste sigma, a filtroGaussiano usa o filtro recursivo, com custo
+// constante por pixel, em vez dos coeficientes.
+#define FILTRO_GAUSSIANO_SIGMA_RECURSIVO 12.0f
+
+// Largura das faixas de colunas no filtro recursivo vertical.
+#define FILTRO_GAUSSIANO_FAIXA 64
 
 // Morfologia.
 void maxLocal (Imagem* in, Imagem* out, int altura, int largura, Imagem* buffer);
@@ -35,12 +69,45 @@ void dilata (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out);
 void erode (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out);
 void abertura (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out, Imagem* buffer);
 void fechamento (Imagem* in, Imagem* kernel, Coordenada centro, Imagem* out, Imagem* buffer);
+ImagemU8* criaKernelCircularU8 (int largura);
+void dilataU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out);
+void erodeU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out);
+void aberturaU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out, ImagemU8* buffer);
+void fechamentoU8 (ImagemU8* in, ImagemU8* kernel, Coordenada centro, ImagemU8* out, ImagemU8* buffer);
 
 // Gradientes.
 void filtroSobel (Imagem* in, Imagem* out, int tamanho, int vertical, int escalado);
 void computaGradientes (Imagem* in, int tamanho_sobel, Imagem* dx, Imagem* dy, Imagem* mag, Imagem* ori);
 
 
+// Transformada de distância.
+#define DISTANCIA_CHAMFER_3_4 0
+#define DISTANCIA_CHAMFER_5_7_11 1
+#define DISTANCIA_EUCLIDIANA 2
+void transformadaDistancia (Imagem* bordas, Imagem* out, int tipo, int* mais_proximo);
+
+// Pirâmide Gaussiana. Os níveis são calculados quando pedidos pela primeira
+// vez e ficam guardados junto com a imagem de origem. O nível 0 é a própria
+// imagem de origem; os níveis múltiplos de niveis_por_oitava têm metade do
+// tamanho do nível uma oitava acima, e os outros ficam em escalas
+// intermediárias.
+typedef struct
+{
+    Imagem* base; // Nível 0. Não pertence à pirâmide.
+    int n_niveis;
+    int niveis_por_oitava;
+    Imagem** niveis; // niveis [0] == base.
+    float* escalas; // Tamanho de cada nível em relação à base (nominal).
+    int* validos; // Se o nível já foi calculado para a base atual.
+} Piramide;
+
+void reduzPiramide (Imagem* in, Imagem* out);
+Piramide* criaPiramide (Imagem* base, int n_niveis, int niveis_por_oitava);
+void destroiPiramide (Piramide* piramide);
+void trocaBasePiramide (Piramide* piramide, Imagem* base);
+Imagem* nivelPiramide (Piramide* piramide, int nivel);
+int nivelPiramidePorEscala (Piramide* piramide, float escala);
+
 void detectorCanny (Imagem* img, int tamanho_sobel, float t_inferior, float t_superior, int usa_proporcao, Imagem* out);
 void _cannyFloodHisterese (Imagem* in, int channel, int row, int col, float threshold, Imagem* out);
 void _cannyIsolaMaximosLocais (Imagem* mag, Imagem* ori);
@@ -0,0 +1,844 @@
+/*============================================================================*/
+/* GABARITOS                                                                  */
+/*============================================================================*/
+/** Tipos e funções para comparar máscaras binárias com um gabarito. */
+/*============================================================================*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "base.h"
+#include "filtros2d.h"
+#include "gabarito.h"
+
+/*============================================================================*/
+
+/* Uma célula da busca grossa do chamfer matching. */
+typedef struct
+{
+	int escala; /* Índice da escala. */
+	int x0, y0, x1, y1; /* Posições (do canto do gabarito) cobertas pela célula. */
+	int cx, cy; /* Posição onde a pontuação foi calculada. */
+	float raio; /* Maior distância entre (cx,cy) e uma posição da célula. */
+	float pontuacao;
+} _CelulaChamfer;
+
+void _redimensionaCandidato (Gabarito* gabarito, Imagem* candidato, BufferGabarito* buffer);
+void _contaBits (uint64_t* a, uint64_t* b, size_t n, int* e, int* ou);
+float _somaChamfer (float* base, int* desloc, int n, float limite_soma);
+int _comparaCelulasChamfer (const void* a, const void* b);
+int _sobrepoeCorrespondencia (CorrespondenciaChamfer* m, int cx, int cy, int rx, int ry);
+int _precedeCorrespondencia (CorrespondenciaChamfer* a, CorrespondenciaChamfer* b);
+void _empilhaCandidatoChamfer (CenaChamfer* cena, int* n, CorrespondenciaChamfer m);
+CorrespondenciaChamfer _retiraCandidatoChamfer (CenaChamfer* cena, int* n);
+void _aceitaCorrespondenciaChamfer (CorrespondenciaChamfer* melhores, int* n, CorrespondenciaChamfer m);
+
+/*============================================================================*/
+/* MÁSCARAS DE BITS                                                           */
+/*============================================================================*/
+/** Cria uma máscara de bits, com todos os pixels desligados.
+ *
+ * Parâmetros: int largura: largura da máscara.
+ *             int altura: altura da máscara.
+ *
+ * Valor de retorno: a máscara criada. */
+
+MascaraBits* criaMascaraBits (int largura, int altura)
+{
+	MascaraBits* mascara;
+
+	mascara = (MascaraBits*) malloc (sizeof (MascaraBits));
+	mascara->largura = largura;
+	mascara->altura = altura;
+	mascara->palavras_por_linha = (largura + 63) / 64;
+	mascara->bits = (uint64_t*) calloc ((size_t) mascara->palavras_por_linha * altura, sizeof (uint64_t));
+
+	return (mascara);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói uma máscara de bits.
+ *
+ * Parâmetros: MascaraBits* mascara: a máscara a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiMascaraBits (MascaraBits* mascara)
+{
+	free (mascara->bits);
+	free (mascara);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Empacota uma imagem em uma máscara de bits. Os pixels com o primeiro canal
+ * maior que 0 ficam ligados.
+ *
+ * Parâmetros: Imagem* img: imagem de entrada.
+ *             MascaraBits* mascara: máscara de saída, do mesmo tamanho.
+ *
+ * Valor de retorno: nenhum. */
+
+void imagemParaMascaraBits (Imagem* img, MascaraBits* mascara)
+{
+	int row, col, palavra;
+
+	if (img->largura != mascara->largura || img->altura != mascara->altura)
+	{
+		printf ("ERRO: imagemParaMascaraBits: a imagem e a mascara precisam ter o mesmo tamanho.\n");
+		exit (1);
+	}
+
+	for (row = 0; row < img->altura; row++)
+	{
+		float* dados = img->dados [0][row];
+		uint64_t* bits = mascara->bits + (size_t) row * mascara->palavras_por_linha;
+
+		for (palavra = 0; palavra < mascara->palavras_por_linha; palavra++)
+		{
+			int inicio = palavra * 64;
+			int fim = (inicio + 64 < img->largura)? inicio + 64 : img->largura;
+			uint64_t w = 0;
+
+			for (col = inicio; col < fim; col++)
+				w |= (uint64_t) (dados [col] > 0) << (col - inicio);
+
+			bits [palavra] = w;
+		}
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/** Conta os pixels ligados em uma máscara.
+ *
+ * Parâmetros: MascaraBits* mascara: a máscara.
+ *
+ * Valor de retorno: o número de pixels ligados. */
+
+int contaPixelsMascara (MascaraBits* mascara)
+{
+	size_t n = (size_t) mascara->palavras_por_linha * mascara->altura;
+	int total = 0;
+
+	_contaBits (mascara->bits, NULL, n, &total, NULL);
+	return (total);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Compara duas máscaras do mesmo tamanho, palavra por palavra: a interseção
+ * é a contagem de bits de a&b, e a união a de a|b. A contagem usa a
+ * instrução POPCNT se o processador tiver (ver _contaBits).
+ *
+ * Parâmetros: MascaraBits* a: uma máscara.
+ *             MascaraBits* b: outra máscara, do mesmo tamanho.
+ *             int* intersecao: parâmetro de saída. Pixels ligados nas duas.
+ *               Pode ser NULL.
+ *             int* uniao: parâmetro de saída. Pixels ligados em pelo menos
+ *               uma. Pode ser NULL.
+ *
+ * Valor de retorno: nenhum. */
+
+void comparaMascaras (MascaraBits* a, MascaraBits* b, int* intersecao, int* uniao)
+{
+	size_t n = (size_t) a->palavras_por_linha * a->altura;
+	int total_e = 0, total_ou = 0;
+
+	if (a->largura != b->largura || a->altura != b->altura)
+	{
+		printf ("ERRO: comparaMascaras: as mascaras precisam ter o mesmo tamanho.\n");
+		exit (1);
+	}
+
+	_contaBits (a->bits, b->bits, n, &total_e, &total_ou);
+
+	if (intersecao)
+		*intersecao = total_e;
+	if (uniao)
+		*uniao = total_ou;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Conta os bits ligados em n palavras. Se b for NULL, conta os de a; senão,
+ * conta os de a&b e os de a|b. O makefile não usa -mpopcnt, então, em x86,
+ * há uma versão compilada para a instrução POPCNT, escolhida em tempo de
+ * execução se o processador a tiver; a outra usa a contagem em software.
+ *
+ * Parâmetros: uint64_t* a: palavras.
+ *             uint64_t* b: outras palavras, ou NULL.
+ *             size_t n: número de palavras.
+ *             int* e: parâmetro de saída. Bits de a (ou de a&b).
+ *             int* ou: parâmetro de saída. Bits de a|b. Pode ser NULL se b
+ *               for NULL.
+ *
+ * Valor de retorno: nenhum. */
+
+#define _CONTA_BITS_CORPO \
+	size_t i; \
+	int total_e = 0, total_ou = 0; \
+	if (!b) \
+		for (i = 0; i < n; i++) \
+			total_e += __builtin_popcountll (a [i]); \
+	else \
+		for (i = 0; i < n; i++) \
+		{ \
+			total_e += __builtin_popcountll (a [i] & b [i]); \
+			total_ou += __builtin_popcountll (a [i] | b [i]); \
+		} \
+	*e = total_e; \
+	if (ou) \
+		*ou = total_ou;
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) && !defined (__POPCNT__)
+__attribute__ ((target ("popcnt")))
+void _contaBitsPopcnt (uint64_t* a, uint64_t* b, size_t n, int* e, int* ou)
+{
+	_CONTA_BITS_CORPO
+}
+#endif
+
+void _contaBits (uint64_t* a, uint64_t* b, size_t n, int* e, int* ou)
+{
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) && !defined (__POPCNT__)
+	if (__builtin_cpu_supports ("popcnt"))
+	{
+		_contaBitsPopcnt (a, b, n, e, ou);
+		return;
+	}
+#endif
+
+	_CONTA_BITS_CORPO
+}
+
+/*----------------------------------------------------------------------------*/
+/** Calcula a interseção sobre a união (IoU) de duas máscaras.
+ *
+ * Parâmetros: MascaraBits* a: uma máscara.
+ *             MascaraBits* b: outra máscara, do mesmo tamanho.
+ *
+ * Valor de retorno: a IoU, em [0,1]. Se as duas estiverem vazias, 0. */
+
+float iouMascaras (MascaraBits* a, MascaraBits* b)
+{
+	int intersecao, uniao;
+
+	comparaMascaras (a, b, &intersecao, &uniao);
+	return ((uniao)? (float) intersecao / (float) uniao : 0.0f);
+}
+
+/*============================================================================*/
+/* GABARITO                                                                   */
+/*============================================================================*/
+/** Cria um gabarito a partir de uma imagem. Os pixels com o primeiro canal
+ * maior que 0 ficam ligados.
+ *
+ * Parâmetros: Imagem* img: imagem do gabarito.
+ *
+ * Valor de retorno: o gabarito criado. Lembre-se de destruí-lo com a
+ *                   destroiGabarito! */
+
+Gabarito* criaGabarito (Imagem* img)
+{
+	Gabarito* gabarito;
+
+	gabarito = (Gabarito*) malloc (sizeof (Gabarito));
+	gabarito->largura = img->largura;
+	gabarito->altura = img->altura;
+	gabarito->mascara = criaMascaraBits (img->largura, img->altura);
+	imagemParaMascaraBits (img, gabarito->mascara);
+	gabarito->n_pixels = contaPixelsMascara (gabarito->mascara);
+
+	return (gabarito);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Abre um arquivo de imagem e cria um gabarito com ela. Os pixels com
+ * vermelho maior que 0 ficam ligados.
+ *
+ * Parâmetros: char* arquivo: caminho do arquivo a abrir.
+ *
+ * Valor de retorno: o gabarito criado, ou NULL se não for possível abrir a
+ *                   imagem. */
+
+Gabarito* abreGabarito (char* arquivo)
+{
+	Imagem* img;
+	Gabarito* gabarito;
+
+	img = abreImagem (arquivo, 3);
+	if (!img)
+		return (NULL);
+
+	gabarito = criaGabarito (img);
+	destroiImagem (img);
+	return (gabarito);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói um gabarito.
+ *
+ * Parâmetros: Gabarito* gabarito: o gabarito a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiGabarito (Gabarito* gabarito)
+{
+	destroiMascaraBits (gabarito->mascara);
+	free (gabarito);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Cria um buffer para a comparaGabarito. O buffer pode ser reaproveitado em
+ * todas as comparações feitas por uma thread.
+ *
+ * Parâmetros: Gabarito* gabarito: o gabarito.
+ *             int n_canais: número de canais dos candidatos.
+ *
+ * Valor de retorno: o buffer criado. */
+
+BufferGabarito* criaBufferGabarito (Gabarito* gabarito, int n_canais)
+{
+	BufferGabarito* buffer = (BufferGabarito*) malloc (sizeof (BufferGabarito));
+	buffer->redimensionada = criaImagem (gabarito->largura, gabarito->altura, n_canais);
+	buffer->mascara = criaMascaraBits (gabarito->largura, gabarito->altura);
+	return (buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói um buffer criado pela criaBufferGabarito.
+ *
+ * Parâmetros: BufferGabarito* buffer: o buffer a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiBufferGabarito (BufferGabarito* buffer)
+{
+	destroiImagem (buffer->redimensionada);
+	destroiMascaraBits (buffer->mascara);
+	free (buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Compara um candidato com um gabarito. O candidato é redimensionado para o
+ * tamanho do gabarito e empacotado em bits (primeiro canal maior que 0), e
+ * contamos os pixels ligados nos dois.
+ *
+ * Parâmetros: Gabarito* gabarito: o gabarito.
+ *             Imagem* candidato: imagem a comparar.
+ *             BufferGabarito* buffer: buffer criado para o gabarito, com o
+ *               número de canais do candidato.
+ *
+ * Valor de retorno: a porcentagem (de 0 a 100) dos pixels do gabarito que
+ *                   estão ligados no gabarito e no candidato. */
+
+float comparaGabarito (Gabarito* gabarito, Imagem* candidato, BufferGabarito* buffer)
+{
+	int count;
+
+	_redimensionaCandidato (gabarito, candidato, buffer);
+	comparaMascaras (gabarito->mascara, buffer->mascara, &count, NULL);
+
+	return (((float) count / (gabarito->largura * gabarito->altura)) * 100.0);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Calcula a IoU entre um candidato (redimensionado para o tamanho do
+ * gabarito) e o gabarito.
+ *
+ * Parâmetros: Gabarito* gabarito: o gabarito.
+ *             Imagem* candidato: imagem a comparar.
+ *             BufferGabarito* buffer: buffer criado para o gabarito, com o
+ *               número de canais do candidato.
+ *
+ * Valor de retorno: a IoU, em [0,1]. */
+
+float iouGabarito (Gabarito* gabarito, Imagem* candidato, BufferGabarito* buffer)
+{
+	_redimensionaCandidato (gabarito, candidato, buffer);
+	return (iouMascaras (gabarito->mascara, buffer->mascara));
+}
+
+/*============================================================================*/
+/* CHAMFER MATCHING                                                           */
+/*============================================================================*/
+/** Cria um gabarito de bordas a partir de uma imagem de bordas, como a saída
+ * da detectorCanny. Os pontos são guardados embaralhados (com uma sequência
+ * fixa), para que as primeiras parcelas da soma já sejam representativas do
+ * gabarito todo e a terminação antecipada da buscaChamfer corte cedo.
+ *
+ * Parâmetros: Imagem* bordas: imagem de bordas. Só o canal 0 é usado; pixels
+ *               > 0.5 são bordas.
+ *
+ * Valor de retorno: o gabarito criado. */
+
+GabaritoBordas* criaGabaritoBordas (Imagem* bordas)
+{
+	GabaritoBordas* gabarito;
+	int row, col, i, n = 0;
+
+	for (row = 0; row < bordas->altura; row++)
+		for (col = 0; col < bordas->largura; col++)
+			if (bordas->dados [0][row][col] > 0.5f)
+				n++;
+
+	gabarito = (GabaritoBordas*) malloc (sizeof (GabaritoBordas));
+	gabarito->largura = bordas->largura;
+	gabarito->altura = bordas->altura;
+	gabarito->n_pontos = n;
+	gabarito->pontos = (Coordenada*) malloc (sizeof (Coordenada) * ((n)? n : 1));
+
+	n = 0;
+	for (row = 0; row < bordas->altura; row++)
+		for (col = 0; col < bordas->largura; col++)
+			if (bordas->dados [0][row][col] > 0.5f)
+				gabarito->pontos [n++] = criaCoordenada (col, row);
+
+	// Fisher-Yates com um gerador linear congruente próprio, para que o
+	// resultado não dependa da rand ().
+	unsigned int semente = 12345;
+	for (i = n-1; i > 0; i--)
+	{
+		semente = semente * 1103515245u + 12345u;
+		int j = (semente >> 8) % (i+1);
+		Coordenada tmp = gabarito->pontos [i];
+		gabarito->pontos [i] = gabarito->pontos [j];
+		gabarito->pontos [j] = tmp;
+	}
+
+	return (gabarito);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói um gabarito de bordas.
+ *
+ * Parâmetros: GabaritoBordas* gabarito: o gabarito a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiGabaritoBordas (GabaritoBordas* gabarito)
+{
+	free (gabarito->pontos);
+	free (gabarito);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Cria uma cena para o chamfer matching. A cena guarda a transformada de
+ * distância das bordas de um quadro; use a preparaCenaChamfer a cada quadro.
+ *
+ * Parâmetros: int largura: largura dos quadros.
+ *             int altura: altura dos quadros.
+ *
+ * Valor de retorno: a cena criada. */
+
+CenaChamfer* criaCenaChamfer (int largura, int altura)
+{
+	CenaChamfer* cena = (CenaChamfer*) malloc (sizeof (CenaChamfer));
+	cena->distancia = criaImagem (largura, altura, 1);
+	cena->truncamento = 0;
+	cena->deslocamentos = NULL;
+	cena->capacidade_deslocamentos = 0;
+	cena->celulas = NULL;
+	cena->capacidade_celulas = 0;
+	cena->candidatos = NULL;
+	cena->capacidade_candidatos = 0;
+	return (cena);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói uma cena do chamfer matching.
+ *
+ * Parâmetros: CenaChamfer* cena: a cena a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiCenaChamfer (CenaChamfer* cena)
+{
+	destroiImagem (cena->distancia);
+	free (cena->deslocamentos);
+	free (cena->celulas);
+	free (cena->candidatos);
+	free (cena);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Prepara a cena para um quadro: calcula a transformada de distância
+ * euclidiana das bordas, uma vez só, e a trunca. Com a truncagem, uma borda
+ * faltando no quadro custa no máximo truncamento, e não a distância até
+ * alguma borda distante.
+ *
+ * Parâmetros: CenaChamfer* cena: a cena.
+ *             Imagem* bordas: bordas do quadro, do tamanho da cena. Só o
+ *               canal 0 é usado; pixels > 0.5 são bordas.
+ *             float truncamento: maior distância considerada, em pixels. Se
+ *               for <= 0, as distâncias não são truncadas.
+ *
+ * Valor de retorno: nenhum. */
+
+void preparaCenaChamfer (CenaChamfer* cena, Imagem* bordas, float truncamento)
+{
+	int row, col;
+
+	if (bordas->largura != cena->distancia->largura || bordas->altura != cena->distancia->altura)
+	{
+		printf ("ERRO: preparaCenaChamfer: as bordas precisam ter o tamanho da cena.\n");
+		exit (1);
+	}
+
+	transformadaDistancia (bordas, cena->distancia, DISTANCIA_EUCLIDIANA, NULL);
+
+	cena->truncamento = truncamento;
+	if (truncamento > 0)
+		for (row = 0; row < cena->distancia->altura; row++)
+		{
+			float* linha = cena->distancia->dados [0][row];
+			for (col = 0; col < cena->distancia->largura; col++)
+				if (linha [col] > truncamento)
+					linha [col] = truncamento;
+		}
+}
+
+/*----------------------------------------------------------------------------*/
+/** Procura um gabarito de bordas em uma região da cena, em várias posições e
+ * escalas. A pontuação de uma posição é a distância média dos pontos do
+ * gabarito até a borda mais próxima da cena, então o custo é proporcional ao
+ * número de pontos do gabarito.
+ *
+ * A busca é grossa-para-fina: primeiro o gabarito é comparado no centro de
+ * cada célula de uma grade com espaçamento CHAMFER_PASSO_GROSSO. Como a
+ * distância euclidiana muda no máximo 1 pixel por pixel de deslocamento, a
+ * pontuação no centro menos o raio da célula é um limite inferior para a
+ * célula toda. As células são percorridas da mais promissora para a menos
+ * promissora, e em cada posição a soma para assim que passa do limite.
+ *
+ * Correspondências com o gabarito na mesma região (centros mais próximos que
+ * metade do tamanho do gabarito) não são repetidas: o resultado é o mesmo de
+ * avaliar todas as posições, ordená-las e ir ficando com cada uma que não se
+ * sobrepõe a nenhuma já escolhida. Uma posição achada só é decidida quando
+ * nenhuma célula ainda não percorrida pode ter algo melhor que ela, e a busca
+ * termina quando n_melhores resultados foram escolhidos.
+ *
+ * Parâmetros: CenaChamfer* cena: cena já preparada.
+ *             GabaritoBordas* gabarito: o gabarito a procurar.
+ *             Retangulo roi: região da cena onde o gabarito deve ficar
+ *               inteiro. É limitada à cena.
+ *             float escala_min, escala_max: escalas do gabarito a testar.
+ *             int n_escalas: número de escalas, espaçadas geometricamente
+ *               entre escala_min e escala_max. Com 1, só usa escala_min.
+ *             float limite: maior pontuação aceita.
+ *             CorrespondenciaChamfer* melhores: vetor de saída, com espaço
+ *               para n_melhores resultados.
+ *             int n_melhores: número máximo de resultados.
+ *
+ * Valor de retorno: o número de resultados colocados em melhores, ordenados
+ *                   da menor pontuação (melhor) para a maior. */
+
+int buscaChamfer (CenaChamfer* cena, GabaritoBordas* gabarito, Retangulo roi, float escala_min, float escala_max, int n_escalas, float limite, CorrespondenciaChamfer* melhores, int n_melhores)
+{
+	Imagem* dist = cena->distancia;
+	int n_pontos = gabarito->n_pontos;
+	int e, i, x, y, n_achados = 0, n_celulas = 0;
+
+	if (n_pontos == 0 || n_melhores <= 0 || n_escalas <= 0)
+		return (0);
+
+	// Limita a região à cena.
+	if (roi.c < 0) roi.c = 0;
+	if (roi.e < 0) roi.e = 0;
+	if (roi.b > dist->altura-1) roi.b = dist->altura-1;
+	if (roi.d > dist->largura-1) roi.d = dist->largura-1;
+
+	// Pontos do gabarito em cada escala, como deslocamentos a partir do canto
+	// superior esquerdo na transformada de distância.
+	if (cena->capacidade_deslocamentos < n_pontos * n_escalas)
+	{
+		cena->capacidade_deslocamentos = n_pontos * n_escalas;
+		cena->deslocamentos = (int*) realloc (cena->deslocamentos, sizeof (int) * cena->capacidade_deslocamentos);
+	}
+
+	float* escalas = (float*) malloc (sizeof (float) * n_escalas);
+	int* larguras = (int*) malloc (sizeof (int) * n_escalas);
+	int* alturas = (int*) malloc (sizeof (int) * n_escalas);
+	for (e = 0; e < n_escalas; e++)
+	{
+		float escala = (n_escalas > 1)? escala_min * powf (escala_max / escala_min, e / (float) (n_escalas-1)) : escala_min;
+		int* desloc = cena->deslocamentos + e * n_pontos;
+
+		escalas [e] = escala;
+		larguras [e] = (int) ((gabarito->largura-1) * escala + 0.5f) + 1;
+		alturas [e] = (int) ((gabarito->altura-1) * escala + 0.5f) + 1;
+		for (i = 0; i < n_pontos; i++)
+			desloc [i] = (int) (gabarito->pontos [i].y * escala + 0.5f) * dist->passo + (int) (gabarito->pontos [i].x * escala + 0.5f);
+	}
+
+	// Busca grossa: o centro de cada célula, em todas as escalas. As células
+	// que não podem ter nada abaixo do limite já ficam de fora.
+	for (e = 0; e < n_escalas; e++)
+	{
+		int x_max = roi.d - larguras [e] + 1, y_max = roi.b - alturas [e] + 1;
+		if (x_max < roi.e || y_max < roi.c)
+			continue; // O gabarito não cabe na região nesta escala.
+
+		for (y = roi.c; y <= y_max; y += CHAMFER_PASSO_GROSSO)
+			for (x = roi.e; x <= x_max; x += CHAMFER_PASSO_GROSSO)
+			{
+				_CelulaChamfer c;
+				c.escala = e;
+				c.x0 = x;
+				c.y0 = y;
+				c.x1 = MIN (x + CHAMFER_PASSO_GROSSO - 1, x_max);
+				c.y1 = MIN (y + CHAMFER_PASSO_GROSSO - 1, y_max);
+				c.cx = (c.x0 + c.x1) / 2;
+				c.cy = (c.y0 + c.y1) / 2;
+				c.raio = sqrtf ((float) (MAX (c.cx - c.x0, c.x1 - c.cx) * MAX (c.cx - c.x0, c.x1 - c.cx) +
+				                         MAX (c.cy - c.y0, c.y1 - c.cy) * MAX (c.cy - c.y0, c.y1 - c.cy)));
+
+				float* base = &dist->dados [0][c.cy][c.cx];
+				float soma = _somaChamfer (base, cena->deslocamentos + e * n_pontos, n_pontos, (limite + c.raio) * n_pontos);
+				c.pontuacao = soma / n_pontos;
+				if (c.pontuacao - c.raio > limite)
+					continue;
+
+				if (n_celulas == cena->capacidade_celulas)
+				{
+					cena->capacidade_celulas = (cena->capacidade_celulas)? cena->capacidade_celulas * 2 : 256;
+					cena->celulas = realloc (cena->celulas, sizeof (_CelulaChamfer) * cena->capacidade_celulas);
+				}
+				((_CelulaChamfer*) cena->celulas) [n_celulas++] = c;
+			}
+	}
+
+	// Busca fina: percorre as células da mais promissora para a menos
+	// promissora, guardando as posições abaixo do limite. Antes de cada
+	// célula, as posições guardadas abaixo do limite inferior dela já não
+	// podem ser superadas por nada que falta percorrer, então são decididas,
+	// da melhor para a pior. Só aqui é seguro descartar uma posição por se
+	// sobrepor a um resultado, porque os resultados escolhidos nunca mais
+	// saem da lista.
+	_CelulaChamfer* celulas = (_CelulaChamfer*) cena->celulas;
+	qsort (celulas, n_celulas, sizeof (_CelulaChamfer), _comparaCelulasChamfer);
+
+	int n_candidatos = 0;
+	for (i = 0; i < n_celulas && n_achados < n_melhores; i++)
+	{
+		_CelulaChamfer* c = &celulas [i];
+		float limite_celula = c->pontuacao - c->raio;
+
+		while (n_candidatos > 0 && n_achados < n_melhores &&
+		       ((CorrespondenciaChamfer*) cena->candidatos) [0].pontuacao < limite_celula)
+			_aceitaCorrespondenciaChamfer (melhores, &n_achados, _retiraCandidatoChamfer (cena, &n_candidatos));
+		if (n_achados == n_melhores)
+			break;
+
+		int* desloc = cena->deslocamentos + c->escala * n_pontos;
+		for (y = c->y0; y <= c->y1; y++)
+			for (x = c->x0; x <= c->x1; x++)
+			{
+				float pontuacao;
+
+				if (x == c->cx && y == c->cy)
+					pontuacao = c->pontuacao; // Já calculada na busca grossa.
+				else
+					pontuacao = _somaChamfer (&dist->dados [0][y][x], desloc, n_pontos, limite * n_pontos) / n_pontos;
+
+				if (pontuacao <= limite)
+				{
+					CorrespondenciaChamfer m;
+					m.roi = criaRetangulo (y, y + alturas [c->escala] - 1, x, x + larguras [c->escala] - 1);
+					m.escala = escalas [c->escala];
+					m.pontuacao = pontuacao;
+					_empilhaCandidatoChamfer (cena, &n_candidatos, m);
+				}
+			}
+	}
+
+	// Acabaram as células: o que sobrou pode ser decidido.
+	while (n_candidatos > 0 && n_achados < n_melhores)
+		_aceitaCorrespondenciaChamfer (melhores, &n_achados, _retiraCandidatoChamfer (cena, &n_candidatos));
+
+	free (escalas);
+	free (larguras);
+	free (alturas);
+	return (n_achados);
+}
+
+/*============================================================================*/
+/* FUNÇÕES INTERNAS                                                           */
+/*============================================================================*/
+/** Redimensiona um candidato para o tamanho do gabarito e o empacota na
+ * máscara do buffer.
+ *
+ * Parâmetros: Gabarito* gabarito: o gabarito.
+ *             Imagem* candidato: imagem a comparar.
+ *             BufferGabarito* buffer: buffer da thread.
+ *
+ * Valor de retorno: nenhum. */
+
+void _redimensionaCandidato (Gabarito* gabarito, Imagem* candidato, BufferGabarito* buffer)
+{
+	if (buffer->redimensionada->largura != gabarito->largura || buffer->redimensionada->altura != gabarito->altura ||
+	    buffer->redimensionada->n_canais != candidato->n_canais)
+	{
+		printf ("ERRO: comparaGabarito: o buffer precisa ter o tamanho do gabarito e o numero de canais do candidato.\n");
+		exit (1);
+	}
+
+	redimensionaBilinear (candidato, buffer->redimensionada);
+	imagemParaMascaraBits (buffer->redimensionada, buffer->mascara);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Soma as distâncias da cena sob os pontos de um gabarito. Para assim que a
+ * soma passa de limite_soma; nesse caso, o valor retornado é só um limite
+ * inferior da soma completa. O teste é feito a cada 8 pontos.
+ *
+ * Parâmetros: float* base: posição do canto superior esquerdo do gabarito na
+ *               transformada de distância.
+ *             int* desloc: deslocamento de cada ponto a partir de base.
+ *             int n: número de pontos.
+ *             float limite_soma: valor a partir do qual a soma pode parar.
+ *
+ * Valor de retorno: a soma. */
+
+float _somaChamfer (float* base, int* desloc, int n, float limite_soma)
+{
+	float soma = 0;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		soma += base [desloc [i]] + base [desloc [i+1]] + base [desloc [i+2]] + base [desloc [i+3]] +
+		        base [desloc [i+4]] + base [desloc [i+5]] + base [desloc [i+6]] + base [desloc [i+7]];
+		if (soma > limite_soma)
+			return (soma);
+	}
+	for (; i < n; i++)
+		soma += base [desloc [i]];
+
+	return (soma);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Ordena as células da busca grossa pela pontuação menos o raio (o limite
+ * inferior da célula). Para a qsort. */
+
+int _comparaCelulasChamfer (const void* a, const void* b)
+{
+	const _CelulaChamfer* ca = (const _CelulaChamfer*) a;
+	const _CelulaChamfer* cb = (const _CelulaChamfer*) b;
+	float la = ca->pontuacao - ca->raio, lb = cb->pontuacao - cb->raio;
+
+	if (la != lb)
+		return ((la < lb)? -1 : 1);
+	if (ca->escala != cb->escala)
+		return (ca->escala - cb->escala);
+	if (ca->y0 != cb->y0)
+		return (ca->y0 - cb->y0);
+	return (ca->x0 - cb->x0);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Diz se o centro de uma correspondência está a menos de (rx,ry) de (cx,cy).
+ * Todos os valores estão em dobro, para ficarem inteiros. */
+
+int _sobrepoeCorrespondencia (CorrespondenciaChamfer* m, int cx, int cy, int rx, int ry)
+{
+	return (abs (m->roi.e + m->roi.d - cx) < rx && abs (m->roi.c + m->roi.b - cy) < ry);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Diz se a correspondência a vem antes de b: menor pontuação e, no empate,
+ * menor escala, linha e coluna, para o resultado não depender da ordem em
+ * que as células são percorridas. */
+
+int _precedeCorrespondencia (CorrespondenciaChamfer* a, CorrespondenciaChamfer* b)
+{
+	if (a->pontuacao != b->pontuacao)
+		return (a->pontuacao < b->pontuacao);
+	if (a->escala != b->escala)
+		return (a->escala < b->escala);
+	if (a->roi.c != b->roi.c)
+		return (a->roi.c < b->roi.c);
+	return (a->roi.e < b->roi.e);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Guarda uma posição achada na busca fina. As posições ficam em um heap na
+ * memória de trabalho da cena, com a de menor pontuação na raiz.
+ *
+ * Parâmetros: CenaChamfer* cena: a cena.
+ *             int* n: número de posições guardadas. É atualizado.
+ *             CorrespondenciaChamfer m: a posição.
+ *
+ * Valor de retorno: nenhum. */
+
+void _empilhaCandidatoChamfer (CenaChamfer* cena, int* n, CorrespondenciaChamfer m)
+{
+	CorrespondenciaChamfer* heap;
+	int i;
+
+	if (*n == cena->capacidade_candidatos)
+	{
+		cena->capacidade_candidatos = (cena->capacidade_candidatos)? cena->capacidade_candidatos * 2 : 256;
+		cena->candidatos = realloc (cena->candidatos, sizeof (CorrespondenciaChamfer) * cena->capacidade_candidatos);
+	}
+
+	heap = (CorrespondenciaChamfer*) cena->candidatos;
+	for (i = (*n)++; i > 0 && _precedeCorrespondencia (&m, &heap [(i-1)/2]); i = (i-1)/2)
+		heap [i] = heap [(i-1)/2];
+	heap [i] = m;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Tira do heap da cena a posição de menor pontuação.
+ *
+ * Parâmetros: CenaChamfer* cena: a cena.
+ *             int* n: número de posições guardadas (pelo menos 1). É
+ *               atualizado.
+ *
+ * Valor de retorno: a posição retirada. */
+
+CorrespondenciaChamfer _retiraCandidatoChamfer (CenaChamfer* cena, int* n)
+{
+	CorrespondenciaChamfer* heap = (CorrespondenciaChamfer*) cena->candidatos;
+	CorrespondenciaChamfer topo = heap [0], ultimo = heap [--(*n)];
+	int i = 0, filho;
+
+	while ((filho = 2*i + 1) < *n)
+	{
+		if (filho + 1 < *n && _precedeCorrespondencia (&heap [filho+1], &heap [filho]))
+			filho++;
+		if (!_precedeCorrespondencia (&heap [filho], &ultimo))
+			break;
+		heap [i] = heap [filho];
+		i = filho;
+	}
+	heap [i] = ultimo;
+	return (topo);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Coloca uma correspondência no fim da lista das melhores, a não ser que ela
+ * se sobreponha a uma que já está lá (centros mais próximos que metade do
+ * tamanho do gabarito). As correspondências devem chegar da melhor para a
+ * pior, então a lista fica ordenada.
+ *
+ * Parâmetros: CorrespondenciaChamfer* melhores: a lista.
+ *             int* n: número de elementos na lista. É atualizado.
+ *             CorrespondenciaChamfer m: a nova correspondência.
+ *
+ * Valor de retorno: nenhum. */
+
+void _aceitaCorrespondenciaChamfer (CorrespondenciaChamfer* melhores, int* n, CorrespondenciaChamfer m)
+{
+	int i;
+	int cx = m.roi.e + m.roi.d, cy = m.roi.c + m.roi.b; // Centros, em dobro.
+	int rx = m.roi.d - m.roi.e + 1, ry = m.roi.b - m.roi.c + 1; // Metade do tamanho, em dobro.
+
+	for (i = 0; i < *n; i++)
+		if (_sobrepoeCorrespondencia (&melhores [i], cx, cy, rx, ry))
+			return;
+
+	melhores [(*n)++] = m;
+}
+
+/*============================================================================*/
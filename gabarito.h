@@ -0,0 +1,111 @@
+/*============================================================================*/
+/* GABARITOS                                                                  */
+/*============================================================================*/
+/** Tipos e funções para comparar máscaras binárias com um gabarito. */
+/*============================================================================*/
+
+#ifndef __GABARITO_H
+#define __GABARITO_H
+
+/*============================================================================*/
+
+#include <stdint.h>
+
+#include "imagem.h"
+#include "geometria.h"
+
+/*============================================================================*/
+/* Uma máscara binária com 1 bit por pixel. Cada linha ocupa palavras_por_linha
+ * palavras de 64 bits; o pixel x fica no bit x%64 da palavra x/64. Os bits
+ * depois do fim da linha ficam sempre em 0, para que as contagens possam
+ * percorrer as palavras inteiras. */
+
+typedef struct
+{
+	int largura;
+	int altura;
+	int palavras_por_linha;
+	uint64_t* bits;
+} MascaraBits;
+
+MascaraBits* criaMascaraBits (int largura, int altura);
+void destroiMascaraBits (MascaraBits* mascara);
+void imagemParaMascaraBits (Imagem* img, MascaraBits* mascara);
+int contaPixelsMascara (MascaraBits* mascara);
+void comparaMascaras (MascaraBits* a, MascaraBits* b, int* intersecao, int* uniao);
+float iouMascaras (MascaraBits* a, MascaraBits* b);
+
+/*----------------------------------------------------------------------------*/
+/* Um gabarito pré-processado. É carregado uma vez e depois só é lido, então
+ * pode ser compartilhado entre threads. Cada thread precisa do seu próprio
+ * buffer para a comparação (criaBufferGabarito). */
+
+typedef struct
+{
+	int largura;
+	int altura;
+	MascaraBits* mascara; /* Pixels ligados no gabarito. */
+	int n_pixels; /* Número de pixels ligados. */
+} Gabarito;
+
+/* Memória de trabalho de uma thread para a comparaGabarito. */
+typedef struct
+{
+	Imagem* redimensionada; /* O candidato, no tamanho do gabarito. */
+	MascaraBits* mascara; /* A máscara do candidato redimensionado. */
+} BufferGabarito;
+
+Gabarito* criaGabarito (Imagem* img);
+Gabarito* abreGabarito (char* arquivo);
+void destroiGabarito (Gabarito* gabarito);
+BufferGabarito* criaBufferGabarito (Gabarito* gabarito, int n_canais);
+void destroiBufferGabarito (BufferGabarito* buffer);
+float comparaGabarito (Gabarito* gabarito, Imagem* candidato, BufferGabarito* buffer);
+float iouGabarito (Gabarito* gabarito, Imagem* candidato, BufferGabarito* buffer);
+
+/*----------------------------------------------------------------------------*/
+/* Chamfer matching. Um gabarito de bordas é só a lista dos seus pontos de
+ * borda, então compará-lo custa tempo proporcional ao número de pontos, e não
+ * à área. A cena é preparada uma vez por quadro (a transformada de distância
+ * das suas bordas) e depois pode ser comparada com muitos gabaritos. A cena
+ * também guarda memória de trabalho, então cada thread precisa da sua. */
+
+typedef struct
+{
+	int largura;
+	int altura;
+	int n_pontos;
+	Coordenada* pontos; /* Pontos de borda, embaralhados (ver criaGabaritoBordas). */
+} GabaritoBordas;
+
+typedef struct
+{
+	Imagem* distancia; /* Distância até a borda mais próxima, truncada. */
+	float truncamento;
+	int* deslocamentos; /* Memória de trabalho: pontos do gabarito em cada escala. */
+	int capacidade_deslocamentos;
+	void* celulas; /* Memória de trabalho: células da busca grossa. */
+	int capacidade_celulas;
+	void* candidatos; /* Memória de trabalho: posições achadas na busca fina. */
+	int capacidade_candidatos;
+} CenaChamfer;
+
+typedef struct
+{
+	Retangulo roi; /* Onde o gabarito (na escala dada) ficou na cena. */
+	float escala;
+	float pontuacao; /* Distância média dos pontos do gabarito até as bordas da cena. Menor é melhor. */
+} CorrespondenciaChamfer;
+
+/* Espaçamento da grade da busca grossa. */
+#define CHAMFER_PASSO_GROSSO 4
+
+GabaritoBordas* criaGabaritoBordas (Imagem* bordas);
+void destroiGabaritoBordas (GabaritoBordas* gabarito);
+CenaChamfer* criaCenaChamfer (int largura, int altura);
+void destroiCenaChamfer (CenaChamfer* cena);
+void preparaCenaChamfer (CenaChamfer* cena, Imagem* bordas, float truncamento);
+int buscaChamfer (CenaChamfer* cena, GabaritoBordas* gabarito, Retangulo roi, float escala_min, float escala_max, int n_escalas, float limite, CorrespondenciaChamfer* melhores, int n_melhores);
+
+/*============================================================================*/
+#endif /* __GABARITO_H */
@@ -0,0 +1,1001 @@
+/*============================================================================*/
+/* GRAFOS DE OPERAÇÕES                                                        */
+/*============================================================================*/
+/** Tipos e funções para montar uma sequência de operações sobre imagens e
+ * executá-la de uma vez, sem criar as imagens intermediárias. */
+/*============================================================================*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "base.h"
+#include "filtros2d.h"
+#include "grafo.h"
+
+/*============================================================================*/
+
+int _grafoNovoNo (GrafoImagens* grafo, int tipo, int n_entradas, int a, int b, int c);
+void _grafoPlaneja (GrafoImagens* grafo, int saida);
+void _grafoLiberaPlano (GrafoImagens* grafo);
+float* _grafoLinha (GrafoImagens* grafo, int no, int canal, int row);
+float* _grafoOperando (GrafoImagens* grafo, int no, int canal, int row, int xb, int n);
+void _grafoCalculaLinha (GrafoImagens* grafo, int no, int canal, int row, float* dest);
+void _grafoPontual (GrafoImagens* grafo, int no, int canal, int row, int xb, int n, float* dest);
+void _grafoGaussiano (GrafoImagens* grafo, int no, int canal, int row, float* dest);
+void _grafoBlur (GrafoImagens* grafo, int no, int canal, int row, float* dest);
+void _grafoBlurAcumula (double* acumulador, double* s, int n, int subtrai);
+void _grafoMaxMinLocal (GrafoImagens* grafo, int no, int canal, int row, float* dest);
+void _grafoMaxMinSufixos (GrafoImagens* grafo, int no, int inicio);
+void _grafoMaxMinLinhas (float* dest, float* a, float* b, int n, int maximo);
+
+/*============================================================================*/
+/* CRIAÇÃO DO GRAFO                                                           */
+/*============================================================================*/
+/** Cria um grafo vazio.
+ *
+ * Parâmetros: nenhum.
+ *
+ * Valor de retorno: o grafo criado. */
+
+GrafoImagens* criaGrafo ()
+{
+    GrafoImagens* grafo = (GrafoImagens*) malloc (sizeof (GrafoImagens));
+    grafo->nos = NULL;
+    grafo->n_nos = 0;
+    grafo->capacidade = 0;
+    grafo->largura = 0;
+    grafo->altura = 0;
+    grafo->n_canais = 0;
+    return (grafo);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói um grafo. As imagens de entrada não são destruídas.
+ *
+ * Parâmetros: GrafoImagens* grafo: o grafo a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiGrafo (GrafoImagens* grafo)
+{
+    int i;
+
+    for (i = 0; i < grafo->n_nos; i++)
+    {
+        free (grafo->nos [i].coef_x);
+        free (grafo->nos [i].coef_y);
+    }
+    free (grafo->nos);
+    free (grafo);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Funções que registram as operações. Nenhuma calcula nada: todas retornam
+ * o índice do novo nó, para ser usado como entrada de outras operações ou na
+ * executaGrafo. Os parâmetros a, b, condicao, reg_min e reg_max são índices
+ * de nós já criados.
+ *
+ * grafoEntrada: uma imagem de entrada. Ela precisa continuar existindo (e
+ *   com o conteúdo desejado) até a execução.
+ * grafoSoma: a*mul1 + b*mul2, como na soma.
+ * grafoEscala: a*mul + soma.
+ * grafoLimiar: 1 onde a > threshold, 0 nos outros pixels.
+ * grafoSeleciona: a onde condicao > threshold, b nos outros pixels.
+ * grafoNormaliza: leva cada pixel de a da faixa [reg_min, reg_max] (ampliada
+ *   para conter o pixel) para a faixa [min, max], como na normLocalSimples.
+ * grafoBlur: média em uma janela altura x largura, como na blur.
+ * grafoMaxLocal, grafoMinLocal: máximo/mínimo em uma janela altura x
+ *   largura, como na maxLocal/minLocal.
+ * grafoGaussiano: filtro Gaussiano, como na filtroGaussiano (incluindo os
+ *   valores especiais de sigma e o espelhamento nas margens), mas sempre com
+ *   os coeficientes, mesmo para sigmas grandes. */
+
+int grafoEntrada (GrafoImagens* grafo, Imagem* img)
+{
+    if (grafo->n_nos && (img->largura != grafo->largura || img->altura != grafo->altura || img->n_canais != grafo->n_canais))
+    {
+        printf ("ERRO: grafoEntrada: as entradas precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    grafo->largura = img->largura;
+    grafo->altura = img->altura;
+    grafo->n_canais = img->n_canais;
+
+    int no = _grafoNovoNo (grafo, GRAFO_ENTRADA, 0, -1, -1, -1);
+    grafo->nos [no].img = img;
+    return (no);
+}
+
+int grafoSoma (GrafoImagens* grafo, int a, int b, float mul1, float mul2)
+{
+    int no = _grafoNovoNo (grafo, GRAFO_SOMA, 2, a, b, -1);
+    grafo->nos [no].parametros [0] = mul1;
+    grafo->nos [no].parametros [1] = mul2;
+    return (no);
+}
+
+int grafoEscala (GrafoImagens* grafo, int a, float mul, float soma)
+{
+    int no = _grafoNovoNo (grafo, GRAFO_ESCALA, 1, a, -1, -1);
+    grafo->nos [no].parametros [0] = mul;
+    grafo->nos [no].parametros [1] = soma;
+    return (no);
+}
+
+int grafoLimiar (GrafoImagens* grafo, int a, float threshold)
+{
+    int no = _grafoNovoNo (grafo, GRAFO_LIMIAR, 1, a, -1, -1);
+    grafo->nos [no].parametros [0] = threshold;
+    return (no);
+}
+
+int grafoSeleciona (GrafoImagens* grafo, int condicao, float threshold, int a, int b)
+{
+    int no = _grafoNovoNo (grafo, GRAFO_SELECIONA, 3, condicao, a, b);
+    grafo->nos [no].parametros [0] = threshold;
+    return (no);
+}
+
+int grafoNormaliza (GrafoImagens* grafo, int a, int reg_min, int reg_max, float min, float max)
+{
+    int no = _grafoNovoNo (grafo, GRAFO_NORMALIZA, 3, a, reg_min, reg_max);
+    grafo->nos [no].parametros [0] = min;
+    grafo->nos [no].parametros [1] = max;
+    return (no);
+}
+
+int grafoBlur (GrafoImagens* grafo, int a, int altura, int largura)
+{
+    if (altura % 2 == 0 || largura % 2 == 0)
+    {
+        printf ("ERRO: grafoBlur: a janela deve ter largura e altura impares.\n");
+        exit (1);
+    }
+
+    int no = _grafoNovoNo (grafo, GRAFO_BLUR, 1, a, -1, -1);
+    grafo->nos [no].altura = altura;
+    grafo->nos [no].largura = largura;
+    return (no);
+}
+
+int grafoMaxLocal (GrafoImagens* grafo, int a, int altura, int largura)
+{
+    if (altura % 2 == 0 || largura % 2 == 0)
+    {
+        printf ("ERRO: grafoMaxLocal: a janela deve ter largura e altura impares.\n");
+        exit (1);
+    }
+
+    int no = _grafoNovoNo (grafo, GRAFO_MAX_LOCAL, 1, a, -1, -1);
+    grafo->nos [no].altura = altura;
+    grafo->nos [no].largura = largura;
+    return (no);
+}
+
+int grafoMinLocal (GrafoImagens* grafo, int a, int altura, int largura)
+{
+    if (altura % 2 == 0 || largura % 2 == 0)
+    {
+        printf ("ERRO: grafoMinLocal: a janela deve ter largura e altura impares.\n");
+        exit (1);
+    }
+
+    int no = _grafoNovoNo (grafo, GRAFO_MIN_LOCAL, 1, a, -1, -1);
+    grafo->nos [no].altura = altura;
+    grafo->nos [no].largura = largura;
+    return (no);
+}
+
+int grafoGaussiano (GrafoImagens* grafo, int a, float sigmax, float sigmay)
+{
+    int no = _grafoNovoNo (grafo, GRAFO_GAUSSIANO, 1, a, -1, -1);
+    NoGrafo* n = &grafo->nos [no];
+
+    n->n_coef_x = _filtroGaussianoNCoef (sigmax);
+    n->n_coef_y = _filtroGaussianoNCoef (sigmay);
+    if (n->n_coef_x >= grafo->largura*2 || n->n_coef_y >= grafo->altura*2)
+    {
+        printf ("ERRO: grafoGaussiano: vetor de coeficientes grande demais!\n");
+        exit (1);
+    }
+
+    n->coef_x = (float*) malloc (sizeof (float) * n->n_coef_x);
+    n->coef_y = (float*) malloc (sizeof (float) * n->n_coef_y);
+    _filtroGaussianoCalculaCoef (n->n_coef_x, sigmax, n->coef_x);
+    _filtroGaussianoCalculaCoef (n->n_coef_y, sigmay, n->coef_y);
+    n->largura = n->n_coef_x;
+    n->altura = n->n_coef_y;
+    return (no);
+}
+
+/*============================================================================*/
+/* EXECUÇÃO                                                                   */
+/*============================================================================*/
+/** Calcula um nó do grafo e o coloca em uma imagem. Só os nós de que ele
+ * depende são calculados.
+ *
+ * Parâmetros: GrafoImagens* grafo: o grafo.
+ *             int no: o nó a calcular.
+ *             Imagem* out: imagem de saída, do tamanho das entradas. Pode ser
+ *               uma das entradas.
+ *
+ * Valor de retorno: nenhum. */
+
+void executaGrafo (GrafoImagens* grafo, int no, Imagem* out)
+{
+    int i, canal, row;
+
+    if (no < 0 || no >= grafo->n_nos)
+    {
+        printf ("ERRO: executaGrafo: no invalido.\n");
+        exit (1);
+    }
+
+    if (out->largura != grafo->largura || out->altura != grafo->altura || out->n_canais != grafo->n_canais)
+    {
+        printf ("ERRO: executaGrafo: a saida precisa ter o tamanho e o numero de canais das entradas.\n");
+        exit (1);
+    }
+
+    _grafoPlaneja (grafo, no);
+
+    // Memória usada por coluna, para escolher a largura das faixas.
+    size_t bytes_por_coluna = 0;
+    int sobrescreve = 0;
+    for (i = 0; i <= no; i++)
+    {
+        NoGrafo* n = &grafo->nos [i];
+        if (!n->usado)
+            continue;
+        bytes_por_coluna += n->n_linhas * sizeof (float) + n->n_internas * ((n->tipo == GRAFO_BLUR)? sizeof (double) : sizeof (float));
+        if (n->acumulador)
+            bytes_por_coluna += sizeof (double);
+        if (n->tipo == GRAFO_ENTRADA && n->img == out && n->margem > 0)
+            sobrescreve = 1;
+    }
+
+    // Se a saída é uma entrada lida com margem, uma faixa estragaria a margem
+    // da seguinte; nesse caso, a imagem é processada inteira.
+    int faixa = grafo->largura;
+    if (!sobrescreve && bytes_por_coluna * grafo->largura > GRAFO_CACHE_BYTES)
+        faixa = MAX ((int) (GRAFO_CACHE_BYTES / bytes_por_coluna), GRAFO_FAIXA_MIN);
+
+    int inicio;
+    for (canal = 0; canal < grafo->n_canais; canal++)
+        for (inicio = 0; inicio < grafo->largura; inicio += faixa)
+        {
+            int fim = MIN (inicio + faixa, grafo->largura) - 1;
+
+            for (i = 0; i <= no; i++)
+            {
+                NoGrafo* n = &grafo->nos [i];
+                n->x0 = MAX (0, inicio - n->margem);
+                n->x1 = MIN (grafo->largura - 1, fim + n->margem);
+                n->proxima = 0;
+                n->proxima_interna = 0;
+            }
+
+            for (row = 0; row < grafo->altura; row++)
+                _grafoCalculaLinha (grafo, no, canal, row, out->dados [canal][row]);
+        }
+
+    _grafoLiberaPlano (grafo);
+}
+
+/*============================================================================*/
+/* FUNÇÕES INTERNAS                                                           */
+/*============================================================================*/
+/** Acrescenta um nó ao grafo.
+ *
+ * Parâmetros: GrafoImagens* grafo: o grafo.
+ *             int tipo: tipo do nó.
+ *             int n_entradas: número de entradas (0 a 3).
+ *             int a, b, c: índices dos nós de entrada.
+ *
+ * Valor de retorno: o índice do nó. */
+
+int _grafoNovoNo (GrafoImagens* grafo, int tipo, int n_entradas, int a, int b, int c)
+{
+    int i, entradas [3] = {a, b, c};
+
+    for (i = 0; i < n_entradas; i++)
+        if (entradas [i] < 0 || entradas [i] >= grafo->n_nos)
+        {
+            printf ("ERRO: grafo: no de entrada invalido.\n");
+            exit (1);
+        }
+
+    if (grafo->n_nos == grafo->capacidade)
+    {
+        grafo->capacidade = (grafo->capacidade)? grafo->capacidade * 2 : 16;
+        grafo->nos = (NoGrafo*) realloc (grafo->nos, sizeof (NoGrafo) * grafo->capacidade);
+    }
+
+    NoGrafo* n = &grafo->nos [grafo->n_nos];
+    memset (n, 0, sizeof (NoGrafo));
+    n->tipo = tipo;
+    n->n_entradas = n_entradas;
+    for (i = 0; i < 3; i++)
+        n->entradas [i] = entradas [i];
+
+    return (grafo->n_nos++);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Monta o plano de execução para calcular o nó saida: marca os nós usados,
+ * decide quais são fundidos, e calcula quantas linhas e colunas extras cada
+ * um precisa guardar. Como um nó só pode usar nós criados antes dele, a
+ * ordem dos índices já é uma ordem topológica.
+ *
+ * Um filtro de vizinhança na linha row pede à sua entrada linhas entre row e
+ * row + altura/2 (as anteriores ele já guardou filtradas na horizontal), e
+ * as operações pixel a pixel pedem a linha row. Então, quando a saída está
+ * na linha s, cada nó é pedido entre s e s + avanco, e um buffer circular
+ * com avanco+1 linhas basta.
+ *
+ * Parâmetros: GrafoImagens* grafo: o grafo.
+ *             int saida: o nó a calcular.
+ *
+ * Valor de retorno: nenhum. */
+
+void _grafoPlaneja (GrafoImagens* grafo, int saida)
+{
+    int i, j, k;
+
+    for (i = 0; i < grafo->n_nos; i++)
+    {
+        grafo->nos [i].usado = 0;
+        grafo->nos [i].n_consumidores = 0;
+        grafo->nos [i].avanco = 0;
+        grafo->nos [i].margem = 0;
+    }
+
+    // Nós usados e número de consumidores.
+    grafo->nos [saida].usado = 1;
+    for (i = saida; i >= 0; i--)
+    {
+        NoGrafo* n = &grafo->nos [i];
+        if (!n->usado)
+            continue;
+
+        for (j = 0; j < n->n_entradas; j++)
+        {
+            NoGrafo* e = &grafo->nos [n->entradas [j]];
+            e->usado = 1;
+            e->n_consumidores++;
+
+            int vizinhanca = (n->tipo == GRAFO_BLUR || n->tipo == GRAFO_MAX_LOCAL ||
+                              n->tipo == GRAFO_MIN_LOCAL || n->tipo == GRAFO_GAUSSIANO);
+            int avanco = n->avanco + ((vizinhanca)? n->altura/2 : 0);
+            int margem = n->margem + ((vizinhanca)? n->largura/2 : 0);
+            e->avanco = MAX (e->avanco, avanco);
+            e->margem = MAX (e->margem, margem);
+        }
+    }
+
+    // Buffers.
+    for (i = 0; i <= saida; i++)
+    {
+        NoGrafo* n = &grafo->nos [i];
+        n->fundido = 0;
+        n->n_linhas = 0;
+        n->linhas = NULL;
+        n->n_internas = 0;
+        n->internas = NULL;
+        n->acumulador = NULL;
+        n->bloco = NULL;
+        n->extremos = NULL;
+        if (!n->usado)
+            continue;
+
+        int pontual = (n->tipo == GRAFO_SOMA || n->tipo == GRAFO_ESCALA || n->tipo == GRAFO_LIMIAR ||
+                       n->tipo == GRAFO_SELECIONA || n->tipo == GRAFO_NORMALIZA);
+
+        // Um nó pixel a pixel usado só por outro nó pixel a pixel é fundido
+        // com ele.
+        if (pontual && i != saida && n->n_consumidores == 1)
+        {
+            for (j = i+1; j <= saida; j++)
+            {
+                NoGrafo* c = &grafo->nos [j];
+                if (!c->usado)
+                    continue;
+                for (k = 0; k < c->n_entradas; k++)
+                    if (c->entradas [k] == i)
+                        n->fundido = (c->tipo == GRAFO_SOMA || c->tipo == GRAFO_ESCALA || c->tipo == GRAFO_LIMIAR ||
+                                      c->tipo == GRAFO_SELECIONA || c->tipo == GRAFO_NORMALIZA);
+            }
+        }
+
+        if (n->fundido)
+            n->bloco = (float*) malloc (sizeof (float) * GRAFO_BLOCO);
+        else if (n->tipo != GRAFO_ENTRADA && i != saida)
+        {
+            n->n_linhas = n->avanco + 1;
+            n->linhas = (float**) malloc (sizeof (float*) * n->n_linhas);
+            for (j = 0; j < n->n_linhas; j++)
+                n->linhas [j] = (float*) malloc (sizeof (float) * grafo->largura);
+        }
+
+        if (n->tipo == GRAFO_BLUR)
+        {
+            // Somas horizontais das linhas row-h-1 a row+h.
+            n->n_internas = MIN (n->altura + 1, grafo->altura);
+            n->internas = (void**) malloc (sizeof (void*) * n->n_internas);
+            for (j = 0; j < n->n_internas; j++)
+                n->internas [j] = malloc (sizeof (double) * grafo->largura);
+            n->acumulador = (double*) malloc (sizeof (double) * grafo->largura);
+        }
+        else if (n->tipo == GRAFO_MAX_LOCAL || n->tipo == GRAFO_MIN_LOCAL)
+        {
+            // Máximos (ou mínimos) horizontais das últimas linhas, os sufixos
+            // de um bloco de altura linhas e o prefixo do bloco atual (ver a
+            // _grafoMaxMinLocal).
+            n->n_internas = MIN (n->altura, grafo->altura) + n->altura + 1;
+            n->internas = (void**) malloc (sizeof (void*) * n->n_internas);
+            for (j = 0; j < n->n_internas; j++)
+                n->internas [j] = malloc (sizeof (float) * grafo->largura);
+            n->extremos = (float*) malloc (sizeof (float) * (grafo->largura + n->largura) * 2);
+        }
+        else if (!pontual && n->tipo != GRAFO_ENTRADA)
+        {
+            n->n_internas = MIN (n->altura, grafo->altura);
+            n->internas = (void**) malloc (sizeof (void*) * n->n_internas);
+            for (j = 0; j < n->n_internas; j++)
+                n->internas [j] = malloc (sizeof (float) * grafo->largura);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Libera os buffers alocados pela _grafoPlaneja. */
+
+void _grafoLiberaPlano (GrafoImagens* grafo)
+{
+    int i, j;
+
+    for (i = 0; i < grafo->n_nos; i++)
+    {
+        NoGrafo* n = &grafo->nos [i];
+        for (j = 0; j < n->n_linhas; j++)
+            free (n->linhas [j]);
+        for (j = 0; j < n->n_internas; j++)
+            free (n->internas [j]);
+        free (n->linhas);
+        free (n->internas);
+        free (n->acumulador);
+        free (n->bloco);
+        free (n->extremos);
+        n->n_linhas = 0;
+        n->linhas = NULL;
+        n->n_internas = 0;
+        n->internas = NULL;
+        n->acumulador = NULL;
+        n->bloco = NULL;
+        n->extremos = NULL;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Retorna uma linha de um nó (não fundido), calculando as linhas que faltam
+ * até ela. A linha é indexada pela coluna da imagem, e vale nas colunas
+ * x0 a x1 do nó. */
+
+float* _grafoLinha (GrafoImagens* grafo, int no, int canal, int row)
+{
+    NoGrafo* n = &grafo->nos [no];
+
+    if (n->tipo == GRAFO_ENTRADA)
+        return (n->img->dados [canal][row]);
+
+    if (row < n->proxima - n->n_linhas)
+    {
+        printf ("ERRO: executaGrafo: linha %d do no %d ja foi descartada.\n", row, no);
+        exit (1);
+    }
+
+    for (; n->proxima <= row; n->proxima++)
+        _grafoCalculaLinha (grafo, no, canal, n->proxima, n->linhas [n->proxima % n->n_linhas]);
+
+    return (n->linhas [row % n->n_linhas]);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Retorna os valores de um nó nas colunas xb a xb+n-1 de uma linha. Se o nó
+ * for fundido, eles são calculados agora, no bloco do nó (indexado a partir
+ * de 0); se não, o ponteiro aponta para a linha do nó, já na coluna xb. */
+
+float* _grafoOperando (GrafoImagens* grafo, int no, int canal, int row, int xb, int n)
+{
+    NoGrafo* e = &grafo->nos [no];
+
+    if (e->fundido)
+    {
+        _grafoPontual (grafo, no, canal, row, xb, n, e->bloco);
+        return (e->bloco);
+    }
+
+    return (_grafoLinha (grafo, no, canal, row) + xb);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Calcula as colunas x0 a x1 de uma linha de um nó, em dest (indexado pela
+ * coluna da imagem). As linhas de cada nó são calculadas em ordem. */
+
+void _grafoCalculaLinha (GrafoImagens* grafo, int no, int canal, int row, float* dest)
+{
+    NoGrafo* n = &grafo->nos [no];
+    int xb;
+
+    switch (n->tipo)
+    {
+        case GRAFO_ENTRADA:
+            if (dest != n->img->dados [canal][row])
+                memcpy (dest + n->x0, n->img->dados [canal][row] + n->x0, sizeof (float) * (n->x1 - n->x0 + 1));
+            break;
+
+        case GRAFO_BLUR:
+            _grafoBlur (grafo, no, canal, row, dest);
+            break;
+
+        case GRAFO_MAX_LOCAL:
+        case GRAFO_MIN_LOCAL:
+            _grafoMaxMinLocal (grafo, no, canal, row, dest);
+            break;
+
+        case GRAFO_GAUSSIANO:
+            _grafoGaussiano (grafo, no, canal, row, dest);
+            break;
+
+        default: // Pixel a pixel, em blocos.
+            for (xb = n->x0; xb <= n->x1; xb += GRAFO_BLOCO)
+                _grafoPontual (grafo, no, canal, row, xb, MIN (GRAFO_BLOCO, n->x1 - xb + 1), dest + xb);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Calcula um bloco de n pixels de um nó pixel a pixel, a partir da coluna
+ * xb. As entradas fundidas são calculadas antes, nos seus próprios blocos.
+ * Com SSE2, 4 pixels são calculados por vez, com as mesmas operações (e o
+ * mesmo resultado) da versão escalar, que fica para o resto do bloco. */
+
+void _grafoPontual (GrafoImagens* grafo, int no, int canal, int row, int xb, int n, float* dest)
+{
+    NoGrafo* nd = &grafo->nos [no];
+    float* a = _grafoOperando (grafo, nd->entradas [0], canal, row, xb, n);
+    float* b = (nd->n_entradas > 1)? _grafoOperando (grafo, nd->entradas [1], canal, row, xb, n) : NULL;
+    float* c = (nd->n_entradas > 2)? _grafoOperando (grafo, nd->entradas [2], canal, row, xb, n) : NULL;
+    float p0 = nd->parametros [0], p1 = nd->parametros [1];
+    int i = 0;
+
+#if defined (__SSE2__)
+    const __m128 v0 = _mm_set1_ps (p0), v1 = _mm_set1_ps (p1);
+#endif
+
+    switch (nd->tipo)
+    {
+        case GRAFO_SOMA:
+#if defined (__SSE2__)
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps (dest + i, _mm_add_ps (_mm_mul_ps (_mm_loadu_ps (a + i), v0), _mm_mul_ps (_mm_loadu_ps (b + i), v1)));
+#endif
+            for (; i < n; i++)
+                dest [i] = a [i]*p0 + b [i]*p1;
+            break;
+
+        case GRAFO_ESCALA:
+#if defined (__SSE2__)
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps (dest + i, _mm_add_ps (_mm_mul_ps (_mm_loadu_ps (a + i), v0), v1));
+#endif
+            for (; i < n; i++)
+                dest [i] = a [i]*p0 + p1;
+            break;
+
+        case GRAFO_LIMIAR:
+#if defined (__SSE2__)
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps (dest + i, _mm_and_ps (_mm_cmpgt_ps (_mm_loadu_ps (a + i), v0), _mm_set1_ps (1.0f)));
+#endif
+            for (; i < n; i++)
+                dest [i] = (a [i] > p0)? 1 : 0;
+            break;
+
+        case GRAFO_SELECIONA:
+#if defined (__SSE2__)
+            for (; i + 4 <= n; i += 4)
+            {
+                __m128 m = _mm_cmpgt_ps (_mm_loadu_ps (a + i), v0);
+                _mm_storeu_ps (dest + i, _mm_or_ps (_mm_and_ps (m, _mm_loadu_ps (b + i)), _mm_andnot_ps (m, _mm_loadu_ps (c + i))));
+            }
+#endif
+            // Lendo os dois valores antes, a escolha não precisa de desvio.
+            for (; i < n; i++)
+            {
+                float vb = b [i], vc = c [i];
+                dest [i] = (a [i] > p0)? vb : vc;
+            }
+            break;
+
+        case GRAFO_NORMALIZA:
+        {
+            float intervalo_out = p1 - p0;
+#if defined (__SSE2__)
+            // As duas saídas são calculadas, e a comparação escolhe uma.
+            const __m128 v_out = _mm_set1_ps (intervalo_out);
+            for (; i + 4 <= n; i += 4)
+            {
+                __m128 val = _mm_loadu_ps (a + i);
+                __m128 region_min = _mm_min_ps (_mm_loadu_ps (b + i), val);
+                __m128 region_max = _mm_max_ps (_mm_loadu_ps (c + i), val);
+                __m128 intervalo_in = _mm_sub_ps (region_max, region_min);
+                __m128 norm = _mm_add_ps (_mm_mul_ps (_mm_div_ps (_mm_sub_ps (val, region_min), intervalo_in), v_out), v0);
+                __m128 igual = _mm_cmpeq_ps (intervalo_in, v_out);
+                _mm_storeu_ps (dest + i, _mm_or_ps (_mm_and_ps (igual, val), _mm_andnot_ps (igual, norm)));
+            }
+#endif
+            for (; i < n; i++)
+            {
+                float val = a [i];
+                float region_min = MIN (b [i], val);
+                float region_max = MAX (c [i], val);
+                float intervalo_in = region_max - region_min;
+
+                if (intervalo_in == intervalo_out)
+                    dest [i] = val; // Região já está normalizada.
+                else
+                    dest [i] = (val - region_min) / intervalo_in * intervalo_out + p0;
+            }
+            break;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Filtro Gaussiano em uma linha. As linhas da entrada são filtradas na
+ * horizontal uma vez só, e as altura últimas ficam no buffer interno. Como
+ * na filtro1D, cada coeficiente é aplicado a um trecho de linha de uma vez
+ * (_filtro1DAcumula), e só as colunas das margens, espelhadas, são
+ * calculadas uma a uma. As somas seguem a mesma ordem da filtro1D, então o
+ * resultado é idêntico ao da filtroGaussiano. */
+
+void _grafoGaussiano (GrafoImagens* grafo, int no, int canal, int row, float* dest)
+{
+    NoGrafo* n = &grafo->nos [no];
+    int largura = grafo->largura, altura = grafo->altura;
+    int cx = n->n_coef_x/2, cy = n->n_coef_y/2;
+    int col, i, pos;
+
+    // Colunas da faixa que não precisam de espelhamento.
+    int inicio_meio = MIN (MAX (cx, n->x0), n->x1 + 1);
+    int fim_meio = MAX (MIN (largura - cx, n->x1 + 1), inicio_meio);
+
+    for (; n->proxima_interna <= MIN (row + cy, altura-1); n->proxima_interna++)
+    {
+        float* in = _grafoLinha (grafo, n->entradas [0], canal, n->proxima_interna);
+        float* h = (float*) n->internas [n->proxima_interna % n->n_internas];
+
+        for (col = inicio_meio; col < fim_meio; col++)
+            h [col] = 0;
+        for (i = -cx; i <= cx; i++)
+            _filtro1DAcumula (h + inicio_meio, in + inicio_meio + i, n->coef_x [cx+i], fim_meio - inicio_meio);
+
+        for (col = n->x0; col <= n->x1; col++)
+        {
+            if (col == inicio_meio)
+                col = fim_meio;
+            if (col > n->x1)
+                break;
+
+            float soma = 0;
+            for (i = -cx; i <= cx; i++)
+            {
+                pos = col + i;
+                if (pos < 0)
+                    pos = -pos;
+                else if (pos >= largura)
+                    pos = largura*2 - pos - 2;
+                soma += in [pos] * n->coef_x [cx+i];
+            }
+            h [col] = soma;
+        }
+    }
+
+    for (col = n->x0; col <= n->x1; col++)
+        dest [col] = 0;
+    for (i = -cy; i <= cy; i++)
+    {
+        pos = row + i;
+        if (pos < 0)
+            pos = -pos;
+        else if (pos >= altura)
+            pos = altura*2 - pos - 2;
+
+        float* h = (float*) n->internas [pos % n->n_internas];
+        _filtro1DAcumula (dest + n->x0, h + n->x0, n->coef_y [cy+i], n->x1 - n->x0 + 1);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Média em uma janela, em uma linha. As somas horizontais de cada linha da
+ * entrada ficam no buffer interno, e o acumulador guarda a soma delas na
+ * janela vertical, atualizada a cada linha (entra a de baixo, sai a de
+ * cima). Nas margens, a janela é cortada, como na blur. As somas
+ * horizontais são feitas como na _filtroCaixaLinha, então o resultado é
+ * idêntico ao da blur. */
+
+void _grafoBlur (GrafoImagens* grafo, int no, int canal, int row, float* dest)
+{
+    NoGrafo* n = &grafo->nos [no];
+    int largura = grafo->largura, altura = grafo->altura;
+    int w = n->largura/2, h = n->altura/2;
+    int col, k;
+
+    for (; n->proxima_interna <= MIN (row + h, altura-1); n->proxima_interna++)
+    {
+        float* in = _grafoLinha (grafo, n->entradas [0], canal, n->proxima_interna);
+        double* s = (double*) n->internas [n->proxima_interna % n->n_internas];
+
+        double soma = 0;
+        for (k = MAX (0, n->x0 - w); k <= MIN (largura-1, n->x0 + w); k++)
+            soma += in [k];
+        s [n->x0] = soma;
+
+        // Primeiro só entram pixels, depois entram e saem, e no fim só saem.
+        for (col = n->x0 + 1; col <= n->x1 && col - w - 1 < 0; col++)
+        {
+            if (col + w < largura)
+                soma += in [col + w];
+            s [col] = soma;
+        }
+        for (; col <= n->x1 && col + w < largura; col++)
+        {
+            soma += (double) in [col + w] - in [col - w - 1];
+            s [col] = soma;
+        }
+        for (; col <= n->x1; col++)
+        {
+            soma -= in [col - w - 1];
+            s [col] = soma;
+        }
+    }
+
+    double* acumulador = n->acumulador;
+    if (row == 0)
+    {
+        for (col = n->x0; col <= n->x1; col++)
+            acumulador [col] = 0;
+        for (k = 0; k <= MIN (h, altura-1); k++)
+            _grafoBlurAcumula (acumulador + n->x0, (double*) n->internas [k % n->n_internas] + n->x0, n->x1 - n->x0 + 1, 0);
+    }
+    else
+    {
+        if (row + h < altura)
+            _grafoBlurAcumula (acumulador + n->x0, (double*) n->internas [(row + h) % n->n_internas] + n->x0, n->x1 - n->x0 + 1, 0);
+        if (row - h - 1 >= 0)
+            _grafoBlurAcumula (acumulador + n->x0, (double*) n->internas [(row - h - 1) % n->n_internas] + n->x0, n->x1 - n->x0 + 1, 1);
+    }
+
+    // Longe das margens, a janela tem sempre largura colunas.
+    int n_linhas = MIN (altura-1, row + h) - MAX (0, row - h) + 1;
+    int inicio_meio = MIN (MAX (w, n->x0), n->x1 + 1);
+    int fim_meio = MAX (MIN (largura - w, n->x1 + 1), inicio_meio);
+    double divisor = n->largura * n_linhas;
+
+    for (col = n->x0; col < inicio_meio; col++)
+        dest [col] = (float) (acumulador [col] / ((MIN (largura-1, col + w) - MAX (0, col - w) + 1) * n_linhas));
+#if defined (__SSE2__)
+    const __m128d d2 = _mm_set1_pd (divisor);
+    for (; col + 4 <= fim_meio; col += 4)
+    {
+        __m128 baixo = _mm_cvtpd_ps (_mm_div_pd (_mm_loadu_pd (acumulador + col), d2));
+        __m128 alto = _mm_cvtpd_ps (_mm_div_pd (_mm_loadu_pd (acumulador + col + 2), d2));
+        _mm_storeu_ps (dest + col, _mm_movelh_ps (baixo, alto));
+    }
+#endif
+    for (; col < fim_meio; col++)
+        dest [col] = (float) (acumulador [col] / divisor);
+    for (; col <= n->x1; col++)
+        dest [col] = (float) (acumulador [col] / ((MIN (largura-1, col + w) - MAX (0, col - w) + 1) * n_linhas));
+}
+
+/*----------------------------------------------------------------------------*/
+/** Soma (ou, se subtrai != 0, subtrai) uma linha de somas horizontais ao
+ * acumulador do blur, em n posições. */
+
+void _grafoBlurAcumula (double* acumulador, double* s, int n, int subtrai)
+{
+    int i = 0;
+
+    if (subtrai)
+    {
+#if defined (__SSE2__)
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm_storeu_pd (acumulador + i, _mm_sub_pd (_mm_loadu_pd (acumulador + i), _mm_loadu_pd (s + i)));
+            _mm_storeu_pd (acumulador + i + 2, _mm_sub_pd (_mm_loadu_pd (acumulador + i + 2), _mm_loadu_pd (s + i + 2)));
+        }
+#endif
+        for (; i < n; i++)
+            acumulador [i] -= s [i];
+    }
+    else
+    {
+#if defined (__SSE2__)
+        for (; i + 4 <= n; i += 4)
+        {
+            _mm_storeu_pd (acumulador + i, _mm_add_pd (_mm_loadu_pd (acumulador + i), _mm_loadu_pd (s + i)));
+            _mm_storeu_pd (acumulador + i + 2, _mm_add_pd (_mm_loadu_pd (acumulador + i + 2), _mm_loadu_pd (s + i + 2)));
+        }
+#endif
+        for (; i < n; i++)
+            acumulador [i] += s [i];
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Máximo ou mínimo em uma janela, em uma linha, com o algoritmo de van Herk
+ * e Gil-Werman: com a linha dividida em blocos do tamanho da janela, toda
+ * janela cobre o fim de um bloco e o começo do seguinte, e o resultado é o
+ * extremo entre um sufixo de um bloco e um prefixo do outro. Isso custa 3
+ * comparações por pixel, qualquer que seja a janela.
+ *
+ * Na horizontal, os prefixos e sufixos de cada linha da entrada são
+ * calculados no buffer extremos. Na vertical, as linhas já filtradas na
+ * horizontal ficam no buffer interno; quando um bloco de linhas termina, os
+ * sufixos dele são calculados (_grafoMaxMinSufixos), e o prefixo do bloco
+ * atual é atualizado a cada linha. Nas margens, a janela é cortada. */
+
+void _grafoMaxMinLocal (GrafoImagens* grafo, int no, int canal, int row, float* dest)
+{
+    NoGrafo* n = &grafo->nos [no];
+    int largura = grafo->largura, altura = grafo->altura;
+    int w = n->largura/2, h = n->altura/2;
+    int maximo = (n->tipo == GRAFO_MAX_LOCAL);
+    float vazio = (maximo)? -FLT_MAX : FLT_MAX;
+    int n_ring = MIN (n->altura, altura);
+    float* prefixo = (float*) n->internas [n->n_internas - 1];
+    int i, b;
+
+    // Blocos de linhas começam em -h, -h + altura, -h + 2*altura...
+    #define _GRAFO_INICIO_BLOCO(y) ((y) - ((y) + h) % n->altura)
+
+    // Colunas x0-w a x1+w, com as de fora da imagem vazias.
+    int inicio = n->x0 - w, tamanho = n->x1 - n->x0 + 1 + 2*w;
+    float* prefixos = n->extremos;
+    float* sufixos = n->extremos + tamanho;
+
+    for (; n->proxima_interna <= MIN (row + h, altura-1); n->proxima_interna++)
+    {
+        int y = n->proxima_interna;
+        int bloco = _GRAFO_INICIO_BLOCO (y);
+
+        // As linhas do bloco anterior ainda estão no buffer interno.
+        if (y == 0)
+            n->bloco_sufixos = -h - n->altura;
+        else if (y == bloco)
+            _grafoMaxMinSufixos (grafo, no, bloco - n->altura);
+
+        float* in = _grafoLinha (grafo, n->entradas [0], canal, y);
+        float* m = (float*) n->internas [y % n_ring];
+
+        for (i = 0; i < tamanho; i++)
+            sufixos [i] = (inicio + i >= 0 && inicio + i < largura)? in [inicio + i] : vazio;
+
+        for (b = 0; b < tamanho; b += n->largura)
+        {
+            int fim = MIN (b + n->largura, tamanho) - 1;
+            prefixos [b] = sufixos [b];
+            if (maximo)
+            {
+                for (i = b+1; i <= fim; i++)
+                    prefixos [i] = MAX (prefixos [i-1], sufixos [i]);
+                for (i = fim-1; i >= b; i--)
+                    sufixos [i] = MAX (sufixos [i+1], sufixos [i]);
+            }
+            else
+            {
+                for (i = b+1; i <= fim; i++)
+                    prefixos [i] = MIN (prefixos [i-1], sufixos [i]);
+                for (i = fim-1; i >= b; i--)
+                    sufixos [i] = MIN (sufixos [i+1], sufixos [i]);
+            }
+        }
+
+        // A janela da coluna col vai de col-w (posição col-x0) a col+w.
+        _grafoMaxMinLinhas (m + n->x0, sufixos, prefixos + 2*w, n->x1 - n->x0 + 1, maximo);
+
+        if (y == MAX (bloco, 0))
+            memcpy (prefixo + n->x0, m + n->x0, sizeof (float) * (n->x1 - n->x0 + 1));
+        else
+            _grafoMaxMinLinhas (prefixo + n->x0, prefixo + n->x0, m + n->x0, n->x1 - n->x0 + 1, maximo);
+    }
+
+    // A janela vai de row-h a row+h. Se row-h começa um bloco, ela é o prefixo
+    // do bloco até row+h; senão, é o sufixo de row-h no bloco anterior mais o
+    // prefixo até row+h (vazio, se o bloco começa depois da última linha).
+    int bloco = _GRAFO_INICIO_BLOCO (row + h);
+    #undef _GRAFO_INICIO_BLOCO
+
+    if (row - h == bloco)
+    {
+        memcpy (dest + n->x0, prefixo + n->x0, sizeof (float) * (n->x1 - n->x0 + 1));
+        return;
+    }
+
+    if (n->bloco_sufixos != bloco - n->altura)
+        _grafoMaxMinSufixos (grafo, no, bloco - n->altura);
+
+    float* sufixo = (float*) n->internas [n_ring + MAX (row - h, 0) - n->bloco_sufixos];
+    if (bloco > altura-1)
+        memcpy (dest + n->x0, sufixo + n->x0, sizeof (float) * (n->x1 - n->x0 + 1));
+    else
+        _grafoMaxMinLinhas (dest + n->x0, sufixo + n->x0, prefixo + n->x0, n->x1 - n->x0 + 1, maximo);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Calcula os sufixos verticais do bloco de linhas que começa em inicio, a
+ * partir das linhas filtradas na horizontal, que precisam estar todas no
+ * buffer interno. O sufixo da linha y fica na posição y - inicio, depois do
+ * buffer circular. */
+
+void _grafoMaxMinSufixos (GrafoImagens* grafo, int no, int inicio)
+{
+    NoGrafo* n = &grafo->nos [no];
+    int n_ring = MIN (n->altura, grafo->altura);
+    int maximo = (n->tipo == GRAFO_MAX_LOCAL);
+    int ultima = MIN (inicio + n->altura, grafo->altura) - 1;
+    int y;
+
+    float* sufixo = (float*) n->internas [n_ring + ultima - inicio];
+    float* m = (float*) n->internas [ultima % n_ring];
+    memcpy (sufixo + n->x0, m + n->x0, sizeof (float) * (n->x1 - n->x0 + 1));
+
+    for (y = ultima-1; y >= MAX (inicio, 0); y--)
+    {
+        float* anterior = sufixo;
+        sufixo = (float*) n->internas [n_ring + y - inicio];
+        m = (float*) n->internas [y % n_ring];
+        _grafoMaxMinLinhas (sufixo + n->x0, m + n->x0, anterior + n->x0, n->x1 - n->x0 + 1, maximo);
+    }
+
+    n->bloco_sufixos = inicio;
+}
+
+/*----------------------------------------------------------------------------*/
+/** dest [i] = máximo (ou mínimo) entre a [i] e b [i], para i de 0 a n-1. dest
+ * pode ser a ou b. */
+
+void _grafoMaxMinLinhas (float* dest, float* a, float* b, int n, int maximo)
+{
+    int i = 0;
+
+    // _mm_max_ps e _mm_min_ps escolhem o segundo operando nos empates, como
+    // as macros MAX e MIN.
+    if (maximo)
+    {
+#if defined (__SSE2__)
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps (dest + i, _mm_max_ps (_mm_loadu_ps (a + i), _mm_loadu_ps (b + i)));
+#endif
+        for (; i < n; i++)
+            dest [i] = MAX (a [i], b [i]);
+    }
+    else
+    {
+#if defined (__SSE2__)
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps (dest + i, _mm_min_ps (_mm_loadu_ps (a + i), _mm_loadu_ps (b + i)));
+#endif
+        for (; i < n; i++)
+            dest [i] = MIN (a [i], b [i]);
+    }
+}
+
+/*============================================================================*/
@@ -0,0 +1,115 @@
+/*============================================================================*/
+/* GRAFOS DE OPERAÇÕES                                                        */
+/*============================================================================*/
+/** Tipos e funções para montar uma sequência de operações sobre imagens e
+ * executá-la de uma vez, sem criar as imagens intermediárias. */
+/*============================================================================*/
+
+#ifndef __GRAFO_H
+#define __GRAFO_H
+
+/*============================================================================*/
+
+#include "imagem.h"
+
+/*============================================================================*/
+/* As operações são só registradas (grafoSoma, grafoBlur etc. retornam o
+ * índice de um nó) e nada é calculado até a executaGrafo. Na execução:
+ *
+ * - A imagem é percorrida linha por linha. Cada nó guarda só as linhas que
+ *   ainda serão usadas por quem depende dele, em um buffer circular, e os
+ *   filtros de vizinhança guardam as linhas da entrada já filtradas na
+ *   horizontal.
+ * - Operações pixel a pixel em sequência (um nó que só é usado por outra
+ *   operação pixel a pixel) são fundidas: são calculadas juntas, em blocos
+ *   de GRAFO_BLOCO pixels, e não ocupam linhas próprias.
+ * - Se as linhas de todos os nós não couberem em GRAFO_CACHE_BYTES, a imagem
+ *   é dividida em faixas verticais, cada uma com a margem de colunas que os
+ *   filtros precisam.
+ *
+ * Todas as entradas e a saída precisam ter o mesmo tamanho e número de
+ * canais; cada canal é processado independentemente. A saída pode ser uma
+ * das entradas. */
+
+/* Tipos de nós. */
+#define GRAFO_ENTRADA 0
+#define GRAFO_SOMA 1
+#define GRAFO_ESCALA 2
+#define GRAFO_LIMIAR 3
+#define GRAFO_SELECIONA 4
+#define GRAFO_NORMALIZA 5
+#define GRAFO_BLUR 6
+#define GRAFO_MAX_LOCAL 7
+#define GRAFO_MIN_LOCAL 8
+#define GRAFO_GAUSSIANO 9
+
+/* Número de pixels calculados de cada vez nas operações fundidas. */
+#define GRAFO_BLOCO 256
+
+/* Memória para as linhas dos nós antes de dividir a imagem em faixas. */
+#define GRAFO_CACHE_BYTES (512 << 10)
+
+/* Largura mínima de uma faixa. */
+#define GRAFO_FAIXA_MIN 64
+
+typedef struct
+{
+    int tipo;
+    int entradas [3];
+    int n_entradas;
+    float parametros [4];
+    int altura; /* Janela dos filtros de vizinhança. */
+    int largura;
+    Imagem* img; /* Nos nós de entrada. */
+    float* coef_x; /* Coeficientes do filtro Gaussiano. */
+    float* coef_y;
+    int n_coef_x;
+    int n_coef_y;
+
+    /* Plano de execução, preenchido pela executaGrafo. */
+    int usado;
+    int n_consumidores;
+    int fundido; /* Calculado dentro de quem o usa, sem linhas próprias. */
+    int avanco; /* Quantas linhas à frente da saída ele pode ser pedido. */
+    int margem; /* Colunas extras, de cada lado da faixa, que ele calcula. */
+    int x0, x1; /* Colunas calculadas na faixa atual. */
+    int n_linhas; /* Tamanho do buffer circular. */
+    float** linhas;
+    int proxima; /* Próxima linha a calcular. */
+    int n_internas; /* Linhas da entrada já filtradas na horizontal. */
+    void** internas;
+    int proxima_interna;
+    double* acumulador; /* Somas das colunas, no blur. */
+    float* bloco; /* Resultado de um bloco, nos nós fundidos. */
+    float* extremos; /* Prefixos e sufixos de uma linha, no máximo/mínimo. */
+    int bloco_sufixos; /* Bloco de linhas com os sufixos, no máximo/mínimo. */
+} NoGrafo;
+
+typedef struct
+{
+    NoGrafo* nos;
+    int n_nos;
+    int capacidade;
+    int largura;
+    int altura;
+    int n_canais;
+} GrafoImagens;
+
+GrafoImagens* criaGrafo ();
+void destroiGrafo (GrafoImagens* grafo);
+
+int grafoEntrada (GrafoImagens* grafo, Imagem* img);
+int grafoSoma (GrafoImagens* grafo, int a, int b, float mul1, float mul2);
+int grafoEscala (GrafoImagens* grafo, int a, float mul, float soma);
+int grafoLimiar (GrafoImagens* grafo, int a, float threshold);
+int grafoSeleciona (GrafoImagens* grafo, int condicao, float threshold, int a, int b);
+int grafoNormaliza (GrafoImagens* grafo, int a, int reg_min, int reg_max, float min, float max);
+int grafoBlur (GrafoImagens* grafo, int a, int altura, int largura);
+int grafoMaxLocal (GrafoImagens* grafo, int a, int altura, int largura);
+int grafoMinLocal (GrafoImagens* grafo, int a, int altura, int largura);
+int grafoGaussiano (GrafoImagens* grafo, int a, float sigmax, float sigmay);
+
+void executaGrafo (GrafoImagens* grafo, int no, Imagem* out);
+
+/*============================================================================*/
+#endif /* __GRAFO_H */
@@ -13,7 +13,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "imagem.h"
 #include "base.h"
@@ -23,21 +30,105 @@
 #define MIN(a,b) ((a<b)?a:b)
 #define MAX(a,b) ((a>b)?a:b)
 
+int _imagemCalculaPasso (int largura);
+void _liberaImagem (Imagem* img);
+void _liberaImagemU8 (ImagemU8* img);
+
+/* Tipos de imagem guardados no pool. */
+#define POOL_FLOAT 0
+#define POOL_U8 1
+
+/* Uma imagem guardada no pool, esperando para ser reaproveitada. */
+typedef struct
+{
+	int tipo; /* POOL_FLOAT ou POOL_U8. */
+	int largura;
+	int altura;
+	int n_canais;
+	size_t bytes; /* Tamanho do bloco de pixels. */
+	void* img;
+} _EntradaPool;
+
+/* O pool de uma thread. As entradas mais antigas ficam no incio. */
+typedef struct
+{
+	_EntradaPool entradas [POOL_MAX_IMAGENS];
+	int n;
+	size_t bytes;
+} _PoolImagens;
+
+static pthread_key_t chave_pool;
+static pthread_once_t chave_pool_criada = PTHREAD_ONCE_INIT;
+void _poolCriaChave ();
+_PoolImagens* _poolDaThread (int cria);
+void _poolDestroi (void* pool);
+void* _poolRetira (int tipo, int largura, int altura, int n_canais);
+int _poolDevolve (int tipo, void* img, int largura, int altura, int n_canais, size_t bytes);
+void _poolDescarta (_EntradaPool* entrada);
+void _arenaAdiciona (ArenaImagens* arena, void* img, int tipo);
+
+/* Dimenses e formato dos dados de um arquivo bmp, lidos dos cabealhos. */
+typedef struct
+{
+	int largura;
+	int altura; /* Sempre positiva. */
+	int invertida; /* 1 se as linhas esto guardadas de cima para baixo. */
+	int bpp; /* 8, 24 ou 32. */
+	unsigned long largura_linha; /* Bytes por linha no arquivo, com o preenchimento. */
+	unsigned long tamanho_header; /* Bytes lidos pela leHeaderDIB (header, mscaras e paleta). */
+	int cinza; /* 1 se a paleta (8 bpp)  a escala de cinza, com paleta [i] = (i,i,i). */
+	unsigned char paleta [256][4]; /* R, G, B e cinza de cada ndice (8 bpp). */
+	float paleta_float [4][256]; /* O mesmo, j convertido para float. */
+} _FormatoBMP;
+
+FILE* abreArquivoBMP (char* arquivo, _FormatoBMP* formato);
 unsigned long getLittleEndianULong (unsigned char* buffer);
-int leHeaderBitmap (FILE* stream, unsigned long* offset);
-int leHeaderDIB (FILE* stream, unsigned long* largura, unsigned long* altura);
-int leDados (FILE* stream, Imagem* img);
+unsigned short getLittleEndianUShort (unsigned char* buffer);
+int leHeaderBitmap (FILE* stream, unsigned long* offset, unsigned long* tamanho);
+int leHeaderDIB (FILE* stream, _FormatoBMP* formato);
+int leDados (FILE* stream, _FormatoBMP* formato, Imagem* img);
+
+/* Dados de uma faixa de linhas convertida por uma thread durante a leitura. */
+typedef struct
+{
+	unsigned char* bytes; /* Bloco de dados lido do arquivo. */
+	_FormatoBMP* formato;
+	Imagem* img;
+	int inicio; /* Primeira linha (da imagem) da faixa. */
+	int fim; /* Uma linha depois da ltima. */
+} _FaixaLeitura;
+
+static float tabela_u8_para_float [256];
+void _inicializaTabelaU8ParaFloat ();
+void _preencheTabelaU8ParaFloat ();
+void* _leDadosConverteFaixa (void* arg);
+void _converteBlocoParaImagem (unsigned char* bytes, _FormatoBMP* formato, Imagem* img);
+unsigned char* _leBlocoBMP (FILE* stream, _FormatoBMP* formato);
+unsigned char* _linhaBlocoBMP (unsigned char* bytes, _FormatoBMP* formato, int y);
+int leDadosU8 (FILE* stream, _FormatoBMP* formato, ImagemU8* img);
+void _converteLinhaU8 (unsigned char* linha, _FormatoBMP* formato, ImagemU8* img, int row);
+int _descartaBytes (FILE* stream, unsigned long n);
 
 void putLittleEndianULong (unsigned long val, unsigned char* buffer);
 void putLittleEndianUShort (unsigned short val, unsigned char* buffer);
-int salvaHeaderBitmap (FILE* stream, Imagem* img);
-int salvaHeaderDIB (FILE* stream, Imagem* img);
+int salvaHeaderBitmap (FILE* stream, int largura, int altura, int bpp);
+int salvaHeaderDIB (FILE* stream, int largura, int altura, int bpp);
+int salvaPaletaCinza (FILE* stream);
 int salvaDados (FILE* stream, Imagem* img);
+void _floatParaU8Linha (float* in, unsigned char* out, int n);
+int salvaDadosU8 (FILE* stream, ImagemU8* img);
+
+void _escritorReservaEspaco (EscritorImagens* escritor, size_t bytes);
+void _escritorEnfileira (EscritorImagens* escritor, int tipo, void* img, char* arquivo, size_t bytes);
+void* _escritorThread (void* arg);
 
 /*============================================================================*/
 /* FUNES DO MDULO                                                          */
 /*============================================================================*/
-/** Cria uma imagem vazia.
+/** Cria uma imagem vazia. Os pixels de todos os canais ficam em um nico bloco
+ * alinhado, e cada linha comea em um endereo mltiplo de
+ * IMAGEM_ALINHAMENTO. A matriz dados contm apenas ponteiros para as linhas
+ * deste bloco, ento o acesso com [canal][y][x] continua funcionando.
  *
  * Parmetros: int largura: largura da imagem.
  *             int altura: altura da imagem.
@@ -50,6 +141,8 @@ Imagem* criaImagem (int largura, int altura, int n_canais)
 {
 	int i, j;
 	Imagem* img;
+	float** linhas;
+	void* bloco;
 
 	if (largura <= 0 || altura <= 0 || n_canais <= 0)
     {
@@ -57,25 +150,47 @@ Imagem* criaImagem (int largura, int altura, int n_canais)
         return (NULL);
     }
 
+	/* Se uma imagem igual foi destruda h pouco nesta thread, reaproveita. */
+	img = (Imagem*) _poolRetira (POOL_FLOAT, largura, altura, n_canais);
+	if (img)
+		return (img);
+
 	img = (Imagem*) malloc (sizeof (Imagem));
 
 	img->largura = largura;
 	img->altura = altura;
 	img->n_canais = n_canais;
+	img->pai = NULL;
+	img->origem_x = img->origem_y = 0;
+	img->capacidade_linhas = altura;
+
+	/* Cada linha  completada at um mltiplo do alinhamento. */
+	img->passo = _imagemCalculaPasso (largura);
+
+	if (posix_memalign (&bloco, IMAGEM_ALINHAMENTO, sizeof (float) * img->passo * altura * n_canais) != 0)
+	{
+		printf ("criaImagem: erro alocando os dados da imagem.\n");
+		free (img);
+		return (NULL);
+	}
+	img->bloco = (float*) bloco;
 
-    img->dados = (float***) malloc (sizeof (float**) * n_canais); /* Uma matriz por canal. */
+	/* Os ponteiros para os canais e para as linhas tambm ficam em um nico bloco. */
+	img->dados = (float***) malloc (sizeof (float**) * n_canais + sizeof (float*) * altura * n_canais);
+	linhas = (float**) (img->dados + n_canais);
 	for (i = 0; i < n_canais; i++)
 	{
-		img->dados [i] = (float**) malloc (sizeof (float*) * altura);
+		img->dados [i] = linhas + i*altura;
 		for (j = 0; j < altura; j++)
-			img->dados [i][j] = (float*) malloc (sizeof (float) * largura);
+			img->dados [i][j] = img->bloco + ((size_t) i*altura + j) * img->passo;
 	}
 
 	return (img);
 }
 
 /*----------------------------------------------------------------------------*/
-/** Destroi uma imagem dada.
+/** Destroi uma imagem dada. A memria pode ficar guardada no pool da thread
+ * atual, para ser reaproveitada por uma prxima criaImagem do mesmo tamanho.
  *
  * Parmetros: Imagem* img: a imagem a destruir.
  *
@@ -83,14 +198,24 @@ Imagem* criaImagem (int largura, int altura, int n_canais)
 
 void destroiImagem (Imagem* img)
 {
-	int i, j;
-
-	for (i = 0; i < img->n_canais; i++)
+	/* Vises no so donas dos pixels, e no vo para o pool. */
+	if (img->pai)
 	{
-		for (j = 0; j < img->altura; j++)
-			free (img->dados [i][j]);
-		free (img->dados [i]);
+		free (img->dados);
+		free (img);
+		return;
 	}
+
+	if (_poolDevolve (POOL_FLOAT, img, img->largura, img->altura, img->n_canais, sizeof (float) * img->passo * img->altura * img->n_canais))
+		return;
+
+	_liberaImagem (img);
+}
+
+// Desaloca de fato uma imagem, sem passar pelo pool.
+void _liberaImagem (Imagem* img)
+{
+	free (img->bloco);
 	free (img->dados);
 	free (img);
 }
@@ -100,7 +225,9 @@ void destroiImagem (Imagem* img)
  *
  * Parmetros: char* arquivo: caminho do arquivo a abrir.
  *             int n_canais: nmero de canais. Deve ser 1 ou 3. Se for 1,
- *               converte a imagem para escala de cinza.
+ *               converte a imagem para escala de cinza. Se for 0, usa o
+ *               formato do arquivo: 1 canal para arquivos de 8 bpp com
+ *               paleta de cinza, 3 canais para os demais.
  *
  * Valor de retorno: uma imagem alocada contendo os dados do arquivo, ou NULL
  *                   se no for possvel abrir a imagem. */
@@ -108,79 +235,36 @@ void destroiImagem (Imagem* img)
 Imagem* abreImagem (char* arquivo, int n_canais)
 {
 	FILE* stream;
-	unsigned long data_offset = 0, largura = 0, altura = 0;
+	_FormatoBMP formato;
 	Imagem* img;
 
-    if (n_canais != 1 && n_canais != 3)
+    if (n_canais != 0 && n_canais != 1 && n_canais != 3)
 	{
-        printf ("abreImagem: so pode abrir imagens com 1 ou 3 canais.\n");
+        printf ("abreImagem: so pode abrir imagens com 0 (nativo), 1 ou 3 canais.\n");
         return (NULL);
 	}
 
-	/* Abre o arquivo. */
-	stream = fopen (arquivo, "rb");
+	/* Abre o arquivo e l os cabealhos. */
+	stream = abreArquivoBMP (arquivo, &formato);
 	if (!stream)
 		return (NULL);
 
-	if (!leHeaderBitmap (stream, &data_offset))
-	{
-		fclose (stream);
-		return (NULL);
-	}
-
-	if (!leHeaderDIB (stream, &largura, &altura))
-	{
-		fclose (stream);
-		return (NULL);
-	}
-
-	/* Pronto, cabealhos lidos! Vamos agora colocar o fluxo nos dados... */
-	if (fseek (stream, data_offset, SEEK_SET) != 0)
-	{
-		printf ("abreImagem: erro lendo dados do arquivo.\n");
-		fclose (stream);
-		return (NULL);
-	}
-
-	/* ... e tudo pronto para criar nossa imagem! */
-	img = criaImagem (largura, altura, 3);
+	/* Tudo pronto para criar nossa imagem! Se o chamador espera uma imagem de
+	   1 canal, a converso para escala de cinza  feita durante a leitura. */
+	if (n_canais == 0)
+		n_canais = (formato.bpp == 8 && formato.cinza)? 1 : 3;
+	img = criaImagem (formato.largura, formato.altura, n_canais);
 
 	/* L os dados. */
-	if (!leDados (stream, img))
+	if (!leDados (stream, &formato, img))
 	{
 		printf ("abreImagem: erro lendo dados do arquivo.\n");
 		fclose (stream);
-		free (img);
+		destroiImagem (img);
 		return (NULL);
 	}
 
 	fclose (stream);
-
-	/* Se o chamador espera uma imagem de 1 canal, converte para escala de cinza. */
-    if (n_canais == 1)
-    {
-        int i, j;
-        float** ptr_canal0;
-
-        /* Para no ficar to ineficiente, reaproveita a memria da imagem RGB original. */
-        for (i = 0; i < img->altura; i++)
-            for (j = 0; j < img->largura; j++)
-                img->dados [0][i][j] = img->dados [0][i][j] * 0.299f + img->dados [1][i][j] * 0.587f + img->dados [2][i][j] * 0.114f;
-
-        /* Modifica a imagem original. */
-        ptr_canal0 = img->dados [0];
-        for (i = 1; i < img->n_canais; i++)
-        {
-            for (j = 0; j < img->altura; j++)
-                free (img->dados [i][j]);
-            free (img->dados[i]);
-        }
-        img->n_canais = 1;
-        free (img->dados);
-        img->dados = (float***) malloc (sizeof (float**));
-        img->dados [0] = ptr_canal0;
-    }
-
     return (img);
 }
 
@@ -207,14 +291,22 @@ int salvaImagem (Imagem* img, char* arquivo)
 	if (!stream)
 		return (0);
 
-	/* Escreve os blocos. */
-	if (!salvaHeaderBitmap (stream, img))
+	/* Escreve os blocos. Imagens de 1 canal so salvas com 8 bpp e uma paleta
+	   de cinza. */
+	int bpp = (img->n_canais == 1)? 8 : 24;
+	if (!salvaHeaderBitmap (stream, img->largura, img->altura, bpp))
+	{
+		fclose (stream);
+		return (0);
+	}
+
+	if (!salvaHeaderDIB (stream, img->largura, img->altura, bpp))
 	{
 		fclose (stream);
 		return (0);
 	}
 
-	if (!salvaHeaderDIB (stream, img))
+	if (bpp == 8 && !salvaPaletaCinza (stream))
 	{
 		fclose (stream);
 		return (0);
@@ -239,14 +331,9 @@ int salvaImagem (Imagem* img, char* arquivo)
 
 Imagem* clonaImagem (Imagem* img)
 {
-    int i, j, k;
     Imagem* clone = criaImagem (img->largura, img->altura, img->n_canais);
 
-    for (i = 0; i < img->n_canais; i++)
-        for (j = 0; j < img->altura; j++)
-            for (k = 0; k < img->largura; k++)
-                clone->dados [i][j][k] = img->dados [i][j][k];
-
+    copiaConteudo (img, clone);
     return (clone);
 }
 
@@ -260,7 +347,7 @@ Imagem* clonaImagem (Imagem* img)
 
 void copiaConteudo (Imagem* in, Imagem* out)
 {
-    int i, j, k;
+    int i, j;
 
     if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
     {
@@ -268,10 +355,17 @@ void copiaConteudo (Imagem* in, Imagem* out)
         exit (1);
     }
 
+    /* Com o mesmo passo, os blocos tm o mesmo formato: uma cpia s. No vale
+       para vises, onde as linhas no so contguas. */
+    if (in->passo == out->passo && !in->pai && !out->pai)
+    {
+        memcpy (out->bloco, in->bloco, sizeof (float) * in->passo * in->altura * in->n_canais);
+        return;
+    }
+
     for (i = 0; i < in->n_canais; i++)
         for (j = 0; j < in->altura; j++)
-            for (k = 0; k < in->largura; k++)
-                out->dados [i][j][k] = in->dados [i][j][k];
+            memcpy (out->dados [i][j], in->dados [i][j], sizeof (float) * in->largura);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -373,237 +467,1698 @@ void redimensionaBilinear (Imagem* in, Imagem* out)
 }
 
 /*============================================================================*/
-/* FUNES INTERNAS (LEITURA)                                                 */
+/* VISES                                                                     */
 /*============================================================================*/
-/** Pega os 4 primeiros bytes do buffer e coloca em um unsigned long,
- * considerando os bytes em ordem little endian.
+/** Cria uma viso de uma regio retangular de uma imagem. A viso  uma
+ * Imagem cujas linhas apontam para dentro da imagem pai: nada  copiado, e
+ * escrever na viso altera a imagem pai. Use destroiImagem para desaloc-la
+ * (a imagem pai no  afetada).
  *
- * Parmetros: unsigned char* buffer: l 4 bytes daqui.
+ * Parmetros: Imagem* pai: imagem de onde vm os pixels. Pode ser outra
+ *               viso.
+ *             int x: coluna do canto superior esquerdo da regio.
+ *             int y: linha do canto superior esquerdo da regio.
+ *             int largura: largura da regio.
+ *             int altura: altura da regio.
  *
- * Valor de Retorno: um unsigned long com os dados do buffer reorganizados. */
+ * Valor de retorno: a viso criada, ou NULL se a regio no couber na imagem
+ *                   pai. */
 
-unsigned long getLittleEndianULong (unsigned char* buffer)
+Imagem* criaVisao (Imagem* pai, int x, int y, int largura, int altura)
 {
-	return (buffer [3] << 24) | (buffer [2] << 16) | (buffer [1] << 8) | buffer [0];
+	Imagem* visao;
+	Imagem* raiz;
+
+	if (x < 0 || y < 0 || largura <= 0 || altura <= 0 || x + largura > pai->largura || y + altura > pai->altura)
+	{
+		printf ("criaVisao: a regiao precisa estar dentro da imagem.\n");
+		return (NULL);
+	}
+
+	visao = (Imagem*) malloc (sizeof (Imagem));
+	visao->n_canais = pai->n_canais;
+	visao->passo = pai->passo;
+	visao->bloco = NULL;
+	visao->pai = pai;
+
+	/* Reserva ponteiros para a altura inteira da imagem dona dos pixels, e no
+	   s para a do pai: se o pai for uma viso, ele pode crescer depois. Assim
+	   a ajustaVisao nunca precisa realocar. */
+	raiz = pai;
+	while (raiz->pai)
+		raiz = raiz->pai;
+	visao->capacidade_linhas = raiz->altura;
+	visao->dados = (float***) malloc (sizeof (float**) * pai->n_canais + sizeof (float*) * visao->capacidade_linhas * pai->n_canais);
+
+	ajustaVisao (visao, x, y, largura, altura);
+	return (visao);
 }
 
 /*----------------------------------------------------------------------------*/
-/** L o header de 14 bytes do formato BMP.
+/** Move uma viso para outra regio da mesma imagem pai. No aloca nada, ento
+ *  a forma mais barata de percorrer vrias regies de uma imagem.
  *
- * Parmetros: FILE* stream: arquivo a ser lido. Supomos que j est aberto.
- *             unsigned long* offset: parmetro de sada,  o deslocamento dos
- *               dados a partir do incio do arquivo.
+ * Parmetros: Imagem* visao: a viso, criada com criaVisao.
+ *             int x, int y, int largura, int altura: a nova regio.
  *
- * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+ * Valor de retorno: nenhum. */
 
-int leHeaderBitmap (FILE* stream, unsigned long* offset)
+void ajustaVisao (Imagem* visao, int x, int y, int largura, int altura)
 {
-	unsigned char data [14]; /* O bloco tem exatamente 14 bytes. */
+	Imagem* pai = visao->pai;
+	int i, j;
 
-	if (fread ((void*) data, 1, 14, stream) != 14)
+	if (!pai || x < 0 || y < 0 || largura <= 0 || altura <= 0 || x + largura > pai->largura || y + altura > pai->altura ||
+	    altura > visao->capacidade_linhas)
 	{
-		printf ("leHeaderBitmap: erro lendo header.\n");
-		return (0);
+		printf ("ERRO: ajustaVisao: a regiao precisa estar dentro da imagem.\n");
+		exit (1);
 	}
 
-	/* Os 2 primeiros bytes precisam ser 'B' e 'M'. */
-	if (data [0] != 'B' || data [1] != 'M')
+	visao->largura = largura;
+	visao->altura = altura;
+	visao->origem_x = x;
+	visao->origem_y = y;
+
+	float** linhas = (float**) (visao->dados + pai->n_canais);
+	for (i = 0; i < pai->n_canais; i++)
 	{
-		printf ("leHeaderBitmap: pode ler apenas formato BM.\n");
-		return (0);
+		visao->dados [i] = linhas + i*visao->capacidade_linhas;
+		for (j = 0; j < altura; j++)
+			visao->dados [i][j] = pai->dados [i][y+j] + x;
 	}
-
-	/* Vou pular todo o resto e ir direto para o offset. */
-	*offset = getLittleEndianULong (&(data [10]));
-	return (1);
 }
 
-/*----------------------------------------------------------------------------*/
-/** L o header DIB.
+/*============================================================================*/
+/* IMAGENS DE 8 BITS                                                          */
+/*============================================================================*/
+/** Cria uma imagem vazia de 8 bits por canal. A organizao  a mesma da
+ * criaImagem.
  *
- * Parmetros: FILE* stream: arquivo a ser lido. Supomos que j est aberto.
- *             unsigned long* largura: parmetro de sada. Largura da imagem.
- *             unsigned long* altura: parmetro de sada. Altura da imagem.
+ * Parmetros: int largura: largura da imagem.
+ *             int altura: altura da imagem.
+ *             int n_canais: nmero de canais.
  *
- * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+ * Valor de retorno: a imagem alocada. A responsabilidade por desaloc-la  do
+ *                   chamador. */
 
-int leHeaderDIB (FILE* stream, unsigned long* largura, unsigned long* altura)
+ImagemU8* criaImagemU8 (int largura, int altura, int n_canais)
 {
-	unsigned long size = 0; /* O tamanho do cabealho DIB. */
+	int i, j;
+	ImagemU8* img;
+	unsigned char** linhas;
+	void* bloco;
+
+	if (largura <= 0 || altura <= 0 || n_canais <= 0)
+    {
+        printf ("criaImagemU8: imagens devem ter altura, largura e n_canais maiores que 0.\n");
+        return (NULL);
+    }
+
+	img = (ImagemU8*) _poolRetira (POOL_U8, largura, altura, n_canais);
+	if (img)
+		return (img);
+
+	img = (ImagemU8*) malloc (sizeof (ImagemU8));
+
+	img->largura = largura;
+	img->altura = altura;
+	img->n_canais = n_canais;
+	img->passo = ((largura + IMAGEM_ALINHAMENTO - 1) / IMAGEM_ALINHAMENTO) * IMAGEM_ALINHAMENTO;
 
-	if (fread ((void*) &size, 4, 1, stream) != 1)
+	if (posix_memalign (&bloco, IMAGEM_ALINHAMENTO, (size_t) img->passo * altura * n_canais) != 0)
 	{
-		printf ("leHeaderDIB: erro lendo header.\n");
-		return (0);
+		printf ("criaImagemU8: erro alocando os dados da imagem.\n");
+		free (img);
+		return (NULL);
 	}
+	img->bloco = (unsigned char*) bloco;
 
-	if (size == 12) /* Formato BITMAPCOREHEADER. */
+	img->dados = (unsigned char***) malloc (sizeof (unsigned char**) * n_canais + sizeof (unsigned char*) * altura * n_canais);
+	linhas = (unsigned char**) (img->dados + n_canais);
+	for (i = 0; i < n_canais; i++)
 	{
-		printf ("leHeaderDIB: BITMAPCOREHEADER nao suportado (arquivo antigo!?)\n");
-		return (0);
+		img->dados [i] = linhas + i*altura;
+		for (j = 0; j < altura; j++)
+			img->dados [i][j] = img->bloco + ((size_t) i*altura + j) * img->passo;
 	}
-	else if (size >= 40) /* Outros formatos. */
-	{
-		unsigned short tmp_short = 0;
-		unsigned long tmp_long = 0;
 
-		/* Largura. */
-		if (fread ((void*) largura, 4, 1, stream) != 1 || *largura <= 0)
-		{
-			printf ("leHeaderDIB: largura invalida.\n");
-			return (0);
-		}
+	return (img);
+}
 
-		/* Altura. */
-		if (fread ((void*) altura, 4, 1, stream) != 1 || *altura <= 0)
-		{
-			printf ("leHeaderDIB: altura invalida.\n");
-			return (0);
-		}
+/*----------------------------------------------------------------------------*/
+/** Destroi uma imagem de 8 bits dada. Assim como na destroiImagem, a memria
+ * pode ficar no pool da thread atual.
+ *
+ * Parmetros: ImagemU8* img: a imagem a destruir.
+ *
+ * Valor de retorno: nenhum. */
 
-		/* Color planes. Precisa ser 1. */
-		if (fread ((void*) &tmp_short, 2, 1, stream) != 1 || tmp_short != 1)
-		{
-			printf ("leHeaderDIB: erro lendo header.\n");
-			return (0);
-		}
+void destroiImagemU8 (ImagemU8* img)
+{
+	if (_poolDevolve (POOL_U8, img, img->largura, img->altura, img->n_canais, (size_t) img->passo * img->altura * img->n_canais))
+		return;
 
-		/* Bpp. Aqui, estou forando 24 bpp. */
-		if (fread ((void*) &tmp_short, 2, 1, stream) != 1 || tmp_short != 24)
-		{
-			printf ("leHeaderDIB: supporta apenas arquivos com 24 bpp.\n");
-			return (0);
-		}
+	_liberaImagemU8 (img);
+}
 
-		/* Compresso. Vou aceitar s imagens sem compresso. */
-		if (fread ((void*) &tmp_long, 4, 1, stream) != 1 || tmp_long != 0)
-		{
-			printf ("leHeaderDIB: suporta apenas arquivos sem compressao.\n");
-			return (0);
-		}
+// Desaloca de fato uma imagem de 8 bits, sem passar pelo pool.
+void _liberaImagemU8 (ImagemU8* img)
+{
+	free (img->bloco);
+	free (img->dados);
+	free (img);
+}
 
-		/* Pula os prximos 12 bytes. */
-		if (fseek (stream, 12, SEEK_CUR) != 0)
-		{
-			printf ("leHeaderDIB: erro lendo header.\n");
-			return (0);
-		}
+/*----------------------------------------------------------------------------*/
+/** Abre um arquivo de imagem dado, mantendo os dados com 8 bits por canal.
+ *
+ * Parmetros: char* arquivo: caminho do arquivo a abrir.
+ *             int n_canais: nmero de canais. Deve ser 1 ou 3. Se for 1,
+ *               converte a imagem para escala de cinza. Se for 0, usa o
+ *               formato do arquivo: 1 canal para arquivos de 8 bpp com
+ *               paleta de cinza, 3 canais para os demais.
+ *
+ * Valor de retorno: uma imagem alocada contendo os dados do arquivo, ou NULL
+ *                   se no for possvel abrir a imagem. */
 
-		/* Paleta. No  para usar! */
-		if (fread ((void*) &tmp_long, 4, 1, stream) != 1 || tmp_long != 0)
-		{
-			printf ("leHeaderDIB: sem suporte a arquivos com paletas de cores.\n");
-			return (0);
-		}
+ImagemU8* abreImagemU8 (char* arquivo, int n_canais)
+{
+	FILE* stream;
+	_FormatoBMP formato;
+	ImagemU8* img;
 
-		return (1);
+    if (n_canais != 0 && n_canais != 1 && n_canais != 3)
+	{
+        printf ("abreImagemU8: so pode abrir imagens com 0 (nativo), 1 ou 3 canais.\n");
+        return (NULL);
+	}
+
+	stream = abreArquivoBMP (arquivo, &formato);
+	if (!stream)
+		return (NULL);
+
+	if (n_canais == 0)
+		n_canais = (formato.bpp == 8 && formato.cinza)? 1 : 3;
+	img = criaImagemU8 (formato.largura, formato.altura, n_canais);
+
+	if (!leDadosU8 (stream, &formato, img))
+	{
+		printf ("abreImagemU8: erro lendo dados do arquivo.\n");
+		fclose (stream);
+		destroiImagemU8 (img);
+		return (NULL);
 	}
 
-	return (0);
+	fclose (stream);
+	return (img);
 }
 
 /*----------------------------------------------------------------------------*/
-/** L os dados de um arquivo.
+/** Salva uma imagem de 8 bits em um arquivo dado.
  *
- * Parmetros: FILE* stream: arquivo a ser lido. Supomos que j est aberto.
- *             Imagem* img: imagem a preencher.
+ * Parmetros: ImagemU8* img: imagem a salvar.
+ *             char* arquivo: caminho do arquivo a salvar.
  *
- * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+ * Valor de retorno: 0 se ocorreu algum erro, 1 do contrrio. */
 
-int leDados (FILE* stream, Imagem* img)
+int salvaImagemU8 (ImagemU8* img, char* arquivo)
 {
-	long long i, j, k;
-	int line_padding;
-	unsigned char data;
-
-	/* Calcula quantos bytes preciso pular no fim de cada linha.
-	  Aqui, cada linha precisa ter um mltiplo de 4. */
-	line_padding = (int) ceil (img->largura*3.0/4.0)*4 - (img->largura*3);
+	FILE* stream;
 
-	/* L! */
-	for (i = img->altura-1; i >= 0; i--)
+	if (img->n_canais != 1 && img->n_canais != 3)
 	{
-		for (j = 0; j < img->largura; j++)
-		{
-		    /* L 3 bytes, na ordem BGR. */
-		    for (k = 0; k < 3; k++)
-		    {
-                if (fread (&data, 1, 1, stream) != 1)
-                    return (0);
-
-                img->dados [2-k][i][j] = (float) data / 255.0f; // 2-k -> 0 = R, 1 = G, 2 = B. Coloca na faixa [0,1]
-		    }
-		}
+        printf ("salvaImagemU8: so pode salvar imagens com 1 ou 3 canais.\n");
+        return (0);
+	}
 
-		if (fseek (stream, line_padding, SEEK_CUR) != 0)
-			return (0);
+	stream = fopen (arquivo, "wb");
+	if (!stream)
+		return (0);
+
+	int bpp = (img->n_canais == 1)? 8 : 24;
+	if (!salvaHeaderBitmap (stream, img->largura, img->altura, bpp) ||
+	    !salvaHeaderDIB (stream, img->largura, img->altura, bpp) ||
+	    (bpp == 8 && !salvaPaletaCinza (stream)) ||
+	    !salvaDadosU8 (stream, img))
+	{
+		fclose (stream);
+		return (0);
 	}
 
+	fclose (stream);
 	return (1);
 }
 
-/*============================================================================*/
-/* FUNES INTERNAS (ESCRITA)                                                 */
-/*============================================================================*/
-/** Coloca um unsigned long nos 4 primeiros bytes do buffer, em ordem little
- * endian.
+/*----------------------------------------------------------------------------*/
+/** Converte uma imagem de floats para 8 bits, usando a float2uchar.
  *
- * Parmetros: unsigned long val: valor a escrever.
- *             unsigned char* buffer: coloca o valor aqui.
+ * Parmetros: Imagem* in: imagem de entrada.
+ *             ImagemU8* out: imagem de sada, com o mesmo tamanho e nmero de
+ *               canais.
  *
- * Valor de Retorno: NENHUM */
+ * Valor de retorno: nenhum. */
 
-void putLittleEndianULong (unsigned long val, unsigned char* buffer)
+void imagemParaU8 (Imagem* in, ImagemU8* out)
 {
-	buffer [0] = (unsigned char) val;
-	buffer [1] = (unsigned char) (val >> 8);
-	buffer [2] = (unsigned char) (val >> 16);
-	buffer [3] = (unsigned char) (val >> 24);
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: imagemParaU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    int channel, row, col;
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (row = 0; row < in->altura; row++)
+            for (col = 0; col < in->largura; col++)
+                out->dados [channel][row][col] = float2uchar (in->dados [channel][row][col]);
 }
 
 /*----------------------------------------------------------------------------*/
-/** Coloca um unsigned short nos 2 primeiros bytes do buffer, em ordem little
- * endian.
+/** Converte uma imagem de 8 bits para floats no intervalo [0,1].
  *
- * Parmetros: unsigned short val: valor a escrever.
- *             unsigned char* buffer: coloca o valor aqui.
+ * Parmetros: ImagemU8* in: imagem de entrada.
+ *             Imagem* out: imagem de sada, com o mesmo tamanho e nmero de
+ *               canais.
  *
- * Valor de Retorno: NENHUM */
+ * Valor de retorno: nenhum. */
 
-void putLittleEndianUShort (unsigned short val, unsigned char* buffer)
+void imagemU8ParaFloat (ImagemU8* in, Imagem* out)
 {
-	buffer [0] = (unsigned char) val;
-	buffer [1] = (unsigned char) (val >> 8);
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: imagemU8ParaFloat: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    _inicializaTabelaU8ParaFloat ();
+
+    int channel, row, col;
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (row = 0; row < in->altura; row++)
+        {
+            unsigned char* linha_in = in->dados [channel][row];
+            float* linha_out = out->dados [channel][row];
+            for (col = 0; col < in->largura; col++)
+                linha_out [col] = tabela_u8_para_float [linha_in [col]];
+        }
 }
 
 /*----------------------------------------------------------------------------*/
-/** Escreve o header Bitmap.
+/** L a prxima imagem bmp de um fluxo j aberto, mantendo os dados com 8
+ * bits por canal. O fluxo  lido s para a frente (sem fseek), ento pode ser
+ * um pipe ou a entrada padro com vrios arquivos bmp em seguida. A imagem
+ * anterior pode ser reaproveitada, evitando uma alocao a cada quadro.
  *
- * Parmetros: FILE* file: arquivo a ser escrito. Supomos que j est aberto.
- *             Imagem* img: imagem a ser salva.
+ * Parmetros: FILE* stream: fluxo a ser lido, posicionado no incio de um
+ *               arquivo bmp.
+ *             int n_canais: nmero de canais (0, 1 ou 3, como na
+ *               abreImagemU8).
+ *             ImagemU8* reuso: imagem a reaproveitar, ou NULL. Se o tamanho
+ *               ou o nmero de canais no coincidirem, ela  destruda e uma
+ *               nova  criada. Tambm  destruda se ocorrer algum erro.
  *
- * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+ * Valor de retorno: a imagem lida, ou NULL no fim do fluxo ou se ocorreu
+ *                   algum erro. */
 
-int salvaHeaderBitmap (FILE* stream, Imagem* img)
+ImagemU8* leImagemU8 (FILE* stream, int n_canais, ImagemU8* reuso)
 {
-	unsigned char data [14]; /* O bloco tem exatamente 14 bytes. */
-	int pos = 0;
-	unsigned long bytes_por_linha;
-
-	data [pos++] = 'B';
-	data [pos++] = 'M';
+	_FormatoBMP formato;
+	unsigned long data_offset, tamanho, lidos;
+	unsigned char* linha;
+	int row, c;
 
-	/* Tamanho do arquivo. Definimos como sendo 14+40 (dos cabealhos) + o espao dos dados. */
-	bytes_por_linha = (unsigned long) ceil (img->largura*3.0/4.0)*4;
-	putLittleEndianULong (14+40+img->altura*bytes_por_linha, &(data [pos]));
-	pos+=4;
+	if (n_canais != 0 && n_canais != 1 && n_canais != 3)
+	{
+		fprintf (stderr, "leImagemU8: so pode ler imagens com 0 (nativo), 1 ou 3 canais.\n");
+		return (NULL);
+	}
 
-	/* Reservado. */
+	/* Fim do fluxo: no  um erro. */
+	c = fgetc (stream);
+	if (c == EOF || ungetc (c, stream) == EOF ||
+	    !leHeaderBitmap (stream, &data_offset, &tamanho) || !leHeaderDIB (stream, &formato))
+	{
+		if (reuso)
+			destroiImagemU8 (reuso);
+		return (NULL);
+	}
+
+	/* Pula o que houver entre os cabealhos e os dados. */
+	lidos = 14 + formato.tamanho_header;
+	if (data_offset < lidos || !_descartaBytes (stream, data_offset - lidos))
+	{
+		fprintf (stderr, "leImagemU8: erro lendo dados do fluxo.\n");
+		if (reuso)
+			destroiImagemU8 (reuso);
+		return (NULL);
+	}
+
+	if (n_canais == 0)
+		n_canais = (formato.bpp == 8 && formato.cinza)? 1 : 3;
+	if (reuso && (reuso->largura != formato.largura || reuso->altura != formato.altura || reuso->n_canais != n_canais))
+	{
+		destroiImagemU8 (reuso);
+		reuso = NULL;
+	}
+	if (!reuso)
+		reuso = criaImagemU8 (formato.largura, formato.altura, n_canais);
+
+	/* L e converte uma linha por vez. As linhas ficam na ordem do arquivo. */
+	linha = (unsigned char*) malloc (formato.largura_linha);
+	for (row = 0; row < formato.altura; row++)
+	{
+		if (fread (linha, 1, formato.largura_linha, stream) != formato.largura_linha)
+			break;
+		_converteLinhaU8 (linha, &formato, reuso, (formato.invertida)? row : formato.altura-1-row);
+	}
+	free (linha);
+
+	/* Alguns arquivos tm bytes extras depois dos dados. */
+	lidos = data_offset + formato.largura_linha * formato.altura;
+	if (row < formato.altura || (tamanho > lidos && !_descartaBytes (stream, tamanho - lidos)))
+	{
+		fprintf (stderr, "leImagemU8: erro lendo dados do fluxo.\n");
+		destroiImagemU8 (reuso);
+		return (NULL);
+	}
+
+	return (reuso);
+}
+
+/*----------------------------------------------------------------------------*/
+/** L um quadro de pixels crus de um fluxo: largura*altura pixels RGB de 8
+ * bits, intercalados, linha por linha de cima para baixo, sem cabealho e
+ * sem preenchimento.
+ *
+ * Parmetros: FILE* stream: fluxo a ser lido.
+ *             ImagemU8* img: imagem de 3 canais a preencher. O tamanho do
+ *               quadro  o tamanho da imagem.
+ *
+ * Valor de retorno: 1 se um quadro inteiro foi lido, 0 se o fluxo acabou
+ *                   antes do quadro, -1 se o quadro foi cortado no meio ou
+ *                   ocorreu algum erro de leitura. */
+
+int leQuadroRGBU8 (FILE* stream, ImagemU8* img)
+{
+	unsigned char* linha;
+	int row, col, ok = 1;
+
+	if (img->n_canais != 3)
+	{
+		printf ("ERRO: leQuadroRGBU8: a imagem precisa ter 3 canais.\n");
+		exit (1);
+	}
+
+	linha = (unsigned char*) malloc ((size_t) img->largura * 3);
+	for (row = 0; row < img->altura && ok; row++)
+	{
+		unsigned char* r = img->dados [0][row];
+		unsigned char* g = img->dados [1][row];
+		unsigned char* b = img->dados [2][row];
+		unsigned char* pos = linha;
+
+		size_t lidos = fread (linha, 3, img->largura, stream);
+		if (lidos != (size_t) img->largura)
+		{
+			ok = (row == 0 && lidos == 0 && !ferror (stream))? 0 : -1;
+			break;
+		}
+
+		for (col = 0; col < img->largura; col++, pos += 3)
+		{
+			r [col] = pos [0];
+			g [col] = pos [1];
+			b [col] = pos [2];
+		}
+	}
+
+	free (linha);
+	return (ok);
+}
+
+/*============================================================================*/
+/* POOL DE IMAGENS                                                            */
+/*============================================================================*/
+/** Cada thread tem um pool com as ltimas imagens destrudas (at
+ * POOL_MAX_IMAGENS imagens e POOL_MAX_BYTES bytes). A criaImagem e a
+ * criaImagemU8 procuram ali uma imagem com o mesmo tamanho e nmero de canais
+ * antes de alocar. Assim, em um lao que cria e destri sempre as mesmas
+ * imagens, o alocador fica parado depois da primeira iterao.
+ *
+ * Esta funo descarta todas as imagens guardadas no pool da thread atual. O
+ * pool de cada thread tambm  descartado automaticamente quando ela
+ * termina.
+ *
+ * Parmetros: nenhum.
+ *
+ * Valor de retorno: nenhum. */
+
+void esvaziaPoolImagens ()
+{
+	_PoolImagens* pool = _poolDaThread (0);
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->n; i++)
+		_poolDescarta (&(pool->entradas [i]));
+
+	pool->n = 0;
+	pool->bytes = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Cria uma arena de imagens. Imagens criadas na arena so destrudas todas
+ * de uma vez pela liberaArena, o que  conveniente para as imagens
+ * temporrias de um estgio de um pipeline. Como as imagens voltam para o
+ * pool, repetir o estgio com imagens do mesmo tamanho no aloca nada.
+ *
+ * Parmetros: nenhum.
+ *
+ * Valor de retorno: a arena criada. Desaloque com destroiArena. */
+
+ArenaImagens* criaArena ()
+{
+	ArenaImagens* arena = (ArenaImagens*) malloc (sizeof (ArenaImagens));
+	arena->n = 0;
+	arena->capacidade = 8;
+	arena->imagens = (void**) malloc (sizeof (void*) * arena->capacidade);
+	arena->tipos = (int*) malloc (sizeof (int) * arena->capacidade);
+	return (arena);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Cria uma imagem que pertence a uma arena. No chame destroiImagem para ela!
+ *
+ * Parmetros: ArenaImagens* arena: a arena.
+ *             int largura, int altura, int n_canais: como na criaImagem.
+ *
+ * Valor de retorno: a imagem criada. */
+
+Imagem* criaImagemNaArena (ArenaImagens* arena, int largura, int altura, int n_canais)
+{
+	Imagem* img = criaImagem (largura, altura, n_canais);
+	if (img)
+		_arenaAdiciona (arena, img, POOL_FLOAT);
+	return (img);
+}
+
+ImagemU8* criaImagemU8NaArena (ArenaImagens* arena, int largura, int altura, int n_canais)
+{
+	ImagemU8* img = criaImagemU8 (largura, altura, n_canais);
+	if (img)
+		_arenaAdiciona (arena, img, POOL_U8);
+	return (img);
+}
+
+// Funo auxiliar, registra uma imagem na arena.
+void _arenaAdiciona (ArenaImagens* arena, void* img, int tipo)
+{
+	if (arena->n == arena->capacidade)
+	{
+		arena->capacidade *= 2;
+		arena->imagens = (void**) realloc (arena->imagens, sizeof (void*) * arena->capacidade);
+		arena->tipos = (int*) realloc (arena->tipos, sizeof (int) * arena->capacidade);
+	}
+
+	arena->imagens [arena->n] = img;
+	arena->tipos [arena->n] = tipo;
+	arena->n++;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destroi todas as imagens de uma arena. A arena continua vlida e pode ser
+ * usada de novo.
+ *
+ * Parmetros: ArenaImagens* arena: a arena.
+ *
+ * Valor de retorno: nenhum. */
+
+void liberaArena (ArenaImagens* arena)
+{
+	/* Destroi na ordem inversa, para que as primeiras imagens fiquem mais
+	   tempo no pool. */
+	while (arena->n > 0)
+	{
+		arena->n--;
+		if (arena->tipos [arena->n] == POOL_FLOAT)
+			destroiImagem ((Imagem*) arena->imagens [arena->n]);
+		else
+			destroiImagemU8 ((ImagemU8*) arena->imagens [arena->n]);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destroi uma arena e todas as suas imagens.
+ *
+ * Parmetros: ArenaImagens* arena: a arena.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiArena (ArenaImagens* arena)
+{
+	liberaArena (arena);
+	free (arena->imagens);
+	free (arena->tipos);
+	free (arena);
+}
+
+/*============================================================================*/
+/* IMAGENS MAPEADAS EM MEMRIA                                                */
+/*============================================================================*/
+/** Abre um arquivo bmp mapeando-o em memria. Os cabealhos so lidos
+ * normalmente, mas os pixels no so copiados: o ImagemMapeada aponta
+ * diretamente para as pginas do arquivo (que, se o arquivo foi lido h pouco,
+ * j esto no cache do sistema).
+ *
+ * Parmetros: char* arquivo: caminho do arquivo a abrir.
+ *
+ * Valor de retorno: a imagem mapeada, ou NULL se no for possvel abrir o
+ *                   arquivo. Desaloque com fechaImagemMapeada. */
+
+ImagemMapeada* abreImagemMapeada (char* arquivo)
+{
+	FILE* stream;
+	unsigned long data_offset = 0;
+	_FormatoBMP formato;
+	struct stat info;
+	ImagemMapeada* img;
+	void* mapa;
+
+	/* L os cabealhos com as mesmas funes da abreImagem. */
+	stream = fopen (arquivo, "rb");
+	if (!stream)
+		return (NULL);
+
+	if (!leHeaderBitmap (stream, &data_offset, NULL) || !leHeaderDIB (stream, &formato))
+	{
+		fclose (stream);
+		return (NULL);
+	}
+
+	/* Os pixels so usados diretamente, ento s aceitamos BGR. */
+	if (formato.bpp != 24)
+	{
+		printf ("abreImagemMapeada: suporta apenas arquivos com 24 bpp.\n");
+		fclose (stream);
+		return (NULL);
+	}
+
+	if (fstat (fileno (stream), &info) != 0)
+	{
+		printf ("abreImagemMapeada: erro lendo o tamanho do arquivo.\n");
+		fclose (stream);
+		return (NULL);
+	}
+
+	/* Verifica se os dados cabem no arquivo. A ltima linha no precisa ter o
+	   preenchimento completo. */
+	unsigned long passo = formato.largura_linha;
+	if ((unsigned long) info.st_size < data_offset + (formato.altura-1)*passo + formato.largura*3)
+	{
+		printf ("abreImagemMapeada: arquivo truncado.\n");
+		fclose (stream);
+		return (NULL);
+	}
+
+	mapa = mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno (stream), 0);
+	fclose (stream); /* O mapeamento continua vlido depois de fechar o arquivo. */
+	if (mapa == MAP_FAILED)
+	{
+		printf ("abreImagemMapeada: erro mapeando o arquivo.\n");
+		return (NULL);
+	}
+
+	img = (ImagemMapeada*) malloc (sizeof (ImagemMapeada));
+	img->largura = formato.largura;
+	img->altura = formato.altura;
+	img->passo = passo;
+	img->invertida = formato.invertida;
+	img->mapa = mapa;
+	img->tamanho_mapa = info.st_size;
+	img->pixels = ((unsigned char*) mapa) + data_offset;
+
+	return (img);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Desfaz o mapeamento de uma imagem mapeada.
+ *
+ * Parmetros: ImagemMapeada* img: a imagem a fechar.
+ *
+ * Valor de retorno: nenhum. */
+
+void fechaImagemMapeada (ImagemMapeada* img)
+{
+	munmap (img->mapa, img->tamanho_mapa);
+	free (img);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Obtm uma linha de uma imagem mapeada, contando de cima para baixo.
+ *
+ * Parmetros: ImagemMapeada* img: a imagem.
+ *             int y: linha desejada (0  a linha de cima).
+ *
+ * Valor de retorno: ponteiro para os largura*3 bytes (BGR) da linha. */
+
+unsigned char* linhaImagemMapeada (ImagemMapeada* img, int y)
+{
+	int linha = (img->invertida)? y : img->altura-1-y;
+	return (img->pixels + (size_t) linha * img->passo);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Converte uma imagem mapeada para uma Imagem de floats, lendo os pixels
+ * diretamente do mapeamento (sem a cpia intermediria da leDados).
+ *
+ * Parmetros: ImagemMapeada* in: imagem de entrada.
+ *             Imagem* out: imagem de sada de 3 canais, com o mesmo tamanho,
+ *               ou de 1 canal para converter para escala de cinza.
+ *
+ * Valor de retorno: nenhum. */
+
+void converteImagemMapeada (ImagemMapeada* in, Imagem* out)
+{
+	if (in->largura != out->largura || in->altura != out->altura || (out->n_canais != 1 && out->n_canais != 3))
+	{
+		printf ("ERRO: converteImagemMapeada: a imagem de saida precisa ter o mesmo tamanho e 1 ou 3 canais.\n");
+		exit (1);
+	}
+
+	_FormatoBMP formato;
+	formato.largura = in->largura;
+	formato.altura = in->altura;
+	formato.invertida = in->invertida;
+	formato.bpp = 24;
+	formato.largura_linha = in->passo;
+	formato.cinza = 0;
+
+	_converteBlocoParaImagem (in->pixels, &formato, out);
+}
+
+/*============================================================================*/
+/* ESCRITA ASSNCRONA                                                         */
+/*============================================================================*/
+/** Cria um escritor assncrono e inicia as suas threads.
+ *
+ * Parmetros: int n_threads: nmero de threads escritoras (pelo menos 1).
+ *             size_t max_bytes: limite de bytes de pixels na fila. Se for 0,
+ *               usa ESCRITOR_MAX_BYTES.
+ *
+ * Valor de retorno: o escritor criado. Lembre-se de destru-lo com a
+ *                   destroiEscritor! */
+
+EscritorImagens* criaEscritor (int n_threads, size_t max_bytes)
+{
+	EscritorImagens* escritor;
+	int i;
+
+	escritor = (EscritorImagens*) malloc (sizeof (EscritorImagens));
+	escritor->n_threads = MAX (1, n_threads);
+	escritor->threads = (pthread_t*) malloc (sizeof (pthread_t) * escritor->n_threads);
+	escritor->primeiro = NULL;
+	escritor->ultimo = NULL;
+	escritor->bytes = 0;
+	escritor->max_bytes = (max_bytes)? max_bytes : ESCRITOR_MAX_BYTES;
+	escritor->em_andamento = 0;
+	escritor->erros = 0;
+	escritor->terminando = 0;
+
+	pthread_mutex_init (&(escritor->mutex), NULL);
+	pthread_cond_init (&(escritor->tem_pedido), NULL);
+	pthread_cond_init (&(escritor->tem_espaco), NULL);
+	pthread_cond_init (&(escritor->ocioso), NULL);
+
+	for (i = 0; i < escritor->n_threads; i++)
+	{
+		if (pthread_create (&(escritor->threads [i]), NULL, _escritorThread, escritor) != 0)
+		{
+			printf ("ERRO: criaEscritor: nao foi possivel criar as threads.\n");
+			exit (1);
+		}
+	}
+
+	return (escritor);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Coloca uma imagem na fila de escrita. Se a fila estiver cheia, espera.
+ *
+ * Parmetros: EscritorImagens* escritor: o escritor.
+ *             Imagem* img: imagem a salvar.
+ *             char* arquivo: caminho do arquivo a salvar.
+ *             int copia: se != 0, salva uma cpia da imagem, que continua
+ *               com o chamador. Se for 0, o escritor fica com a imagem e a
+ *               destri depois de salv-la. Vises so sempre copiadas;
+ *               com 0, a viso  destruda logo depois da cpia (a imagem
+ *               pai no  afetada).
+ *
+ * Valor de retorno: NENHUM */
+
+void salvaImagemAsync (EscritorImagens* escritor, Imagem* img, char* arquivo, int copia)
+{
+	size_t bytes = (size_t) img->largura * img->altura * img->n_canais * sizeof (float);
+
+	_escritorReservaEspaco (escritor, bytes);
+
+	if (copia || img->pai)
+	{
+		Imagem* original = img;
+		img = clonaImagem (original);
+
+		// O escritor ficaria com a viso, mas s a cpia vai para a fila.
+		if (!copia)
+			destroiImagem (original);
+	}
+
+	_escritorEnfileira (escritor, 0, img, arquivo, bytes);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Coloca uma imagem de 8 bits na fila de escrita. Se a fila estiver cheia,
+ * espera.
+ *
+ * Parmetros: EscritorImagens* escritor: o escritor.
+ *             ImagemU8* img: imagem a salvar.
+ *             char* arquivo: caminho do arquivo a salvar.
+ *             int copia: se != 0, salva uma cpia da imagem, que continua
+ *               com o chamador. Se for 0, o escritor fica com a imagem e a
+ *               destri depois de salv-la.
+ *
+ * Valor de retorno: NENHUM */
+
+void salvaImagemU8Async (EscritorImagens* escritor, ImagemU8* img, char* arquivo, int copia)
+{
+	size_t bytes = (size_t) img->largura * img->altura * img->n_canais;
+	int canal, row;
+
+	_escritorReservaEspaco (escritor, bytes);
+
+	if (copia)
+	{
+		ImagemU8* clone = criaImagemU8 (img->largura, img->altura, img->n_canais);
+		for (canal = 0; canal < img->n_canais; canal++)
+			for (row = 0; row < img->altura; row++)
+				memcpy (clone->dados [canal][row], img->dados [canal][row], img->largura);
+		img = clone;
+	}
+
+	_escritorEnfileira (escritor, 1, img, arquivo, bytes);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Espera at que todas as imagens da fila tenham sido salvas.
+ *
+ * Parmetros: EscritorImagens* escritor: o escritor.
+ *
+ * Valor de retorno: o nmero de imagens que no puderam ser salvas desde a
+ *                   ltima chamada. */
+
+int aguardaEscritor (EscritorImagens* escritor)
+{
+	int erros;
+
+	pthread_mutex_lock (&(escritor->mutex));
+	while (escritor->primeiro || escritor->em_andamento)
+		pthread_cond_wait (&(escritor->ocioso), &(escritor->mutex));
+
+	erros = escritor->erros;
+	escritor->erros = 0;
+	pthread_mutex_unlock (&(escritor->mutex));
+
+	return (erros);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Espera todas as imagens da fila serem salvas, termina as threads e
+ * destri o escritor.
+ *
+ * Parmetros: EscritorImagens* escritor: o escritor a destruir.
+ *
+ * Valor de retorno: o nmero de imagens que no puderam ser salvas desde a
+ *                   ltima aguardaEscritor. */
+
+int destroiEscritor (EscritorImagens* escritor)
+{
+	int i, erros;
+
+	erros = aguardaEscritor (escritor);
+
+	pthread_mutex_lock (&(escritor->mutex));
+	escritor->terminando = 1;
+	pthread_cond_broadcast (&(escritor->tem_pedido));
+	pthread_mutex_unlock (&(escritor->mutex));
+
+	for (i = 0; i < escritor->n_threads; i++)
+		pthread_join (escritor->threads [i], NULL);
+
+	pthread_mutex_destroy (&(escritor->mutex));
+	pthread_cond_destroy (&(escritor->tem_pedido));
+	pthread_cond_destroy (&(escritor->tem_espaco));
+	pthread_cond_destroy (&(escritor->ocioso));
+	free (escritor->threads);
+	free (escritor);
+
+	return (erros);
+}
+
+/*============================================================================*/
+/* FUNES INTERNAS (ALOCAO)                                                */
+/*============================================================================*/
+/** Calcula o passo (nmero de floats por linha, incluindo o preenchimento)
+ * para uma largura dada.
+ *
+ * Parmetros: int largura: largura da imagem.
+ *
+ * Valor de Retorno: o passo, mltiplo de IMAGEM_ALINHAMENTO/sizeof (float). */
+
+int _imagemCalculaPasso (int largura)
+{
+	int floats_por_bloco = IMAGEM_ALINHAMENTO / sizeof (float);
+	return (((largura + floats_por_bloco - 1) / floats_por_bloco) * floats_por_bloco);
+}
+
+/*============================================================================*/
+/* FUNES INTERNAS (POOL)                                                    */
+/*============================================================================*/
+/** Obtm o pool da thread atual.
+ *
+ * Parmetros: int cria: se != 0, cria o pool se a thread ainda no tiver um.
+ *
+ * Valor de Retorno: o pool, ou NULL se a thread no tem um (e cria == 0). */
+
+// Funo auxiliar, cria a chave usada para guardar o pool de cada thread.
+void _poolCriaChave ()
+{
+	pthread_key_create (&chave_pool, _poolDestroi);
+}
+
+_PoolImagens* _poolDaThread (int cria)
+{
+	_PoolImagens* pool;
+
+	pthread_once (&chave_pool_criada, _poolCriaChave);
+	pool = (_PoolImagens*) pthread_getspecific (chave_pool);
+
+	if (!pool && cria)
+	{
+		pool = (_PoolImagens*) malloc (sizeof (_PoolImagens));
+		pool->n = 0;
+		pool->bytes = 0;
+		pthread_setspecific (chave_pool, pool);
+	}
+
+	return (pool);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destri o pool de uma thread (chamada automaticamente quando ela termina).
+ *
+ * Parmetros: void* pool: o pool.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _poolDestroi (void* pool)
+{
+	_PoolImagens* p = (_PoolImagens*) pool;
+	int i;
+
+	for (i = 0; i < p->n; i++)
+		_poolDescarta (&(p->entradas [i]));
+	free (p);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Procura no pool da thread atual uma imagem com o tamanho e nmero de canais
+ * dados. Prefere as imagens devolvidas mais recentemente.
+ *
+ * Parmetros: int tipo: POOL_FLOAT ou POOL_U8.
+ *             int largura, int altura, int n_canais: o que procurar.
+ *
+ * Valor de Retorno: a imagem (que sai do pool), ou NULL se no houver. */
+
+void* _poolRetira (int tipo, int largura, int altura, int n_canais)
+{
+	_PoolImagens* pool = _poolDaThread (0);
+	void* img;
+	int i;
+
+	if (!pool)
+		return (NULL);
+
+	for (i = pool->n-1; i >= 0; i--)
+	{
+		_EntradaPool* e = &(pool->entradas [i]);
+		if (e->tipo == tipo && e->largura == largura && e->altura == altura && e->n_canais == n_canais)
+		{
+			img = e->img;
+			pool->bytes -= e->bytes;
+			pool->n--;
+			memmove (e, e+1, sizeof (_EntradaPool) * (pool->n - i));
+			return (img);
+		}
+	}
+
+	return (NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Coloca uma imagem no pool da thread atual. Se o pool estiver cheio, as
+ * imagens mais antigas so descartadas para abrir espao.
+ *
+ * Parmetros: int tipo: POOL_FLOAT ou POOL_U8.
+ *             void* img: a imagem.
+ *             int largura, int altura, int n_canais: dados da imagem.
+ *             size_t bytes: tamanho do bloco de pixels.
+ *
+ * Valor de Retorno: 1 se a imagem ficou no pool, 0 se ela deve ser
+ *                   desalocada pelo chamador. */
+
+int _poolDevolve (int tipo, void* img, int largura, int altura, int n_canais, size_t bytes)
+{
+	_PoolImagens* pool;
+
+	if (POOL_MAX_IMAGENS == 0 || bytes > POOL_MAX_BYTES)
+		return (0);
+
+	pool = _poolDaThread (1);
+
+	while (pool->n > 0 && (pool->n == POOL_MAX_IMAGENS || pool->bytes + bytes > POOL_MAX_BYTES))
+	{
+		_poolDescarta (&(pool->entradas [0]));
+		pool->bytes -= pool->entradas [0].bytes;
+		pool->n--;
+		memmove (pool->entradas, pool->entradas+1, sizeof (_EntradaPool) * pool->n);
+	}
+
+	_EntradaPool* e = &(pool->entradas [pool->n++]);
+	e->tipo = tipo;
+	e->largura = largura;
+	e->altura = altura;
+	e->n_canais = n_canais;
+	e->bytes = bytes;
+	e->img = img;
+	pool->bytes += bytes;
+
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Desaloca de fato a imagem de uma entrada do pool.
+ *
+ * Parmetros: _EntradaPool* entrada: a entrada.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _poolDescarta (_EntradaPool* entrada)
+{
+	if (entrada->tipo == POOL_FLOAT)
+		_liberaImagem ((Imagem*) entrada->img);
+	else
+		_liberaImagemU8 ((ImagemU8*) entrada->img);
+}
+
+/*============================================================================*/
+/* FUNES INTERNAS (LEITURA)                                                 */
+/*============================================================================*/
+/** Abre um arquivo bmp, l os cabealhos e posiciona o fluxo no incio dos
+ * dados.
+ *
+ * Parmetros: char* arquivo: caminho do arquivo a abrir.
+ *             _FormatoBMP* formato: parmetro de sada. Dimenses e formato
+ *               dos dados do arquivo.
+ *
+ * Valor de Retorno: o arquivo aberto, ou NULL se ocorreu algum erro. */
+
+FILE* abreArquivoBMP (char* arquivo, _FormatoBMP* formato)
+{
+	FILE* stream;
+	unsigned long data_offset = 0;
+
+	stream = fopen (arquivo, "rb");
+	if (!stream)
+		return (NULL);
+
+	if (!leHeaderBitmap (stream, &data_offset, NULL))
+	{
+		fclose (stream);
+		return (NULL);
+	}
+
+	if (!leHeaderDIB (stream, formato))
+	{
+		fclose (stream);
+		return (NULL);
+	}
+
+	/* Pronto, cabealhos lidos! Vamos agora colocar o fluxo nos dados. */
+	if (fseek (stream, data_offset, SEEK_SET) != 0)
+	{
+		printf ("abreArquivoBMP: erro lendo dados do arquivo.\n");
+		fclose (stream);
+		return (NULL);
+	}
+
+	return (stream);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Pega os 4 primeiros bytes do buffer e coloca em um unsigned long,
+ * considerando os bytes em ordem little endian.
+ *
+ * Parmetros: unsigned char* buffer: l 4 bytes daqui.
+ *
+ * Valor de Retorno: um unsigned long com os dados do buffer reorganizados. */
+
+unsigned long getLittleEndianULong (unsigned char* buffer)
+{
+	return ((unsigned long) buffer [3] << 24) | (buffer [2] << 16) | (buffer [1] << 8) | buffer [0];
+}
+
+/*----------------------------------------------------------------------------*/
+/** Pega os 2 primeiros bytes do buffer e coloca em um unsigned short,
+ * considerando os bytes em ordem little endian.
+ *
+ * Parmetros: unsigned char* buffer: l 2 bytes daqui.
+ *
+ * Valor de Retorno: um unsigned short com os dados do buffer reorganizados. */
+
+unsigned short getLittleEndianUShort (unsigned char* buffer)
+{
+	return (unsigned short) ((buffer [1] << 8) | buffer [0]);
+}
+
+/*----------------------------------------------------------------------------*/
+/** L o header de 14 bytes do formato BMP.
+ *
+ * Parmetros: FILE* stream: arquivo a ser lido. Supomos que j est aberto.
+ *             unsigned long* offset: parmetro de sada,  o deslocamento dos
+ *               dados a partir do incio do arquivo.
+ *             unsigned long* tamanho: parmetro de sada,  o tamanho do
+ *               arquivo segundo o header. Pode ser NULL.
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int leHeaderBitmap (FILE* stream, unsigned long* offset, unsigned long* tamanho)
+{
+	unsigned char data [14]; /* O bloco tem exatamente 14 bytes. */
+
+	if (fread ((void*) data, 1, 14, stream) != 14)
+	{
+		printf ("leHeaderBitmap: erro lendo header.\n");
+		return (0);
+	}
+
+	/* Os 2 primeiros bytes precisam ser 'B' e 'M'. */
+	if (data [0] != 'B' || data [1] != 'M')
+	{
+		printf ("leHeaderBitmap: pode ler apenas formato BM.\n");
+		return (0);
+	}
+
+	/* Vou pular todo o resto e ir direto para o offset. */
+	*offset = (unsigned int) getLittleEndianULong (&(data [10]));
+	if (tamanho)
+		*tamanho = (unsigned int) getLittleEndianULong (&(data [2]));
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** L o header DIB (e a paleta, se houver). Aceita arquivos sem compresso
+ * de 8 bpp (com paleta), 24 bpp (BGR) e 32 bpp (BGRA, o alfa  ignorado),
+ * guardados de baixo para cima (altura positiva) ou de cima para baixo
+ * (altura negativa). Arquivos de 32 bpp tambm podem usar BI_BITFIELDS, desde
+ * que as mscaras sejam as usuais.
+ *
+ * Parmetros: FILE* stream: arquivo a ser lido, posicionado logo depois do
+ *               header de 14 bytes.
+ *             _FormatoBMP* formato: parmetro de sada. Dimenses e formato
+ *               dos dados do arquivo.
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int leHeaderDIB (FILE* stream, _FormatoBMP* formato)
+{
+	unsigned char data [124]; /* O maior header, BITMAPV5HEADER. */
+	unsigned long size; /* O tamanho do cabealho DIB. */
+	unsigned long compressao, n_cores;
+	int largura, altura, i;
+
+	if (fread ((void*) data, 1, 4, stream) != 4)
+	{
+		printf ("leHeaderDIB: erro lendo header.\n");
+		return (0);
+	}
+
+	size = (unsigned int) getLittleEndianULong (data);
+	if (size == 12) /* Formato BITMAPCOREHEADER. */
+	{
+		printf ("leHeaderDIB: BITMAPCOREHEADER nao suportado (arquivo antigo!?)\n");
+		return (0);
+	}
+
+	if (size < 40 || size > 124 || fread ((void*) (data+4), 1, size-4, stream) != size-4)
+	{
+		printf ("leHeaderDIB: erro lendo header.\n");
+		return (0);
+	}
+
+	/* Largura e altura. Uma altura negativa indica que as linhas esto
+	   guardadas de cima para baixo. */
+	formato->tamanho_header = size;
+	largura = (int) getLittleEndianULong (&(data [4]));
+	altura = (int) getLittleEndianULong (&(data [8]));
+	if (largura <= 0)
+	{
+		printf ("leHeaderDIB: largura invalida.\n");
+		return (0);
+	}
+
+	if (altura == 0)
+	{
+		printf ("leHeaderDIB: altura invalida.\n");
+		return (0);
+	}
+
+	formato->largura = largura;
+	formato->altura = (altura < 0)? -altura : altura;
+	formato->invertida = (altura < 0);
+
+	/* Color planes. Precisa ser 1. */
+	if (getLittleEndianUShort (&(data [12])) != 1)
+	{
+		printf ("leHeaderDIB: erro lendo header.\n");
+		return (0);
+	}
+
+	/* Bpp. */
+	formato->bpp = getLittleEndianUShort (&(data [14]));
+	if (formato->bpp != 8 && formato->bpp != 24 && formato->bpp != 32)
+	{
+		printf ("leHeaderDIB: suporta apenas arquivos com 8, 24 ou 32 bpp.\n");
+		return (0);
+	}
+
+	/* Compresso. Vou aceitar s imagens sem compresso. BI_BITFIELDS (3) s
+	   descreve onde esto os canais em um pixel de 32 bits. */
+	compressao = (unsigned int) getLittleEndianULong (&(data [16]));
+	if (compressao == 3 && formato->bpp == 32)
+	{
+		unsigned char* mascaras = &(data [40]);
+
+		/* No BITMAPINFOHEADER, as mscaras vm logo depois do header. */
+		if (size < 52)
+		{
+			if (fread ((void*) mascaras, 1, 12, stream) != 12)
+			{
+				printf ("leHeaderDIB: erro lendo header.\n");
+				return (0);
+			}
+			formato->tamanho_header += 12;
+		}
+
+		if (getLittleEndianULong (&(mascaras [0])) != 0x00FF0000 ||
+		    getLittleEndianULong (&(mascaras [4])) != 0x0000FF00 ||
+		    getLittleEndianULong (&(mascaras [8])) != 0x000000FF)
+		{
+			printf ("leHeaderDIB: suporta apenas mascaras BGRA.\n");
+			return (0);
+		}
+	}
+	else if (compressao != 0)
+	{
+		printf ("leHeaderDIB: suporta apenas arquivos sem compressao.\n");
+		return (0);
+	}
+
+	/* Cada linha no arquivo precisa ter um mltiplo de 4 bytes. */
+	formato->largura_linha = (((unsigned long) largura * formato->bpp + 31) / 32) * 4;
+	formato->cinza = 0;
+
+	/* Paleta. S  usada em arquivos de 8 bpp. */
+	n_cores = (unsigned int) getLittleEndianULong (&(data [32]));
+	if (formato->bpp != 8)
+		return (1);
+
+	if (n_cores == 0 || n_cores > 256)
+		n_cores = 256;
+
+	unsigned char paleta [256*4];
+	if (fread ((void*) paleta, 4, n_cores, stream) != n_cores)
+	{
+		printf ("leHeaderDIB: erro lendo paleta.\n");
+		return (0);
+	}
+	formato->tamanho_header += n_cores*4;
+
+	/* ndices fora da paleta viram preto. */
+	memset (formato->paleta, 0, sizeof (formato->paleta));
+	formato->cinza = 1;
+	for (i = 0; i < (int) n_cores; i++)
+	{
+		formato->paleta [i][0] = paleta [i*4+2];
+		formato->paleta [i][1] = paleta [i*4+1];
+		formato->paleta [i][2] = paleta [i*4];
+		if (paleta [i*4] != i || paleta [i*4+1] != i || paleta [i*4+2] != i)
+			formato->cinza = 0;
+	}
+
+	if (n_cores < 256)
+		formato->cinza = 0;
+
+	/* Pr-calcula a converso de cada ndice para cinza e para float. */
+	for (i = 0; i < 256; i++)
+	{
+		int soma = formato->paleta [i][0] * 19595 + formato->paleta [i][1] * 38470 + formato->paleta [i][2] * 7471;
+		formato->paleta [i][3] = (unsigned char) ((soma + 32768) >> 16);
+		formato->paleta_float [0][i] = (float) formato->paleta [i][0] / 255.0f;
+		formato->paleta_float [1][i] = (float) formato->paleta [i][1] / 255.0f;
+		formato->paleta_float [2][i] = (float) formato->paleta [i][2] / 255.0f;
+		formato->paleta_float [3][i] = (float) soma * (1.0f / (255.0f * 65536.0f));
+	}
+
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** L os dados de um arquivo. Todo o bloco de dados  lido de uma vez, e
+ * depois os pixels so separados nos canais R, G e B (ou convertidos para
+ * escala de cinza, se a imagem tiver 1 canal).
+ *
+ * Parmetros: FILE* stream: arquivo a ser lido. Supomos que j est aberto.
+ *             _FormatoBMP* formato: formato dos dados, lido dos cabealhos.
+ *             Imagem* img: imagem a preencher.
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int leDados (FILE* stream, _FormatoBMP* formato, Imagem* img)
+{
+	unsigned char* bytes;
+
+	bytes = _leBlocoBMP (stream, formato);
+	if (!bytes)
+		return (0);
+
+	_converteBlocoParaImagem (bytes, formato, img);
+
+	free (bytes);
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** L de uma vez todo o bloco de dados de um arquivo.
+ *
+ * Parmetros: FILE* stream: arquivo a ser lido, posicionado nos dados.
+ *             _FormatoBMP* formato: formato dos dados, lido dos cabealhos.
+ *
+ * Valor de Retorno: um bloco alocado com os dados (lembre-se de desaloc-lo!),
+ *                   ou NULL se ocorreu algum erro. */
+
+unsigned char* _leBlocoBMP (FILE* stream, _FormatoBMP* formato)
+{
+	unsigned long tamanho, preenchimento;
+	unsigned char* bytes;
+
+	tamanho = formato->largura_linha * formato->altura;
+	preenchimento = formato->largura_linha - ((unsigned long) formato->largura * formato->bpp + 7) / 8;
+
+	/* L tudo! */
+	bytes = (unsigned char*) malloc (tamanho);
+	if (!bytes)
+		return (NULL);
+
+	/* A ltima linha no precisa ter o preenchimento completo. */
+	if (fread (bytes, 1, tamanho, stream) < tamanho - preenchimento)
+	{
+		free (bytes);
+		return (NULL);
+	}
+
+	return (bytes);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Converte um bloco de dados (no formato do arquivo) para os canais de uma
+ * imagem, usando uma tabela de converso de 8 bits para float. Se a imagem
+ * tiver 1 canal, os pixels so convertidos diretamente para escala de cinza.
+ * Em imagens grandes, a converso  dividida em faixas de linhas processadas
+ * em paralelo.
+ *
+ * Parmetros: unsigned char* bytes: primeira linha do bloco no arquivo.
+ *             _FormatoBMP* formato: formato dos dados.
+ *             Imagem* img: imagem de 1 ou 3 canais a preencher.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _converteBlocoParaImagem (unsigned char* bytes, _FormatoBMP* formato, Imagem* img)
+{
+	int i, n_threads;
+
+	_inicializaTabelaU8ParaFloat ();
+
+	/* Decide quantas faixas usar. */
+	n_threads = (int) (((long long) img->largura * img->altura) / LEITURA_MIN_PIXELS_POR_THREAD);
+	n_threads = MAX (1, MIN (n_threads, LEITURA_MAX_THREADS));
+
+	_FaixaLeitura faixas [LEITURA_MAX_THREADS];
+	pthread_t threads [LEITURA_MAX_THREADS];
+	int criada [LEITURA_MAX_THREADS];
+
+	for (i = 0; i < n_threads; i++)
+	{
+		faixas [i].bytes = bytes;
+		faixas [i].formato = formato;
+		faixas [i].img = img;
+		faixas [i].inicio = (int) ((long long) img->altura * i / n_threads);
+		faixas [i].fim = (int) ((long long) img->altura * (i+1) / n_threads);
+	}
+
+	/* A primeira faixa fica com esta thread. Se no der para criar uma
+	   thread, a prpria thread atual processa a faixa depois. */
+	for (i = 1; i < n_threads; i++)
+		criada [i] = (pthread_create (&(threads [i]), NULL, _leDadosConverteFaixa, &(faixas [i])) == 0);
+
+	_leDadosConverteFaixa (&(faixas [0]));
+
+	for (i = 1; i < n_threads; i++)
+	{
+		if (criada [i])
+			pthread_join (threads [i], NULL);
+		else
+			_leDadosConverteFaixa (&(faixas [i]));
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/** Preenche (uma nica vez) a tabela de converso de 8 bits para float.
+ *
+ * Parmetros: nenhum.
+ *
+ * Valor de Retorno: nenhum. */
+
+void _inicializaTabelaU8ParaFloat ()
+{
+	static pthread_once_t inicializada = PTHREAD_ONCE_INIT;
+	pthread_once (&inicializada, _preencheTabelaU8ParaFloat);
+}
+
+void _preencheTabelaU8ParaFloat ()
+{
+	int i;
+	for (i = 0; i < 256; i++)
+		tabela_u8_para_float [i] = (float) i / 255.0f; /* Coloca na faixa [0,1]. */
+}
+
+/*----------------------------------------------------------------------------*/
+/** Obtm, no bloco de dados do arquivo, a linha y da imagem. Normalmente as
+ * linhas no arquivo ficam de baixo para cima.
+ *
+ * Parmetros: unsigned char* bytes: primeira linha do bloco no arquivo.
+ *             _FormatoBMP* formato: formato dos dados.
+ *             int y: linha desejada.
+ *
+ * Valor de Retorno: ponteiro para o incio da linha no bloco. */
+
+unsigned char* _linhaBlocoBMP (unsigned char* bytes, _FormatoBMP* formato, int y)
+{
+	int linha = (formato->invertida)? y : formato->altura-1-y;
+	return (bytes + (size_t) linha * formato->largura_linha);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Converte os pixels de uma faixa de linhas para os canais da imagem. Cada
+ * formato (8, 24 ou 32 bpp) tem o seu prprio lao, para que o lao interno
+ * no precise testar nada. Em imagens de 1 canal, usa os pesos da
+ * RGBParaCinza em ponto fixo (16 bits de frao). A soma inteira cabe
+ * exatamente em um float, ento s h um arredondamento, na multiplicao
+ * final. Em arquivos de 8 bpp, a converso de cada ndice da paleta j foi
+ * calculada pela leHeaderDIB.
+ *
+ * Parmetros: void* arg: ponteiro para um _FaixaLeitura.
+ *
+ * Valor de Retorno: NULL (assinatura exigida pela pthread_create). */
+
+void* _leDadosConverteFaixa (void* arg)
+{
+	_FaixaLeitura* faixa = (_FaixaLeitura*) arg;
+	_FormatoBMP* formato = faixa->formato;
+	Imagem* img = faixa->img;
+	const float escala = 1.0f / (255.0f * 65536.0f);
+	int row, col;
+
+	for (row = faixa->inicio; row < faixa->fim; row++)
+	{
+		unsigned char* linha = _linhaBlocoBMP (faixa->bytes, formato, row);
+
+		if (img->n_canais == 1)
+		{
+			float* cinza = img->dados [0][row];
+
+			if (formato->bpp == 8)
+			{
+				for (col = 0; col < img->largura; col++)
+					cinza [col] = formato->paleta_float [3][linha [col]];
+			}
+			else if (formato->bpp == 24)
+			{
+				for (col = 0; col < img->largura; col++, linha += 3)
+					cinza [col] = (float) (linha [2] * 19595 + linha [1] * 38470 + linha [0] * 7471) * escala;
+			}
+			else
+			{
+				for (col = 0; col < img->largura; col++, linha += 4)
+					cinza [col] = (float) (linha [2] * 19595 + linha [1] * 38470 + linha [0] * 7471) * escala;
+			}
+		}
+		else
+		{
+			float* r = img->dados [0][row];
+			float* g = img->dados [1][row];
+			float* b = img->dados [2][row];
+
+			if (formato->bpp == 8)
+			{
+				for (col = 0; col < img->largura; col++)
+				{
+					r [col] = formato->paleta_float [0][linha [col]];
+					g [col] = formato->paleta_float [1][linha [col]];
+					b [col] = formato->paleta_float [2][linha [col]];
+				}
+			}
+			else if (formato->bpp == 24)
+			{
+				for (col = 0; col < img->largura; col++, linha += 3)
+				{
+					b [col] = tabela_u8_para_float [linha [0]];
+					g [col] = tabela_u8_para_float [linha [1]];
+					r [col] = tabela_u8_para_float [linha [2]];
+				}
+			}
+			else
+			{
+				for (col = 0; col < img->largura; col++, linha += 4)
+				{
+					b [col] = tabela_u8_para_float [linha [0]];
+					g [col] = tabela_u8_para_float [linha [1]];
+					r [col] = tabela_u8_para_float [linha [2]];
+				}
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+/** L os dados de um arquivo para uma imagem de 8 bits. Se a imagem tiver 1
+ * canal, converte para escala de cinza durante a leitura, usando os mesmos
+ * pesos da RGBParaCinza em ponto fixo (16 bits de frao).
+ *
+ * Parmetros: FILE* stream: arquivo a ser lido. Supomos que j est aberto.
+ *             _FormatoBMP* formato: formato dos dados, lido dos cabealhos.
+ *             ImagemU8* img: imagem a preencher (1 ou 3 canais).
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int leDadosU8 (FILE* stream, _FormatoBMP* formato, ImagemU8* img)
+{
+	unsigned char* bytes;
+	int row;
+
+	bytes = _leBlocoBMP (stream, formato);
+	if (!bytes)
+		return (0);
+
+	for (row = 0; row < img->altura; row++)
+		_converteLinhaU8 (_linhaBlocoBMP (bytes, formato, row), formato, img, row);
+
+	free (bytes);
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Converte uma linha do arquivo (8, 24 ou 32 bpp) para a linha row de uma
+ * imagem de 8 bits. Se a imagem tiver 1 canal, converte para escala de cinza.
+ *
+ * Parmetros: unsigned char* linha: a linha no formato do arquivo.
+ *             _FormatoBMP* formato: formato dos dados.
+ *             ImagemU8* img: imagem a preencher (1 ou 3 canais).
+ *             int row: linha da imagem.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _converteLinhaU8 (unsigned char* linha, _FormatoBMP* formato, ImagemU8* img, int row)
+{
+	int col;
+	int passo_pixel = formato->bpp / 8;
+
+	/* Um arquivo de 8 bpp com paleta de cinza j est no formato certo. */
+	if (formato->bpp == 8 && formato->cinza && img->n_canais == 1)
+		memcpy (img->dados [0][row], linha, img->largura);
+	else if (img->n_canais == 1)
+	{
+		unsigned char* cinza = img->dados [0][row];
+
+		if (formato->bpp == 8)
+		{
+			for (col = 0; col < img->largura; col++)
+				cinza [col] = formato->paleta [linha [col]][3];
+		}
+		else
+		{
+			for (col = 0; col < img->largura; col++, linha += passo_pixel)
+				cinza [col] = (unsigned char) ((linha [2] * 19595 + linha [1] * 38470 + linha [0] * 7471 + 32768) >> 16);
+		}
+	}
+	else
+	{
+		unsigned char* r = img->dados [0][row];
+		unsigned char* g = img->dados [1][row];
+		unsigned char* b = img->dados [2][row];
+
+		if (formato->bpp == 8)
+		{
+			for (col = 0; col < img->largura; col++)
+			{
+				r [col] = formato->paleta [linha [col]][0];
+				g [col] = formato->paleta [linha [col]][1];
+				b [col] = formato->paleta [linha [col]][2];
+			}
+		}
+		else if (formato->bpp == 24)
+		{
+			for (col = 0; col < img->largura; col++, linha += 3)
+			{
+				b [col] = linha [0];
+				g [col] = linha [1];
+				r [col] = linha [2];
+			}
+		}
+		else
+		{
+			for (col = 0; col < img->largura; col++, linha += 4)
+			{
+				b [col] = linha [0];
+				g [col] = linha [1];
+				r [col] = linha [2];
+			}
+		}
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/** L e descarta bytes de um fluxo. Ao contrrio da fseek, funciona tambm
+ * com pipes.
+ *
+ * Parmetros: FILE* stream: fluxo a ser lido.
+ *             unsigned long n: nmero de bytes a descartar.
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int _descartaBytes (FILE* stream, unsigned long n)
+{
+	unsigned char lixo [4096];
+
+	while (n > 0)
+	{
+		size_t k = (n < sizeof (lixo))? n : sizeof (lixo);
+		if (fread ((void*) lixo, 1, k, stream) != k)
+			return (0);
+		n -= k;
+	}
+
+	return (1);
+}
+
+/*============================================================================*/
+/* FUNES INTERNAS (ESCRITA)                                                 */
+/*============================================================================*/
+/** Coloca um unsigned long nos 4 primeiros bytes do buffer, em ordem little
+ * endian.
+ *
+ * Parmetros: unsigned long val: valor a escrever.
+ *             unsigned char* buffer: coloca o valor aqui.
+ *
+ * Valor de Retorno: NENHUM */
+
+void putLittleEndianULong (unsigned long val, unsigned char* buffer)
+{
+	buffer [0] = (unsigned char) val;
+	buffer [1] = (unsigned char) (val >> 8);
+	buffer [2] = (unsigned char) (val >> 16);
+	buffer [3] = (unsigned char) (val >> 24);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Coloca um unsigned short nos 2 primeiros bytes do buffer, em ordem little
+ * endian.
+ *
+ * Parmetros: unsigned short val: valor a escrever.
+ *             unsigned char* buffer: coloca o valor aqui.
+ *
+ * Valor de Retorno: NENHUM */
+
+void putLittleEndianUShort (unsigned short val, unsigned char* buffer)
+{
+	buffer [0] = (unsigned char) val;
+	buffer [1] = (unsigned char) (val >> 8);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Escreve o header Bitmap.
+ *
+ * Parmetros: FILE* file: arquivo a ser escrito. Supomos que j est aberto.
+ *             int largura: largura da imagem a ser salva.
+ *             int altura: altura da imagem a ser salva.
+ *             int bpp: 24, ou 8 (com uma paleta de 256 cores).
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int salvaHeaderBitmap (FILE* stream, int largura, int altura, int bpp)
+{
+	unsigned char data [14]; /* O bloco tem exatamente 14 bytes. */
+	int pos = 0;
+	unsigned long bytes_por_linha, offset;
+
+	data [pos++] = 'B';
+	data [pos++] = 'M';
+
+	/* Tamanho do arquivo. Definimos como sendo 14+40 (dos cabealhos) + a
+	   paleta + o espao dos dados. */
+	bytes_por_linha = (((unsigned long) largura * bpp + 31) / 32) * 4;
+	offset = 14+40 + ((bpp == 8)? 256*4 : 0);
+	putLittleEndianULong (offset+altura*bytes_por_linha, &(data [pos]));
+	pos+=4;
+
+	/* Reservado. */
 	putLittleEndianULong (0, &(data [pos]));
 	pos+=4;
 
-	/* Offset. Definimos como 14+40 (o tamanho dos cabealhos). */
-	putLittleEndianULong (14+40, &(data [pos]));
+	/* Offset. Definimos como 14+40 (o tamanho dos cabealhos) + a paleta. */
+	putLittleEndianULong (offset, &(data [pos]));
 
 	if (fwrite ((void*) data, 1, 14, stream) != 14)
 	{
@@ -618,11 +2173,13 @@ int salvaHeaderBitmap (FILE* stream, Imagem* img)
 /** Escreve o header DIB.
  *
  * Parmetros: FILE* file: arquivo a ser escrito. Supomos que j est aberto.
- *             Imagem* img: imagem a ser salva.
+ *             int largura: largura da imagem a ser salva.
+ *             int altura: altura da imagem a ser salva.
+ *             int bpp: 24, ou 8 (com uma paleta de 256 cores).
  *
  * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
 
-int salvaHeaderDIB (FILE* stream, Imagem* img)
+int salvaHeaderDIB (FILE* stream, int largura, int altura, int bpp)
 {
 	unsigned char data [40]; /* O bloco tem exatamente 40 bytes. */
 	int pos = 0;
@@ -633,11 +2190,11 @@ int salvaHeaderDIB (FILE* stream, Imagem* img)
 	pos += 4;
 
 	/* Largura. */
-	putLittleEndianULong (img->largura, &(data [pos]));
+	putLittleEndianULong (largura, &(data [pos]));
 	pos += 4;
 
 	/* Altura. */
-	putLittleEndianULong (img->altura, &(data [pos]));
+	putLittleEndianULong (altura, &(data [pos]));
 	pos += 4;
 
 	/* Color planes. */
@@ -645,7 +2202,7 @@ int salvaHeaderDIB (FILE* stream, Imagem* img)
 	pos += 2;
 
 	/* bpp. */
-	putLittleEndianUShort (24, &(data [pos]));
+	putLittleEndianUShort (bpp, &(data [pos]));
 	pos += 2;
 
 	/* Compresso. */
@@ -653,8 +2210,8 @@ int salvaHeaderDIB (FILE* stream, Imagem* img)
 	pos += 4;
 
 	/* Tamanho dos dados. */
-	bytes_por_linha = (unsigned long) ceil (img->largura*3.0/4.0)*4;
-	putLittleEndianULong (img->altura*bytes_por_linha, &(data [pos]));
+	bytes_por_linha = (((unsigned long) largura * bpp + 31) / 32) * 4;
+	putLittleEndianULong (altura*bytes_por_linha, &(data [pos]));
 	pos += 4;
 
 	/* Resoluo horizontal e vertical (simplesmente copiei este valor de algum arquivo!). */
@@ -664,7 +2221,7 @@ int salvaHeaderDIB (FILE* stream, Imagem* img)
 	pos += 4;
 
 	/* Cores. */
-	putLittleEndianULong (0, &(data [pos]));
+	putLittleEndianULong ((bpp == 8)? 256 : 0, &(data [pos]));
 	pos += 4;
 	putLittleEndianULong (0, &(data [pos]));
 	pos += 4;
@@ -679,7 +2236,38 @@ int salvaHeaderDIB (FILE* stream, Imagem* img)
 }
 
 /*----------------------------------------------------------------------------*/
-/** Escreve o bloco de dados.
+/** Escreve a paleta de um arquivo de 8 bpp em escala de cinza: o ndice i
+ * corresponde  cor (i,i,i).
+ *
+ * Parmetros: FILE* file: arquivo a ser escrito. Supomos que j est aberto.
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int salvaPaletaCinza (FILE* stream)
+{
+	unsigned char data [256*4]; /* BGR + 1 byte reservado para cada cor. */
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		data [i*4] = data [i*4+1] = data [i*4+2] = (unsigned char) i;
+		data [i*4+3] = 0;
+	}
+
+	if (fwrite ((void*) data, 1, 256*4, stream) != 256*4)
+	{
+		printf ("salvaPaletaCinza: erro escrevendo paleta.\n");
+		return (0);
+	}
+
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Escreve o bloco de dados. Cada linha de cada canal  convertida de uma vez
+ * para 8 bits; em imagens de 3 canais os bytes so depois intercalados na
+ * ordem BGR. Imagens de 1 canal so escritas com 8 bpp (os bytes so os
+ * ndices da paleta de cinza).
  *
  * Parmetros: FILE* file: arquivo a ser escrito. Supomos que j est aberto.
  *             Imagem* img: imagem a ser salva.
@@ -688,44 +2276,132 @@ int salvaHeaderDIB (FILE* stream, Imagem* img)
 
 int salvaDados (FILE* stream, Imagem* img)
 {
-    unsigned char dado;
-	long long i, j, k;
-	unsigned long largura_linha, line_padding;
+	long long i, j;
+	unsigned long largura_linha;
 	unsigned char* linha;
-	unsigned long pos_linha;
+	unsigned char* canais = NULL; /* Uma linha de cada canal, j em 8 bits. */
 
-	/* Calcula quantos bytes preciso pular no fim de cada linha.
-	  Aqui, cada linha precisa ter um mltiplo de 4. */
-	largura_linha = (unsigned long) ceil (img->largura*3.0/4.0)*4;
-	line_padding = largura_linha - (img->largura*3);
-	linha = (unsigned char*) malloc (sizeof (unsigned char) * largura_linha);
+	/* Cada linha precisa ter um mltiplo de 4 bytes. O preenchimento fica em 0. */
+	largura_linha = (((unsigned long) img->largura * img->n_canais + 3) / 4) * 4;
+	linha = (unsigned char*) calloc (largura_linha, sizeof (unsigned char));
+	if (img->n_canais == 3)
+		canais = (unsigned char*) malloc (sizeof (unsigned char) * img->largura * 3);
 
-    for (i = img->altura-1; i >= 0; i--)
+	for (i = img->altura-1; i >= 0; i--)
 	{
-		pos_linha = 0;
-		for (j = 0; j < img->largura; j++)
+		if (img->n_canais == 1)
+			_floatParaU8Linha (img->dados [0][i], linha, img->largura);
+		else
 		{
-		    /* Imagem de 3 canais: converte para uchar na ordem BGR. */
-		    if (img->n_canais == 3)
-		    {
-		        for (k = 0; k < 3; k++)
-		            linha [pos_linha++] = float2uchar (img->dados [2-k][i][j]);
-		    }
-		    else /* Imagem de 1 canal: converte para uchar e replica 3 vezes. */
-		    {
-		        dado = float2uchar (img->dados [0][i][j]);
-                for (k = 0; k < 3; k++)
-                    linha [pos_linha++] = dado;
-            }
+			unsigned char* r = canais;
+			unsigned char* g = canais + img->largura;
+			unsigned char* b = canais + 2*img->largura;
+			unsigned char* pos = linha;
+
+			_floatParaU8Linha (img->dados [0][i], r, img->largura);
+			_floatParaU8Linha (img->dados [1][i], g, img->largura);
+			_floatParaU8Linha (img->dados [2][i], b, img->largura);
+
+			for (j = 0; j < img->largura; j++)
+			{
+				*(pos++) = b [j];
+				*(pos++) = g [j];
+				*(pos++) = r [j];
+			}
 		}
 
-		for (j = 0; j < line_padding; j++)
-			linha [pos_linha++] = 0;
-
 		if (fwrite ((void*) linha, 1, largura_linha, stream) != largura_linha)
 		{
 			printf ("salvaDados: errro escrevendo dados da imagem.\n");
 			free (linha);
+			free (canais);
+			return (0);
+		}
+	}
+
+	free (linha);
+	free (canais);
+	return (1);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Converte uma linha de floats para 8 bits, com o mesmo resultado da
+ * float2uchar. Com SSE2, 16 valores so escalados, arredondados, saturados e
+ * empacotados por vez.
+ *
+ * Parmetros: float* in: valores de entrada (no precisam estar alinhados).
+ *             unsigned char* out: sada, com n bytes.
+ *             int n: nmero de valores.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _floatParaU8Linha (float* in, unsigned char* out, int n)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	const __m128 escala = _mm_set1_ps (255.0f);
+	const __m128 meio = _mm_set1_ps (0.5f);
+	const __m128 zero = _mm_setzero_ps ();
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v [4];
+		int k;
+
+		/* Mesma sequncia da float2uchar: escala, soma 0.5, satura e trunca. */
+		for (k = 0; k < 4; k++)
+		{
+			__m128 x = _mm_add_ps (_mm_mul_ps (_mm_loadu_ps (in + i + k*4), escala), meio);
+			x = _mm_min_ps (_mm_max_ps (x, zero), escala);
+			v [k] = _mm_cvttps_epi32 (x);
+		}
+
+		_mm_storeu_si128 ((__m128i*) (out + i), _mm_packus_epi16 (_mm_packs_epi32 (v [0], v [1]), _mm_packs_epi32 (v [2], v [3])));
+	}
+#endif
+
+	for (; i < n; i++)
+		out [i] = float2uchar (in [i]);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Escreve o bloco de dados de uma imagem de 8 bits.
+ *
+ * Parmetros: FILE* file: arquivo a ser escrito. Supomos que j est aberto.
+ *             ImagemU8* img: imagem a ser salva.
+ *
+ * Valor de Retorno: 1 se no ocorreram erros, 0 do contrrio. */
+
+int salvaDadosU8 (FILE* stream, ImagemU8* img)
+{
+	long long i, j;
+	unsigned long largura_linha;
+	unsigned char* linha;
+
+	largura_linha = (((unsigned long) img->largura * img->n_canais + 3) / 4) * 4;
+	linha = (unsigned char*) calloc (largura_linha, sizeof (unsigned char)); /* O preenchimento fica em 0. */
+
+	for (i = img->altura-1; i >= 0; i--)
+	{
+		unsigned char* pos = linha;
+
+		if (img->n_canais == 3) /* Na ordem BGR. */
+		{
+			for (j = 0; j < img->largura; j++)
+			{
+				*(pos++) = img->dados [2][i][j];
+				*(pos++) = img->dados [1][i][j];
+				*(pos++) = img->dados [0][i][j];
+			}
+		}
+		else /* 8 bpp: o ndice na paleta de cinza  o prprio valor. */
+			memcpy (pos, img->dados [0][i], img->largura);
+
+		if (fwrite ((void*) linha, 1, largura_linha, stream) != largura_linha)
+		{
+			printf ("salvaDadosU8: errro escrevendo dados da imagem.\n");
+			free (linha);
 			return (0);
 		}
 	}
@@ -735,3 +2411,117 @@ int salvaDados (FILE* stream, Imagem* img)
 }
 
 /*============================================================================*/
+/* FUNES INTERNAS (ESCRITA ASSNCRONA)                                      */
+/*============================================================================*/
+/** Espera at haver espao na fila para mais uma imagem, e reserva esse
+ * espao. Uma imagem maior que o limite  aceita quando a fila est vazia.
+ *
+ * Parmetros: EscritorImagens* escritor: o escritor.
+ *             size_t bytes: tamanho dos pixels da imagem.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _escritorReservaEspaco (EscritorImagens* escritor, size_t bytes)
+{
+	pthread_mutex_lock (&(escritor->mutex));
+	while (escritor->bytes > 0 && escritor->bytes + bytes > escritor->max_bytes)
+		pthread_cond_wait (&(escritor->tem_espaco), &(escritor->mutex));
+
+	escritor->bytes += bytes;
+	pthread_mutex_unlock (&(escritor->mutex));
+}
+
+/*----------------------------------------------------------------------------*/
+/** Coloca um pedido no fim da fila (o espao j foi reservado).
+ *
+ * Parmetros: EscritorImagens* escritor: o escritor.
+ *             int tipo: 0 para Imagem, 1 para ImagemU8.
+ *             void* img: imagem a salvar. O escritor fica com ela.
+ *             char* arquivo: caminho do arquivo ( copiado).
+ *             size_t bytes: espao reservado para a imagem.
+ *
+ * Valor de Retorno: NENHUM */
+
+void _escritorEnfileira (EscritorImagens* escritor, int tipo, void* img, char* arquivo, size_t bytes)
+{
+	PedidoEscrita* pedido = (PedidoEscrita*) malloc (sizeof (PedidoEscrita));
+	pedido->tipo = tipo;
+	pedido->img = img;
+	pedido->arquivo = (char*) malloc (strlen (arquivo) + 1);
+	strcpy (pedido->arquivo, arquivo);
+	pedido->bytes = bytes;
+	pedido->prox = NULL;
+
+	pthread_mutex_lock (&(escritor->mutex));
+	if (escritor->ultimo)
+		escritor->ultimo->prox = pedido;
+	else
+		escritor->primeiro = pedido;
+	escritor->ultimo = pedido;
+	pthread_cond_signal (&(escritor->tem_pedido));
+	pthread_mutex_unlock (&(escritor->mutex));
+}
+
+/*----------------------------------------------------------------------------*/
+/** Lao de uma thread escritora: retira pedidos da fila e salva as imagens,
+ * at o escritor ser destrudo. As imagens so desalocadas diretamente, sem
+ * passar pelo pool: o pool desta thread nunca seria usado.
+ *
+ * Parmetros: void* arg: ponteiro para o EscritorImagens.
+ *
+ * Valor de Retorno: NULL (assinatura exigida pela pthread_create). */
+
+void* _escritorThread (void* arg)
+{
+	EscritorImagens* escritor = (EscritorImagens*) arg;
+	PedidoEscrita* pedido;
+	int ok;
+
+	pthread_mutex_lock (&(escritor->mutex));
+	for (;;)
+	{
+		while (!escritor->primeiro && !escritor->terminando)
+			pthread_cond_wait (&(escritor->tem_pedido), &(escritor->mutex));
+
+		if (!escritor->primeiro) /* Terminando, e no h mais nada para salvar. */
+			break;
+
+		pedido = escritor->primeiro;
+		escritor->primeiro = pedido->prox;
+		if (!escritor->primeiro)
+			escritor->ultimo = NULL;
+		escritor->em_andamento++;
+		pthread_mutex_unlock (&(escritor->mutex));
+
+		if (pedido->tipo == 0)
+		{
+			ok = salvaImagem ((Imagem*) pedido->img, pedido->arquivo);
+			_liberaImagem ((Imagem*) pedido->img);
+		}
+		else
+		{
+			ok = salvaImagemU8 ((ImagemU8*) pedido->img, pedido->arquivo);
+			_liberaImagemU8 ((ImagemU8*) pedido->img);
+		}
+
+		if (!ok)
+			printf ("salvaImagemAsync: erro salvando %s.\n", pedido->arquivo);
+
+		pthread_mutex_lock (&(escritor->mutex));
+		if (!ok)
+			escritor->erros++;
+		escritor->bytes -= pedido->bytes;
+		escritor->em_andamento--;
+		pthread_cond_broadcast (&(escritor->tem_espaco));
+		if (!escritor->primeiro && !escritor->em_andamento)
+			pthread_cond_broadcast (&(escritor->ocioso));
+
+		free (pedido->arquivo);
+		free (pedido);
+	}
+	pthread_mutex_unlock (&(escritor->mutex));
+
+	return (NULL);
+}
+
+/*============================================================================*/
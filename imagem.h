@@ -14,20 +14,50 @@
 #ifndef __IMAGEM_H
 #define __IMAGEM_H
 
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
 /*============================================================================*/
 
-typedef struct
+typedef struct Imagem
 {
 	int largura;
 	int altura;
 	int n_canais;
+	int passo; /* Nmero de floats entre o incio de duas linhas consecutivas (>= largura). */
+	float* bloco; /* Bloco nico e alinhado com os pixels de todos os canais. NULL em vises. */
 	float*** dados; /* Uma matriz de dados por canal. Acessar com 3 ndices: [canal][y][x]. */
+	struct Imagem* pai; /* Em vises, a imagem de onde vm os pixels. NULL do contrrio. */
+	int origem_x; /* Em vises, posio do pixel (0,0) na imagem pai. */
+	int origem_y;
+	int capacidade_linhas; /* Em vises, ponteiros de linha reservados por canal. */
 } Imagem;
 
+/* Alinhamento (em bytes) do bloco de pixels e do incio de cada linha. */
+#define IMAGEM_ALINHAMENTO 64
+
+/* Leitura em paralelo: imagens com menos pixels que isso por thread so
+ * convertidas por uma thread s. Use LEITURA_MAX_THREADS 1 para desligar. */
+#ifndef LEITURA_MAX_THREADS
+#define LEITURA_MAX_THREADS 4
+#endif
+#define LEITURA_MIN_PIXELS_POR_THREAD (1 << 19)
+
+/* Limites do pool de imagens de cada thread. Use POOL_MAX_IMAGENS 0 para
+ * desligar o pool. */
+#ifndef POOL_MAX_IMAGENS
+#define POOL_MAX_IMAGENS 16
+#endif
+#ifndef POOL_MAX_BYTES
+#define POOL_MAX_BYTES (256 << 20)
+#endif
+
 /*----------------------------------------------------------------------------*/
-/* Por simplicidade e compatibilidade, ns sempre consideramos a leitura e
- * escrita de imagens com 3 canais, 24bpp. Todas as converses para escala de
- * cinza e float so feitas internamente. */
+/* Por simplicidade e compatibilidade, a leitura aceita arquivos de 8 bpp
+ * (com paleta), 24 bpp e 32 bpp, e a escrita usa 24 bpp para imagens de 3
+ * canais e 8 bpp (com paleta de cinza) para imagens de 1 canal. Todas as
+ * converses para escala de cinza e float so feitas internamente. */
 
 Imagem* criaImagem (int largura, int altura, int n_canais);
 void destroiImagem (Imagem* img);
@@ -38,5 +68,125 @@ void copiaConteudo (Imagem* in, Imagem* out);
 void redimensionaNN (Imagem* in, Imagem* out);
 void redimensionaBilinear (Imagem* in, Imagem* out);
 
+/* Vises: imagens que apontam para uma regio retangular de outra imagem,
+ * sem copiar os pixels. Como as linhas so acessadas pelos mesmos ponteiros
+ * dados [canal][y], qualquer funo que recebe uma Imagem* aceita uma viso.
+ * A imagem pai precisa existir enquanto a viso for usada. */
+Imagem* criaVisao (Imagem* pai, int x, int y, int largura, int altura);
+void ajustaVisao (Imagem* visao, int x, int y, int largura, int altura);
+
+/*----------------------------------------------------------------------------*/
+/* Imagem com 8 bits por canal. Os valores ficam no intervalo [0,255], e as
+ * imagens binrias usam 0 e 255. Tem a mesma organizao da Imagem: um nico
+ * bloco alinhado, acessado com 3 ndices: [canal][y][x]. */
+
+typedef struct
+{
+	int largura;
+	int altura;
+	int n_canais;
+	int passo; /* Nmero de bytes entre o incio de duas linhas consecutivas (>= largura). */
+	unsigned char* bloco;
+	unsigned char*** dados;
+} ImagemU8;
+
+ImagemU8* criaImagemU8 (int largura, int altura, int n_canais);
+void destroiImagemU8 (ImagemU8* img);
+ImagemU8* abreImagemU8 (char* arquivo, int n_canais);
+int salvaImagemU8 (ImagemU8* img, char* arquivo);
+void imagemParaU8 (Imagem* in, ImagemU8* out);
+void imagemU8ParaFloat (ImagemU8* in, Imagem* out);
+
+/* Leitura de fluxos (pipes, entrada padro) com vrios quadros em seguida. */
+ImagemU8* leImagemU8 (FILE* stream, int n_canais, ImagemU8* reuso);
+int leQuadroRGBU8 (FILE* stream, ImagemU8* img);
+
+/*----------------------------------------------------------------------------*/
+/* Pool e arenas de imagens. As imagens destrudas ficam guardadas em um pool
+ * por thread e so reaproveitadas pela criaImagem/criaImagemU8 quando o
+ * tamanho e o nmero de canais coincidem. Uma arena agrupa as imagens
+ * temporrias de um estgio, para destru-las todas de uma vez. */
+
+typedef struct
+{
+	void** imagens;
+	int* tipos;
+	int n;
+	int capacidade;
+} ArenaImagens;
+
+void esvaziaPoolImagens ();
+ArenaImagens* criaArena ();
+Imagem* criaImagemNaArena (ArenaImagens* arena, int largura, int altura, int n_canais);
+ImagemU8* criaImagemU8NaArena (ArenaImagens* arena, int largura, int altura, int n_canais);
+void liberaArena (ArenaImagens* arena);
+void destroiArena (ArenaImagens* arena);
+
+/*----------------------------------------------------------------------------*/
+/* Um arquivo bmp de 24bpp mapeado em memria. Os pixels so acessados
+ * diretamente no arquivo, sem cpia e sem converso para float: cada linha
+ * tem largura*3 bytes na ordem BGR. Lembre-se que no arquivo as linhas
+ * normalmente ficam de baixo para cima; use linhaImagemMapeada para obter a
+ * linha y. */
+
+typedef struct
+{
+	int largura;
+	int altura;
+	int passo; /* Bytes entre o incio de duas linhas no arquivo (com o preenchimento). */
+	int invertida; /* 1 se as linhas esto guardadas de cima para baixo. */
+	unsigned char* pixels; /* Primeira linha guardada no arquivo (normalmente a de baixo!). */
+	void* mapa; /* O arquivo inteiro, como retornado pela mmap. */
+	unsigned long tamanho_mapa;
+} ImagemMapeada;
+
+ImagemMapeada* abreImagemMapeada (char* arquivo);
+void fechaImagemMapeada (ImagemMapeada* img);
+unsigned char* linhaImagemMapeada (ImagemMapeada* img, int y);
+void converteImagemMapeada (ImagemMapeada* in, Imagem* out);
+
+/*----------------------------------------------------------------------------*/
+/* Escrita assncrona. As imagens so colocadas em uma fila e salvas por uma
+ * ou mais threads escritoras, enquanto a thread que chamou continua
+ * trabalhando. A fila  limitada em bytes: se estiver cheia, as funes
+ * salva*Async esperam at que alguma imagem seja salva. Os erros de escrita
+ * so contados e retornados pela aguardaEscritor. */
+
+#ifndef ESCRITOR_MAX_BYTES
+#define ESCRITOR_MAX_BYTES (64 << 20)
+#endif
+
+typedef struct PedidoEscrita
+{
+	int tipo; /* 0 para Imagem, 1 para ImagemU8. */
+	void* img;
+	char* arquivo;
+	size_t bytes;
+	struct PedidoEscrita* prox;
+} PedidoEscrita;
+
+typedef struct
+{
+	pthread_t* threads;
+	int n_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t tem_pedido; /* Acorda as threads escritoras. */
+	pthread_cond_t tem_espaco; /* Acorda quem espera espao na fila. */
+	pthread_cond_t ocioso; /* Acorda quem espera a fila esvaziar. */
+	PedidoEscrita* primeiro;
+	PedidoEscrita* ultimo;
+	size_t bytes; /* Bytes na fila e sendo salvos. */
+	size_t max_bytes;
+	int em_andamento; /* Pedidos que j saram da fila, mas ainda esto sendo salvos. */
+	int erros; /* Erros desde a ltima aguardaEscritor. */
+	int terminando;
+} EscritorImagens;
+
+EscritorImagens* criaEscritor (int n_threads, size_t max_bytes);
+void salvaImagemAsync (EscritorImagens* escritor, Imagem* img, char* arquivo, int copia);
+void salvaImagemU8Async (EscritorImagens* escritor, ImagemU8* img, char* arquivo, int copia);
+int aguardaEscritor (EscritorImagens* escritor);
+int destroiEscritor (EscritorImagens* escritor);
+
 /*============================================================================*/
 #endif /* __IMAGEM_H */
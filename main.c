@@ -7,16 +7,33 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
+#include <unistd.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "pdi.h"
 
 /*============================================================================*/
 
-#define THRESHOLD 1.0
 #define ALTURA_MIN 30
 #define LARGURA_MIN 30
 #define N_PIXELS_MIN 30
 
+// 25 em [0,255] corresponde ao 0.1 em [0,1].
+#define DIFERENCA_VERMELHO 25
+
+// Salva a máscara de cada componente em ./resultados, só para depuração.
+#define SALVA_ELEMENTOS 1
+
+// Salva a máscara de vermelho e as labels em ./resultados, só para depuração.
+#define SALVA_MAPAS 1
+
 /*============================================================================*/
 
 typedef struct {
@@ -26,21 +43,102 @@ typedef struct {
 	Coordenada right;
 } Frame;
 
-void chamferFunc(Imagem *canny, Imagem *chamfer);
 
-int recurssChamfer(Imagem *canny, Imagem *chamfer, float value, int y, int x);
+void redDetector(ImagemU8 *img, ImagemU8 *img_out);
+
+void redMapping(ImagemU8 *in, ImagemU8 *out);
+
+float checkPlaca(Gabarito *gabarito, Imagem *img, BufferGabarito *buffer);
+
+// Um componente verificado.
+typedef struct {
+	Retangulo roi;
+	int n_pixels;
+	float pontuacao;
+} Deteccao;
+
+// Saída do processamento de um arquivo: o texto que seria impresso e as
+// detecções.
+typedef struct {
+	char *texto;
+	size_t tamanho;
+	int sem_texto; // Se 1, só guarda as detecções.
+	Deteccao *deteccoes;
+	int n_deteccoes;
+	int capacidade;
+	int erro;
+	int pronto;
+} Resultado;
+
+// Registros do modo fluxo em binário (na ordem de bytes da máquina).
+typedef struct {
+	int32_t quadro;
+	int32_t n_deteccoes;
+	float latencia_ms;
+} RegistroQuadro;
+
+typedef struct {
+	int32_t x, y, largura, altura;
+	int32_t n_pixels;
+	float pontuacao;
+} RegistroDeteccao;
+
+// Memória de trabalho de uma thread. As imagens intermediárias são criadas
+// uma vez e reaproveitadas enquanto o tamanho das imagens não mudar.
+typedef struct {
+	Gabarito *gabarito; // Compartilhado, só leitura.
+	EscritorImagens *escritor; // Compartilhado. Se for NULL, nada é salvo.
+	BufferGabarito *buffer;
+	ImagemU8 *red;
+	Imagem *redMap;
+	BufferRotulaVermelho *rotulos; // Só cresce, não depende do tamanho das imagens.
+} Contexto;
+
+// Um lote de arquivos processado em paralelo.
+typedef struct {
+	char **arquivos;
+	int n_arquivos;
+	int para_no_erro; // Se 1, para no primeiro arquivo que não abrir.
+	Resultado *resultados;
+	int proximo; // Próximo arquivo a processar.
+	int parar;
+	pthread_mutex_t mutex;
+	pthread_cond_t pronto;
+	Gabarito *gabarito;
+	EscritorImagens *escritor;
+} Lote;
+
+int processaLote(Lote *lote, int n_threads);
+
+void *trabalhadorLote(void *arg);
+
+void processaArquivo(char *arquivo, int idx, Contexto *ctx, Resultado *res);
+
+void processaImagem(ImagemU8 *img, int idx, Contexto *ctx, Resultado *res);
 
-void redDetector(Imagem *img, Imagem *img_out);
+int processaFluxo(char *entrada, int largura_raw, int altura_raw, int binario, Gabarito *gabarito, FILE *saida);
 
-void redMapping(Imagem *in, Imagem *out);
+void escreveRegistro(FILE *saida, int quadro, Resultado *res, double latencia_ms, int binario);
 
-float checkPlaca(Imagem *img);
+void adicionaDeteccao(Resultado *res, ComponenteConexo *componente, float pontuacao);
+
+void iniciaContexto(Contexto *ctx, Gabarito *gabarito, EscritorImagens *escritor);
+
+void ajustaContexto(Contexto *ctx, int largura, int altura);
+
+void liberaContexto(Contexto *ctx);
+
+void anexaResultado(Resultado *res, const char *formato, ...);
+
+void adicionaArquivo(Lote *lote, const char *arquivo);
+
+int adicionaEntrada(Lote *lote, char *entrada);
 
 /*============================================================================*/
 
-int main()
+int main(int argc, char **argv)
 {
-	int elem, idx=5, qtde, i, j;
+	int i, n_threads = 0;
 	//float r, g, b, h, s, l;
 
 	char *files[13] = {"./img/placa01.bmp", "./img/placa02.bmp", "./img/placa03.bmp", "./img/placa04.bmp",
@@ -48,198 +146,606 @@ int main()
 					   "./img/placa09.bmp", "./img/placa10.bmp", "./img/placa11.bmp"
 					   , "./img/placa12.bmp", "./img/placa13.bmp"};
 
-	char fileName[25], elementName[35];
+	// Sem argumentos, processa as imagens de exemplo e para no primeiro erro.
+	// Com argumentos (-j N e arquivos, padrões ou diretórios), processa o lote
+	// em paralelo. Com -s entrada, processa um fluxo de quadros (bmp, ou RGB
+	// cru com -r LxA) vindo de um pipe ou da entrada padrão (-s -), e escreve
+	// as detecções em texto (ou em binário, com -b).
+	Lote lote;
+	lote.arquivos = NULL;
+	lote.n_arquivos = 0;
+	lote.para_no_erro = 0;
+
+	char *fluxo = NULL;
+	int largura_raw = 0, altura_raw = 0, binario = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i+1 < argc)
+			n_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i+1 < argc)
+			fluxo = argv[++i];
+		else if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &largura_raw, &altura_raw) != 2 || largura_raw <= 0 || altura_raw <= 0) {
+				printf("Tamanho invalido: %s.\n", argv[i]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[i], "-b") == 0)
+			binario = 1;
+		else if (!adicionaEntrada(&lote, argv[i]))
+			printf("Nada encontrado em %s.\n", argv[i]);
+	}
 
-	for (int idx = 0; idx < 13; idx++) {
+	if (fluxo) {
+		// Os registros vão para uma cópia da saída padrão, e o stdout passa a
+		// ser o stderr: as mensagens da biblioteca (que usam printf) não podem
+		// se misturar aos registros.
+		fflush(stdout);
+		int fd = dup(fileno(stdout));
+		FILE *saida = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+		if (!saida || dup2(fileno(stderr), fileno(stdout)) < 0) {
+			fprintf(stderr, "Erro preparando a saida.\n");
+			exit(1);
+		}
 
-		Imagem *img = abreImagem(files[idx], 3);
-		//Imagem *img = abreImagem("./img/placa01.bmp", 3);
-		if (!img)
+		Gabarito *gabarito = abreGabarito("./gabs.bmp");
+		if (!gabarito)
 		{
-			printf("Erro abrindo a imagem.\n");
+			fprintf(stderr, "Erro abrindo o gabarito.\n");
 			exit(1);
 		}
-		Coordenada coo;
-
-		coo.x = 2;
-		coo.y = 2;
+		int ok = processaFluxo(fluxo, largura_raw, altura_raw, binario, gabarito, saida);
+		destroiGabarito(gabarito);
+		fclose(saida);
+		return (ok ? 0 : 1);
+	}
 
-		//Imagem *kernel = criaImagem(3, 3, 1);
+	if (argc == 1) {
+		for (i = 0; i < 13; i++)
+			adicionaArquivo(&lote, files[i]);
+		lote.para_no_erro = 1;
+		n_threads = 1;
+	}
 
-		//Imagem *dilatada = criaImagem(img->largura, img->altura, 3);
+	if (n_threads <= 0)
+		n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads > lote.n_arquivos)
+		n_threads = lote.n_arquivos;
+	if (n_threads < 1)
+		n_threads = 1;
 
-		//Imagem *canny = criaImagem(img->largura, img->altura, 3);Descomentar  quando for fazer o chamfer
+	/* As imagens de resultado são salvas em segundo plano. */
+	lote.escritor = criaEscritor((n_threads > 8)? n_threads/4 : 2, 0);
 
-		//Imagem *chamfer = criaImagem(img->largura, img->altura, 1); Descomentar quando for fazer o chamfer
+	/* O gabarito é lido uma vez só e compartilhado por todas as threads. */
+	lote.gabarito = abreGabarito("./gabs.bmp");
+	if (!lote.gabarito)
+	{
+		printf("Erro abrindo o gabarito.\n");
+		exit(1);
+	}
 
-		Imagem *red = criaImagem(img->largura, img->altura, 3);
+	int erros = processaLote(&lote, n_threads);
 
-		Imagem *redMap = criaImagem(img->largura, img->altura, 1);
+	if (destroiEscritor(lote.escritor) > 0)
+		printf("Erro salvando resultados.\n");
 
-		redDetector(img, red);
+	destroiGabarito(lote.gabarito);
+	for (i = 0; i < lote.n_arquivos; i++)
+		free(lote.arquivos[i]);
+	free(lote.arquivos);
 
-		sprintf(fileName, "./resultados/%d-red.bmp", idx+1);
-		salvaImagem(red, fileName);
+	if (erros && lote.para_no_erro)
+		exit(1);
 
+	return (0);
+}
 
-		/*detectorCanny(img, 3, 0.01, 0.4, 1, canny);
+/*----------------------------------------------------------------------------*/
+// Processa todos os arquivos do lote com n_threads threads. Cada thread pega
+// o próximo arquivo ainda não processado; os resultados são impressos na
+// ordem dos arquivos, assim que ficam prontos. Retorna o número de erros.
 
-		sprintf(fileName, "./resultados/%d-canny.bmp", idx+1);
-		salvaImagem(canny, fileName);
+int processaLote(Lote *lote, int n_threads)
+{
+	int i, erros = 0;
+
+	lote->resultados = calloc(lote->n_arquivos + 1, sizeof(Resultado));
+	lote->proximo = 0;
+	lote->parar = 0;
+	pthread_mutex_init(&lote->mutex, NULL);
+	pthread_cond_init(&lote->pronto, NULL);
+
+	// Com uma thread só, processa aqui mesmo, um arquivo depois do outro.
+	if (n_threads == 1) {
+		Contexto ctx;
+		iniciaContexto(&ctx, lote->gabarito, lote->escritor);
+		for (i = 0; i < lote->n_arquivos; i++) {
+			Resultado *res = &lote->resultados[i];
+			processaArquivo(lote->arquivos[i], i+1, &ctx, res);
+			fputs(res->texto ? res->texto : "", stdout);
+			free(res->texto);
+			res->texto = NULL;
+			if (res->erro) {
+				erros++;
+				if (lote->para_no_erro)
+					break;
+			}
+		}
+		liberaContexto(&ctx);
+	}
+	else {
+		pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+		for (i = 0; i < n_threads; i++)
+			if (pthread_create(&threads[i], NULL, trabalhadorLote, lote) != 0) {
+				printf("Erro criando as threads.\n");
+				exit(1);
+			}
 
-		dilata(canny, kernel, coo, dilatada);
-		salvaImagem(dilatada, "Dilatada");*/
+		// Imprime na ordem de entrada.
+		for (i = 0; i < lote->n_arquivos; i++) {
+			Resultado *res = &lote->resultados[i];
+			pthread_mutex_lock(&lote->mutex);
+			while (!res->pronto)
+				pthread_cond_wait(&lote->pronto, &lote->mutex);
+			pthread_mutex_unlock(&lote->mutex);
+
+			fputs(res->texto ? res->texto : "", stdout);
+			free(res->texto);
+			res->texto = NULL;
+			if (res->erro) {
+				erros++;
+				if (lote->para_no_erro) {
+					pthread_mutex_lock(&lote->mutex);
+					lote->parar = 1;
+					pthread_mutex_unlock(&lote->mutex);
+					break;
+				}
+			}
+		}
 
+		for (i = 0; i < n_threads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
 
-		redMapping(img, redMap);
-		sprintf(fileName, "./resultados/%d-redMap1.bmp", idx+1);
-		salvaImagem(redMap, fileName);
-		sprintf(fileName, "./resultados/%d-redMap2.bmp", idx+1);
-		ComponenteConexo *componentes;
-		qtde = rotulaFloodFill(redMap, &componentes, LARGURA_MIN, ALTURA_MIN, N_PIXELS_MIN, idx+1);
-		salvaImagem(redMap, fileName);
+	}
 
-		//printf("\n%d - %d elementos\n", idx+1,qtde);
+	// Se parou no meio, descarta o que ficou pronto depois do erro.
+	for (i = 0; i < lote->n_arquivos; i++) {
+		free(lote->resultados[i].texto);
+		free(lote->resultados[i].deteccoes);
+	}
 
-		for(i=1;i<=qtde;i++){
-			sprintf(elementName, "./resultados/%d-element%d.bmp", idx+1,i);
-			Imagem *element = abreImagem(elementName, 3);
-			float tmp = checkPlaca(element);
-			if(tmp>90.f){
-				printf("\n %d-element%d é praca %.2f%% !! \n", idx+1,i, tmp);
-			} else {
-				printf("\n %d-element%d não é praca %.2f%% !! (eu acho) \n",  idx+1,i, tmp);
-			}
-			//Imagem *elementCanny = criaImagem(element->largura, element->altura, 3);
-			//detectorCanny(element, 5, 0.01, 0.4, 1, elementCanny);
-			//sprintf(fileName, "./resultados/%d-element%dcanny.bmp", idx+1,i);
-			//salvaImagem(elementCanny, fileName);
-			//dilata(canny, kernel, coo, dilatada);
-			destroiImagem(element);
-			//destroiImagem(elementCanny);
-		}
+	pthread_mutex_destroy(&lote->mutex);
+	pthread_cond_destroy(&lote->pronto);
+	free(lote->resultados);
+	return erros;
+}
 
-		
+/*----------------------------------------------------------------------------*/
+// Laço de uma thread do lote. Cada thread tem o seu contexto (e, dentro da
+// biblioteca, o seu pool de imagens).
 
-		/*for (i = 0; i < chamfer->altura; i++)
-		{
-			for (j = 0; j < chamfer->largura; j++)
-			{
-				chamfer->dados[0][i][j] = 100000000;
-			}
-		}
+void *trabalhadorLote(void *arg)
+{
+	Lote *lote = (Lote *) arg;
+	Contexto ctx;
+	iniciaContexto(&ctx, lote->gabarito, lote->escritor);
+
+	for (;;) {
+		pthread_mutex_lock(&lote->mutex);
+		int k = lote->proximo++;
+		int parar = lote->parar;
+		pthread_mutex_unlock(&lote->mutex);
+		if (k >= lote->n_arquivos || parar)
+			break;
+
+		Resultado *res = &lote->resultados[k];
+		processaArquivo(lote->arquivos[k], k+1, &ctx, res);
+
+		pthread_mutex_lock(&lote->mutex);
+		res->pronto = 1;
+		pthread_cond_broadcast(&lote->pronto);
+		pthread_mutex_unlock(&lote->mutex);
+	}
 
-		Imagem *tst = abreImagem("saida.bmp", 3);
-		chamferFunc(canny, chamfer);
+	liberaContexto(&ctx);
+	esvaziaPoolImagens();
+	return NULL;
+}
 
-		salvaImagem(chamfer, "chamfer_teste.bmp");*/
+/*----------------------------------------------------------------------------*/
+// Abre um arquivo e procura as placas nele. idx é o número usado nos nomes
+// dos arquivos de resultado. O texto de saída fica em res.
 
-		//destroiImagem(canny);
-		//destroiImagem(chamfer);
-		destroiImagem(img);
-		destroiImagem(red);
-		destroiImagem(redMap);
+void processaArquivo(char *arquivo, int idx, Contexto *ctx, Resultado *res)
+{
+	ImagemU8 *img = abreImagemU8(arquivo, 3);
+	//Imagem *img = abreImagem("./img/placa01.bmp", 3);
+	if (!img)
+	{
+		anexaResultado(res, "Erro abrindo a imagem.\n");
+		res->erro = 1;
+		return;
 	}
 
-	return (0);
+	processaImagem(img, idx, ctx, res);
+	destroiImagemU8(img);
 }
 
-float checkPlaca(Imagem *img){
+/*----------------------------------------------------------------------------*/
+// Procura as placas em uma imagem RGB. As detecções são acrescentadas a res.
 
-	Imagem *gabarito = abreImagem("./gabs.bmp", 3);
+void processaImagem(ImagemU8 *img, int idx, Contexto *ctx, Resultado *res)
+{
+	int i, qtde;
+	char fileName[256], elementName[256];
+	EscritorImagens *escritor = ctx->escritor;
 
-	Imagem *resize = criaImagem(gabarito->largura, gabarito->altura, 3);
-	
-	redimensionaBilinear(img, resize);
+	ajustaContexto(ctx, img->largura, img->altura);
 
-	int count = 0;
+	Coordenada coo;
 
-	for(int j = 0; j<resize->altura; j++){
-		for(int i = 0; i < resize->largura; i++){
-			if(gabarito->dados[0][j][i] > 0 && resize->dados[0][j][i] > 0){
-				count++;
-			}
-		}
+	coo.x = 2;
+	coo.y = 2;
+
+	//Imagem *kernel = criaImagem(3, 3, 1);
+
+	//Imagem *dilatada = criaImagem(img->largura, img->altura, 3);
+
+	//Imagem *canny = criaImagem(img->largura, img->altura, 3);Descomentar  quando for fazer o chamfer
+
+	//Imagem *chamfer = criaImagem(img->largura, img->altura, 1); Descomentar quando for fazer o chamfer
+
+	// A imagem do redDetector só serve para ser salva.
+	if (escritor) {
+		redDetector(img, ctx->red);
+		sprintf(fileName, "./resultados/%d-red.bmp", idx);
+		salvaImagemU8Async(escritor, ctx->red, fileName, 1);
 	}
-	
-	int total = resize->altura*resize->largura;
 
-	float perc = ((float)count/total)*100.0;
 
-	destroiImagem(resize);
-	destroiImagem(gabarito);
+	/*detectorCanny(img, 3, 0.01, 0.4, 1, canny);
+
+	sprintf(fileName, "./resultados/%d-canny.bmp", idx);
+	salvaImagem(canny, fileName);
+
+	dilata(canny, kernel, coo, dilatada);
+	salvaImagem(dilatada, "Dilatada");*/
+
 
-	//printf("\n %d de %d ---> %.2f%% \n", count, total, perc);
+	// Uma só passada: classifica os pixels vermelhos e rotula as sequências.
+	// As labels só são desenhadas se for para salvá-las.
+	int salva_mapas = (SALVA_MAPAS && escritor);
+	ComponenteConexo *componentes;
+	qtde = rotulaVermelho(img, DIFERENCA_VERMELHO, &componentes, LARGURA_MIN, ALTURA_MIN, N_PIXELS_MIN, salva_mapas ? ctx->redMap : NULL, ctx->rotulos);
+
+	if (salva_mapas) {
+		ImagemU8 *redMapU8 = criaImagemU8(img->largura, img->altura, 1);
+		redMapping(img, redMapU8);
+		sprintf(fileName, "./resultados/%d-redMap1.bmp", idx);
+		salvaImagemU8Async(escritor, redMapU8, fileName, 0);
+
+		sprintf(fileName, "./resultados/%d-redMap2.bmp", idx);
+		salvaImagemAsync(escritor, ctx->redMap, fileName, 1);
+	}
+
+	//printf("\n%d - %d elementos\n", idx,qtde);
+
+	for(i=1;i<=qtde;i++){
+		// A verificação usa a máscara direto da memória.
+		Imagem *element = componentes[i-1].mascara;
+		if (SALVA_ELEMENTOS && escritor) {
+			sprintf(elementName, "./resultados/%d-element%d.bmp", idx,i);
+			salvaImagemAsync(escritor, element, elementName, 1);
+		}
+		float tmp = checkPlaca(ctx->gabarito, element, ctx->buffer);
+		adicionaDeteccao(res, &componentes[i-1], tmp);
+		if(tmp>90.f){
+			anexaResultado(res, "\n %d-element%d é praca %.2f%% !! \n", idx,i, tmp);
+		} else {
+			anexaResultado(res, "\n %d-element%d não é praca %.2f%% !! (eu acho) \n",  idx,i, tmp);
+		}
+		//Imagem *elementCanny = criaImagem(element->largura, element->altura, 3);
+		//detectorCanny(element, 5, 0.01, 0.4, 1, elementCanny);
+		//sprintf(fileName, "./resultados/%d-element%dcanny.bmp", idx,i);
+		//salvaImagem(elementCanny, fileName);
+		//dilata(canny, kernel, coo, dilatada);
+		//destroiImagem(elementCanny);
+	}
+	destroiComponentes(componentes, qtde);
 
 	
-	return perc;	
+
+	/*transformadaDistancia(canny, chamfer, DISTANCIA_CHAMFER_3_4, NULL);
+
+	salvaImagem(chamfer, "chamfer_teste.bmp");*/
+
+	//destroiImagem(canny);
+	//destroiImagem(chamfer);
 }
 
-void chamferFunc(Imagem *canny, Imagem *chamfer)
+/*----------------------------------------------------------------------------*/
+// Processa um fluxo de quadros: arquivos bmp em seguida ou, se largura_raw e
+// altura_raw forem dados, quadros RGB crus desse tamanho. entrada é um
+// caminho (um pipe com nome, por exemplo) ou "-" para a entrada padrão. Para
+// cada quadro, escreve um registro com as detecções em saida. Todas as
+// imagens de trabalho são criadas uma vez só. Retorna 1 se o fluxo foi lido
+// até o fim sem erros.
+
+int processaFluxo(char *entrada, int largura_raw, int altura_raw, int binario, Gabarito *gabarito, FILE *saida)
 {
-	int i, j; //, c;
+	FILE *stream = (strcmp(entrada, "-") == 0) ? stdin : fopen(entrada, "rb");
+	if (!stream) {
+		fprintf(stderr, "Erro abrindo %s.\n", entrada);
+		return 0;
+	}
 
-	for (i = 0; i < canny->altura; i++)
-	{
-		for (j = 0; j < canny->largura; j++)
-		{
-			//printf("\nCANNY \ni: %d\nj: %d\ncanny: %f\n", i, j, canny->dados[0][i][j]);
-			if (canny->dados[0][i][j] == 1)
-			{
-				printf("\ni: %d\nj: %d\n", i, j);
-				chamfer->dados[0][i][j] = 0;
-				recurssChamfer(canny, chamfer, 0.3, i, j);
+	// Nada é salvo em disco; o contexto e o resultado são reaproveitados.
+	Contexto ctx;
+	iniciaContexto(&ctx, gabarito, NULL);
+	Resultado res;
+	memset(&res, 0, sizeof(res));
+	res.sem_texto = 1;
+
+	ImagemU8 *img = NULL;
+	if (largura_raw > 0)
+		img = criaImagemU8(largura_raw, altura_raw, 3);
+
+	int quadro = 0, ok = 1;
+	double soma_ms = 0, max_ms = 0;
+	struct timespec inicio, fim;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &inicio);
+
+		if (largura_raw > 0) {
+			int lido = leQuadroRGBU8(stream, img);
+			if (lido <= 0) {
+				if (lido < 0) {
+					fprintf(stderr, "Quadro %d incompleto.\n", quadro+1);
+					ok = 0;
+				}
+				break;
+			}
+		}
+		else {
+			// Fim do fluxo entre dois arquivos é o fim normal; qualquer outra
+			// falha é erro.
+			int c = fgetc(stream);
+			if (c == EOF)
+				break;
+			ungetc(c, stream);
+			if (!(img = leImagemU8(stream, 3, img))) {
+				fprintf(stderr, "Quadro %d invalido.\n", quadro+1);
+				ok = 0;
+				break;
 			}
 		}
+
+		quadro++;
+		res.n_deteccoes = 0;
+		processaImagem(img, quadro, &ctx, &res);
+
+		// Latência do quadro: da leitura até o registro estar pronto.
+		clock_gettime(CLOCK_MONOTONIC, &fim);
+		double ms = (fim.tv_sec - inicio.tv_sec) * 1000.0 + (fim.tv_nsec - inicio.tv_nsec) / 1e6;
+		soma_ms += ms;
+		if (ms > max_ms)
+			max_ms = ms;
+
+		escreveRegistro(saida, quadro, &res, ms, binario);
+		fflush(saida);
 	}
-}
 
-int recurssChamfer(Imagem *canny, Imagem *chamfer, float value, int y, int x)
-{
-	chamfer->dados[0][y][x] = value;
+	if (ferror(stream) || !feof(stream))
+		ok = 0;
+	if (stream != stdin)
+		fclose(stream);
+	if (img)
+		destroiImagemU8(img);
+	liberaContexto(&ctx);
+	free(res.deteccoes);
+	free(res.texto);
+
+	fprintf(stderr, "%d quadros, latencia media %.3f ms, maxima %.3f ms.\n", quadro, quadro ? soma_ms / quadro : 0.0, max_ms);
+	return ok;
+}
 
-	value = value + 0.01;
+/*----------------------------------------------------------------------------*/
+// Escreve o registro de um quadro do fluxo. Em texto, uma linha
+// "Q quadro n_deteccoes latencia_ms" seguida de uma linha
+// "D quadro i x y largura altura n_pixels pontuacao" por detecção. Em
+// binário, um RegistroQuadro seguido de n_deteccoes RegistroDeteccao.
 
-	if(x > 0 && value < THRESHOLD) {
-		if(chamfer->dados[0][y][x-1] > value && canny->dados[0][y][x-1] != 1) {
-			//printf("\nIF 1\nAltura: %d\nLargura: %d\nValue: %f\n", y, x, value);
-			//if(recurssChamfer(canny, chamfer, value, y, x-1) == 1) return 1;
-			recurssChamfer(canny, chamfer, value, y, x-1);
+void escreveRegistro(FILE *saida, int quadro, Resultado *res, double latencia_ms, int binario)
+{
+	int i;
+
+	if (binario) {
+		RegistroQuadro rq;
+		rq.quadro = quadro;
+		rq.n_deteccoes = res->n_deteccoes;
+		rq.latencia_ms = (float) latencia_ms;
+		fwrite(&rq, sizeof(rq), 1, saida);
+		for (i = 0; i < res->n_deteccoes; i++) {
+			Deteccao *d = &res->deteccoes[i];
+			RegistroDeteccao rd;
+			rd.x = d->roi.e;
+			rd.y = d->roi.c;
+			rd.largura = d->roi.d - d->roi.e + 1;
+			rd.altura = d->roi.b - d->roi.c + 1;
+			rd.n_pixels = d->n_pixels;
+			rd.pontuacao = d->pontuacao;
+			fwrite(&rd, sizeof(rd), 1, saida);
 		}
+		return;
 	}
 
-	if(y > 0 && value < THRESHOLD) {
-		if(chamfer->dados[0][y-1][x] > value && canny->dados[0][y-1][x] != 1) {
-			//printf("\nIF 2\nAltura: %d\nLargura: %d\nValue: %f\n", y, x, value);
-			//if(recurssChamfer(canny, chamfer, value, y-1, x) == 1) return 1;
-			recurssChamfer(canny, chamfer, value, y-1, x);
-		}
+	fprintf(saida, "Q %d %d %.3f\n", quadro, res->n_deteccoes, latencia_ms);
+	for (i = 0; i < res->n_deteccoes; i++) {
+		Deteccao *d = &res->deteccoes[i];
+		fprintf(saida, "D %d %d %d %d %d %d %d %.2f\n", quadro, i+1, d->roi.e, d->roi.c,
+		        d->roi.d - d->roi.e + 1, d->roi.b - d->roi.c + 1, d->n_pixels, d->pontuacao);
 	}
+}
 
-	if(x < canny->largura-1 && value < THRESHOLD) {
-		if(chamfer->dados[0][y][x+1] > value && canny->dados[0][y][x+1] != 1) {
-			//printf("\nIF 3\nAltura: %d\nLargura: %d\nValue: %f\n", y, x, value);
-			//if(recurssChamfer(canny, chamfer, value, y, x+1) == 1) return 1;
-			recurssChamfer(canny, chamfer, value, y, x+1);
-		}
+/*----------------------------------------------------------------------------*/
+// Guarda a detecção de um componente no resultado. O vetor só cresce, e é
+// reaproveitado entre quadros.
+
+void adicionaDeteccao(Resultado *res, ComponenteConexo *componente, float pontuacao)
+{
+	if (res->n_deteccoes == res->capacidade) {
+		res->capacidade = (res->capacidade)? res->capacidade * 2 : 16;
+		res->deteccoes = realloc(res->deteccoes, sizeof(Deteccao) * res->capacidade);
 	}
+	Deteccao *d = &res->deteccoes[res->n_deteccoes++];
+	d->roi = componente->roi;
+	d->n_pixels = componente->n_pixels;
+	d->pontuacao = pontuacao;
+}
+
+/*----------------------------------------------------------------------------*/
+// Prepara o contexto de uma thread. As imagens são criadas no primeiro uso.
+
+void iniciaContexto(Contexto *ctx, Gabarito *gabarito, EscritorImagens *escritor)
+{
+	ctx->gabarito = gabarito;
+	ctx->escritor = escritor;
+	ctx->buffer = criaBufferGabarito(gabarito, 1);
+	ctx->red = NULL;
+	ctx->redMap = NULL;
+	ctx->rotulos = criaBufferRotulaVermelho();
+}
+
+/*----------------------------------------------------------------------------*/
+// Garante que as imagens do contexto tenham o tamanho dado. Só realoca se o
+// tamanho mudou.
+
+void ajustaContexto(Contexto *ctx, int largura, int altura)
+{
+	if (ctx->red && ctx->red->largura == largura && ctx->red->altura == altura)
+		return;
+
+	if (ctx->red)
+		destroiImagemU8(ctx->red);
+	if (ctx->redMap)
+		destroiImagem(ctx->redMap);
+	ctx->red = criaImagemU8(largura, altura, 3);
+	ctx->redMap = criaImagem(largura, altura, 1);
+}
+
+/*----------------------------------------------------------------------------*/
+// Libera a memória de um contexto (mas não o gabarito nem o escritor).
+
+void liberaContexto(Contexto *ctx)
+{
+	destroiBufferGabarito(ctx->buffer);
+	if (ctx->red)
+		destroiImagemU8(ctx->red);
+	if (ctx->redMap)
+		destroiImagem(ctx->redMap);
+	destroiBufferRotulaVermelho(ctx->rotulos);
+}
+
+/*----------------------------------------------------------------------------*/
+// Acrescenta texto formatado (como na printf) ao resultado de um arquivo.
+
+void anexaResultado(Resultado *res, const char *formato, ...)
+{
+	va_list args;
+	char linha[512];
+
+	if (res->sem_texto)
+		return;
+
+	va_start(args, formato);
+	int n = vsnprintf(linha, sizeof(linha), formato, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	if (n >= (int) sizeof(linha))
+		n = sizeof(linha) - 1;
+
+	res->texto = realloc(res->texto, res->tamanho + n + 1);
+	memcpy(res->texto + res->tamanho, linha, n + 1);
+	res->tamanho += n;
+}
+
+/*----------------------------------------------------------------------------*/
+// Acrescenta um caminho à lista de arquivos do lote.
+
+void adicionaArquivo(Lote *lote, const char *arquivo)
+{
+	lote->arquivos = realloc(lote->arquivos, sizeof(char *) * (lote->n_arquivos + 1));
+	lote->arquivos[lote->n_arquivos] = malloc(strlen(arquivo) + 1);
+	strcpy(lote->arquivos[lote->n_arquivos], arquivo);
+	lote->n_arquivos++;
+}
 
-	if(y < canny->altura-1 && value < THRESHOLD) {
-		if(chamfer->dados[0][y+1][x] > value && canny->dados[0][y+1][x] != 1) {
-			//printf("\nIF 4\nAltura: %d\nLargura: %d\nValue: %f\n", y, x, value);
-			//if(recurssChamfer(canny, chamfer, value, y+1, x) == 1) return 1;
-			recurssChamfer(canny, chamfer, value, y+1, x);
+/*----------------------------------------------------------------------------*/
+// Acrescenta ao lote os arquivos de uma entrada da linha de comando: um
+// diretório (todos os .bmp dentro dele, em ordem alfabética), uma lista
+// (@arquivo, um caminho por linha), um padrão (*, ? ou [) ou um arquivo.
+// Retorna o número de arquivos acrescentados.
+
+int adicionaEntrada(Lote *lote, char *entrada)
+{
+	struct stat info;
+	size_t k;
+	int n = lote->n_arquivos;
+
+	if (entrada[0] == '@') {
+		char linha[4096];
+		FILE *lista = fopen(entrada+1, "r");
+		if (!lista)
+			return 0;
+		while (fgets(linha, sizeof(linha), lista)) {
+			linha[strcspn(linha, "\r\n")] = '\0';
+			if (linha[0])
+				adicionaArquivo(lote, linha);
 		}
+		fclose(lista);
 	}
+	else if (stat(entrada, &info) == 0 && S_ISDIR(info.st_mode)) {
+		struct dirent **nomes;
+		int n_nomes = scandir(entrada, &nomes, NULL, alphasort);
+		for (int j = 0; j < n_nomes; j++) {
+			size_t tam = strlen(nomes[j]->d_name);
+			if (tam > 4 && strcasecmp(nomes[j]->d_name + tam - 4, ".bmp") == 0) {
+				char caminho[4096];
+				snprintf(caminho, sizeof(caminho), "%s/%s", entrada, nomes[j]->d_name);
+				adicionaArquivo(lote, caminho);
+			}
+			free(nomes[j]);
+		}
+		if (n_nomes >= 0)
+			free(nomes);
+	}
+	else if (strpbrk(entrada, "*?[")) {
+		glob_t g;
+		if (glob(entrada, 0, NULL, &g) == 0)
+			for (k = 0; k < g.gl_pathc; k++)
+				adicionaArquivo(lote, g.gl_pathv[k]);
+		globfree(&g);
+	}
+	else
+		adicionaArquivo(lote, entrada);
+
+	return lote->n_arquivos - n;
+}
 
+float checkPlaca(Gabarito *gabarito, Imagem *img, BufferGabarito *buffer){
 
-	return 1;
+	// Sem leitura de arquivo nem alocação: o gabarito já está pronto.
+	return comparaGabarito(gabarito, img, buffer);
 }
 
-void redDetector(Imagem *img, Imagem *img_out){
+void redDetector(ImagemU8 *img, ImagemU8 *img_out){
 
 	int i, j;
-	float r, g, b;
+	int r, g, b;
 
 	for (i = 0; i < img->altura; i++)
 		{
@@ -249,27 +755,27 @@ void redDetector(Imagem *img, Imagem *img_out){
 				g = img->dados[1][i][j];
 				b = img->dados[2][i][j];
 
-				if ((r - g > 0.1 && r - b > 0.1))
+				if ((r - g > DIFERENCA_VERMELHO && r - b > DIFERENCA_VERMELHO))
 				{
-					img_out->dados[0][i][j] = img->dados[0][i][j];
-					img_out->dados[1][i][j] = img->dados[1][i][j];
-					img_out->dados[2][i][j] = img->dados[2][i][j];
+					img_out->dados[0][i][j] = r;
+					img_out->dados[1][i][j] = g;
+					img_out->dados[2][i][j] = b;
 				}
 				else
 				{
-					img_out->dados[0][i][j] = -1;
-					img_out->dados[1][i][j] = -1;
-					img_out->dados[2][i][j] = -1;
+					img_out->dados[0][i][j] = 0;
+					img_out->dados[1][i][j] = 0;
+					img_out->dados[2][i][j] = 0;
 				}
 			}
 		}
 }
 
-void redMapping(Imagem *in, Imagem *out)
+void redMapping(ImagemU8 *in, ImagemU8 *out)
 {
 
     int j, k;
-		float r, g, b;
+		int r, g, b;
     for (j = 0; j < in->altura; j++){
         for (k = 0; k < in->largura; k++){
 
@@ -277,10 +783,10 @@ void redMapping(Imagem *in, Imagem *out)
 			g = in->dados[1][j][k];
 			b = in->dados[2][j][k];
 
-      if ((r - g > 0.1 && r - b > 0.1)) {
-        out->dados[0][j][k] = 1.0;
+      if ((r - g > DIFERENCA_VERMELHO && r - b > DIFERENCA_VERMELHO)) {
+        out->dados[0][j][k] = 255;
 			} else {
-        out->dados[0][j][k] = 0.0;
+        out->dados[0][j][k] = 0;
 			}
 		}
 	}
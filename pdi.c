@@ -16,5 +16,7 @@
 #include "desenho.c"
 #include "segmenta.c"
 #include "filtros2d.c"
+#include "gabarito.c"
+#include "grafo.c"
 
 /*============================================================================*/
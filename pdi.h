@@ -21,6 +21,8 @@
 #include "desenho.h"
 #include "segmenta.h"
 #include "filtros2d.h"
+#include "gabarito.h"
+#include "grafo.h"
 
 /*============================================================================*/
 #endif /* __PDI_H */
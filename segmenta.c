@@ -8,10 +8,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "base.h"
 #include "filtros2d.h"
+#include "grafo.h"
 #include "segmenta.h"
 
+/*============================================================================*/
+
+/* Uma sequência horizontal de pixels de uma linha (rotulaVermelho). */
+typedef struct
+{
+    int y;
+    int inicio;
+    int fim; /* Inclusive. */
+} _Sequencia;
+
+int _sequenciaRaiz (int* pai, int k);
+void _sequenciaUniao (int* pai, int a, int b);
+
+int _otsuHistograma (float hist [256]);
+
 /*============================================================================*/
 /* CLASSIFICA��O DE PIXELS                                                    */
 /*============================================================================*/
@@ -50,9 +67,8 @@ void binariza (Imagem* in, Imagem* out, float threshold)
  *               imagem de entrada.
  *             int largura: largura/altura da janela para a m�dia.
  *             float threshold: limiar.
- *             Imagem* buffer: uma imagem com o mesmo tamanho da imagem de
- *               entrada. Pode ser usada quando se quer evitar a aloca��o do
- *               buffer interno. Use NULL se quiser usar o buffer interno.
+ *             Imagem* buffer: não é mais usado, pois as imagens
+ *               intermediárias não são criadas. Use NULL.
  *
  * Valor de retorno: nenhum (a imagem de sa�da � usada). */
 
@@ -71,16 +87,15 @@ void binarizaAdapt (Imagem* in, Imagem* out, int largura, float threshold, Image
         exit (1);
     }
 
-    int channel, row, col;
-
-    // Primeiro calcula as m�dias.
-    blur (in, out, largura, largura, buffer);
+    // Compara cada pixel com a média local, sem criar a imagem das médias.
+    GrafoImagens* grafo = criaGrafo ();
+    int original = grafoEntrada (grafo, in);
+    int media = grafoBlur (grafo, original, largura, largura);
+    int diferenca = grafoSoma (grafo, original, media, 1, -1);
+    int resultado = grafoLimiar (grafo, diferenca, threshold);
 
-    // Agora compara cada pixel com a m�dia local.
-    for (channel = 0; channel < in->n_canais; channel++)
-        for (row = 0; row < in->altura; row++)
-            for (col = 0; col < in->largura; col++)
-                out->dados [channel][row][col] = (in->dados [channel][row][col] - out->dados [channel][row][col] > threshold)? 1 : 0;
+    executaGrafo (grafo, resultado, out);
+    destroiGrafo (grafo);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -93,13 +108,18 @@ void binarizaAdapt (Imagem* in, Imagem* out, int largura, float threshold, Image
 
 float thresholdOtsu (Imagem* img)
 {
-    int i;
-
     // Cria e normaliza o histograma.
     float hist [256];
     criaHistograma8bpp1cNorm (img, 0, hist);
 
-    // Agora executa o algoritmo.
+    return (((float) _otsuHistograma (hist)) / 255.0f);
+}
+
+// Função auxiliar, com o algoritmo propriamente dito. Recebe um histograma normalizado e retorna o limiar em [0,255].
+int _otsuHistograma (float hist [256])
+{
+    int i;
+
     float peso1 = hist [0];
     float soma1 = 0;
     float peso2 = 1.0f - peso1;
@@ -136,7 +156,59 @@ float thresholdOtsu (Imagem* img)
         }
     }
 
-    return (((float) melhor_limiar) / 255.0f);
+    return (melhor_limiar);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Binarização simples por limiarização, para imagens de 8 bits. A saída usa
+ * 0 e 255.
+ *
+ * Parâmetros: ImagemU8* in: imagem de entrada. Se tiver mais que 1 canal,
+ *               binariza cada canal independentemente.
+ *             ImagemU8* out: imagem de saída. Deve ter o mesmo tamanho da
+ *               imagem de entrada.
+ *             int threshold: limiar, em [0,255].
+ *
+ * Valor de retorno: nenhum (usa a imagem de saída). */
+
+void binarizaU8 (ImagemU8* in, ImagemU8* out, int threshold)
+{
+    if (in->largura != out->largura || in->altura != out->altura || in->n_canais != out->n_canais)
+    {
+        printf ("ERRO: binarizaU8: as imagens precisam ter o mesmo tamanho e numero de canais.\n");
+        exit (1);
+    }
+
+    int channel, row, col;
+    for (channel = 0; channel < in->n_canais; channel++)
+        for (row = 0; row < in->altura; row++)
+        {
+            unsigned char* linha_in = in->dados [channel][row];
+            unsigned char* linha_out = out->dados [channel][row];
+            for (col = 0; col < in->largura; col++)
+                linha_out [col] = (linha_in [col] > threshold)? 255 : 0;
+        }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Algoritmo de Otsu para imagens de 8 bits.
+ *
+ * Parâmetros: ImagemU8* img: imagem de entrada.
+ *
+ * Valor de retorno: o limiar escolhido, em [0,255]. */
+
+int thresholdOtsuU8 (ImagemU8* img)
+{
+    int i, hist_int [256];
+    float hist [256];
+
+    criaHistogramaU8 (img, 0, hist_int);
+
+    float norm = 1.0f / (float) (img->largura * img->altura);
+    for (i = 0; i < 256; i++)
+        hist [i] = ((float) hist_int [i]) * norm;
+
+    return (_otsuHistograma (hist));
 }
 
 /*============================================================================*/
@@ -154,12 +226,19 @@ float thresholdOtsu (Imagem* img)
  *             int altura_min: descarta componentes com altura menor que esta.
  *             int n_pixels_min: descarta componentes com menos pixels que isso.
  *
+ * Componentes com 1 pixel de largura ou de altura também são descartados,
+ * porque o recorte da máscara (sem a última linha e a última coluna da roi)
+ * ficaria vazio.
+ *
+ * Cada componente mantido recebe a sua máscara (o campo mascara), para que
+ * possa ser usado sem passar pelo disco. Desaloque o vetor e as máscaras com a
+ * destroiComponentes.
+ *
  * Valor de retorno: o n�mero de componentes conexos encontrados. */
 
-int rotulaFloodFill (Imagem* img, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min, int idx)
+int rotulaFloodFill (Imagem* img, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min)
 {
-    int row, col, n, i, j, k;
-    char fileName[25];
+    int row, col, n, i, j;
 
     // Marca todos os objetos com valores negativos.
     n = 0;
@@ -191,30 +270,35 @@ int rotulaFloodFill (Imagem* img, ComponenteConexo** componentes, int largura_mi
                 c->label = label;
                 c->roi = criaRetangulo (row, row, col, col);
                 c->n_pixels = 0;
+                c->mascara = NULL;
 
 				        pilha [0] = criaCoordenada (col,row);
 			          floodFill (img, pilha, c);
 
                 // Verifica se este componente n�o ficou pequeno demais.
+                // Componentes com 1 pixel de largura ou de altura ficariam com
+                // uma máscara vazia.
                 if (c->n_pixels >= n_pixels_min &&
                     c->roi.d - c->roi.e + 1 >= largura_min &&
-                    c->roi.b - c->roi.c + 1 >= altura_min) {
+                    c->roi.b - c->roi.c + 1 >= altura_min &&
+                    c->roi.d > c->roi.e && c->roi.b > c->roi.c) {
                     n++;
 
                     //desenhaRetangulo(c->roi, cor, img); //Teste Para ver os objetos na imagem original
 
                     Imagem *element = criaImagem(c->roi.d - c->roi.e, c->roi.b - c->roi.c, 1); //utiliza as bordas do retangulo para definir o tamanho da imagem que vai conter o componente
+                    c->mascara = element;
 
                     for(i=c->roi.c;i<c->roi.b; i++) {  //Preenche a imagem em branco onde elemento esta populado
                       for(j=c->roi.e;j<c->roi.d; j++) {
                         if(img->dados[0][i][j] == label) {
                           //printf("\ni: %d\nj: %d\n", i, j);
                           element->dados[0][i-c->roi.c][j-c->roi.e] = 1.0;
+                        } else {
+                          element->dados[0][i-c->roi.c][j-c->roi.e] = 0.0;
                         }
                       }
                     }
-                    sprintf(fileName ,"./resultados/%d-element%d.bmp", idx, n);
-                    salvaImagem(element, fileName); 
                     //Aplicar canny nessa imagem e usar o canny para comparar com o chamfer
 						//Ps - Escolher um elemento extraido bem definido para aplicar o chamfer e usar como referencia
                 }				
@@ -409,6 +493,7 @@ int rotulaUnionFind (Imagem* img, ComponenteConexo** componentes, int largura_mi
     for (i = 0; i < n; i++)
     {
         (*componentes) [i].n_pixels = 0;
+        (*componentes) [i].mascara = NULL;
         (*componentes) [i].roi.c = img->altura;
         (*componentes) [i].roi.b = -1;
         (*componentes) [i].roi.e = img->largura;
@@ -465,5 +550,311 @@ int rotulaUnionFind (Imagem* img, ComponenteConexo** componentes, int largura_mi
     return (n_mantidos);
 }
 
+/*----------------------------------------------------------------------------*/
+/** Desaloca um vetor de componentes criado pelas funções de rotulagem,
+ * incluindo as máscaras dos componentes.
+ *
+ * Parâmetros: ComponenteConexo* componentes: vetor a desalocar.
+ *             int n: número de componentes no vetor.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiComponentes (ComponenteConexo* componentes, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (componentes [i].mascara)
+            destroiImagem (componentes [i].mascara);
+
+    free (componentes);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Segmenta e rotula os pixels vermelhos de uma imagem RGB em uma única
+ * passada. Cada linha é percorrida uma vez: os pixels com r-g e r-b maiores
+ * que diferenca_min formam sequências horizontais, que são unidas (union-find)
+ * às sequências da linha de cima que as tocam (vizinhança-4). A máscara nunca
+ * é criada; a caixa envolvente e o número de pixels de cada componente são
+ * acumulados a partir das sequências.
+ *
+ * Os componentes saem na mesma ordem, com as mesmas labels [0.1,0.2,etc] e
+ * com as mesmas máscaras que a rotulaFloodFill produziria para a máscara de
+ * vermelho.
+ *
+ * Parâmetros: ImagemU8* img: imagem RGB de entrada.
+ *             int diferenca_min: diferença mínima do vermelho para o verde e
+ *               para o azul, em [0,255].
+ *             ComponenteConexo** componentes: um ponteiro para um vetor de
+ *               saída, alocado dentro desta função. Desaloque o vetor e as
+ *               máscaras com a destroiComponentes.
+ *             int largura_min: descarta componentes com largura menor que esta.
+ *             int altura_min: descarta componentes com altura menor que esta.
+ *             int n_pixels_min: descarta componentes com menos pixels que isso.
+ *             Imagem* rotulos: se não for NULL, recebe as labels de todos os
+ *               componentes (0 no fundo), como a imagem de saída da
+ *               rotulaFloodFill. Só serve para depuração.
+ *             BufferRotulaVermelho* buffer: memória de trabalho, criada com
+ *               a criaBufferRotulaVermelho. Se for NULL, um buffer é criado
+ *               e destruído dentro desta função.
+ *
+ * Valor de retorno: o número de componentes conexos encontrados. */
+
+int rotulaVermelho (ImagemU8* img, int diferenca_min, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min, Imagem* rotulos, BufferRotulaVermelho* buffer)
+{
+    int row, col, i, j, k, n;
+    BufferRotulaVermelho* temporario = NULL;
+
+    if (img->n_canais != 3)
+    {
+        printf ("ERRO: rotulaVermelho: a imagem precisa ter 3 canais.\n");
+        exit (1);
+    }
+
+    if (rotulos && (rotulos->largura != img->largura || rotulos->altura != img->altura || rotulos->n_canais != 1))
+    {
+        printf ("ERRO: rotulaVermelho: a imagem de rotulos precisa ter o mesmo tamanho e 1 canal.\n");
+        exit (1);
+    }
+
+    if (!buffer)
+        buffer = temporario = criaBufferRotulaVermelho ();
+
+    // Sequências e a floresta do union-find (pai [k] == k nas raízes).
+    int n_seq = 0;
+    _Sequencia* seq = (_Sequencia*) buffer->sequencias;
+    int* pai = buffer->pai;
+    int anterior = 0; // Primeira sequência da linha de cima.
+
+    for (row = 0; row < img->altura; row++)
+    {
+        unsigned char* r = img->dados [0][row];
+        unsigned char* g = img->dados [1][row];
+        unsigned char* b = img->dados [2][row];
+        int atual = n_seq; // Primeira sequência desta linha.
+
+        // Classifica e extrai as sequências da linha.
+        col = 0;
+        while (col < img->largura)
+        {
+            while (col < img->largura && !(r [col] - g [col] > diferenca_min && r [col] - b [col] > diferenca_min))
+                col++;
+            if (col == img->largura)
+                break;
+
+            int inicio = col;
+            while (col < img->largura && r [col] - g [col] > diferenca_min && r [col] - b [col] > diferenca_min)
+                col++;
+
+            if (n_seq == buffer->capacidade_sequencias)
+            {
+                buffer->capacidade_sequencias = (buffer->capacidade_sequencias)? buffer->capacidade_sequencias * 2 : 1024;
+                buffer->sequencias = seq = realloc (seq, sizeof (_Sequencia) * buffer->capacidade_sequencias);
+                buffer->pai = pai = realloc (pai, sizeof (int) * buffer->capacidade_sequencias);
+            }
+            seq [n_seq].y = row;
+            seq [n_seq].inicio = inicio;
+            seq [n_seq].fim = col-1;
+            pai [n_seq] = n_seq;
+            n_seq++;
+        }
+
+        // Une com as sequências da linha de cima que se sobrepõem.
+        i = anterior;
+        j = atual;
+        while (i < atual && j < n_seq)
+        {
+            if (seq [i].fim < seq [j].inicio)
+                i++;
+            else if (seq [j].fim < seq [i].inicio)
+                j++;
+            else
+            {
+                _sequenciaUniao (pai, i, j);
+                if (seq [i].fim < seq [j].fim)
+                    i++;
+                else
+                    j++;
+            }
+        }
+
+        anterior = atual;
+    }
+
+    // Como a união sempre liga a raiz maior à menor, a raiz de um componente é
+    // a sua primeira sequência, e percorrer as raízes em ordem crescente dá a
+    // mesma ordem de descoberta da rotulaFloodFill. Acumula os dados de cada
+    // componente na posição da sua raiz.
+    // Nunca há mais componentes que sequências.
+    if (buffer->capacidade_componentes < n_seq+1)
+    {
+        buffer->capacidade_componentes = MAX (n_seq+1, buffer->capacidade_componentes * 2);
+        buffer->componentes = realloc (buffer->componentes, sizeof (ComponenteConexo) * buffer->capacidade_componentes);
+        buffer->indice = realloc (buffer->indice, sizeof (int) * buffer->capacidade_componentes);
+        buffer->final = realloc (buffer->final, sizeof (int) * buffer->capacidade_componentes);
+        buffer->labels = realloc (buffer->labels, sizeof (float) * buffer->capacidade_componentes);
+    }
+    int* indice = buffer->indice;
+    ComponenteConexo* todos = buffer->componentes;
+    n = 0;
+    for (k = 0; k < n_seq; k++)
+    {
+        int raiz = _sequenciaRaiz (pai, k);
+        pai [k] = raiz;
+        if (raiz == k)
+        {
+            indice [k] = n;
+            todos [n].roi = criaRetangulo (seq [k].y, seq [k].y, seq [k].inicio, seq [k].fim);
+            todos [n].n_pixels = 0;
+            todos [n].mascara = NULL;
+            n++;
+        }
+
+        ComponenteConexo* c = &(todos [indice [raiz]]);
+        c->n_pixels += seq [k].fim - seq [k].inicio + 1;
+        if (seq [k].y > c->roi.b)
+            c->roi.b = seq [k].y;
+        if (seq [k].inicio < c->roi.e)
+            c->roi.e = seq [k].inicio;
+        if (seq [k].fim > c->roi.d)
+            c->roi.d = seq [k].fim;
+    }
+
+    // Labels (contando também os componentes descartados) e filtragem. final
+    // guarda a posição de cada componente no vetor de saída, ou -1.
+    int* final = buffer->final;
+    float* labels = buffer->labels;
+    int n_mantidos = 0;
+    float label = 0.1f;
+    for (i = 0; i < n; i++)
+    {
+        ComponenteConexo* c = &(todos [i]);
+        c->label = label;
+        labels [i] = label;
+        label += 0.1f;
+
+        // Mesmo recorte da rotulaFloodFill: a última linha e a última coluna
+        // da roi ficam de fora. Um componente com 1 pixel de largura ou de
+        // altura ficaria com uma máscara vazia, e é descartado.
+        if (c->n_pixels >= n_pixels_min &&
+            c->roi.d - c->roi.e + 1 >= largura_min &&
+            c->roi.b - c->roi.c + 1 >= altura_min &&
+            c->roi.d > c->roi.e && c->roi.b > c->roi.c)
+        {
+            c->mascara = criaImagem (c->roi.d - c->roi.e, c->roi.b - c->roi.c, 1);
+            for (j = 0; j < c->mascara->altura; j++)
+                memset (c->mascara->dados [0][j], 0, sizeof (float) * c->mascara->largura);
+
+            final [i] = n_mantidos;
+            if (i != n_mantidos)
+                todos [n_mantidos] = *c;
+            n_mantidos++;
+        }
+        else
+            final [i] = -1;
+    }
+
+    // Pinta as máscaras (e as labels) percorrendo as sequências.
+    if (rotulos)
+        for (row = 0; row < rotulos->altura; row++)
+            memset (rotulos->dados [0][row], 0, sizeof (float) * rotulos->largura);
+
+    for (k = 0; k < n_seq; k++)
+    {
+        int comp = indice [pai [k]];
+
+        if (rotulos)
+            for (col = seq [k].inicio; col <= seq [k].fim; col++)
+                rotulos->dados [0][seq [k].y][col] = labels [comp];
+
+        if (final [comp] < 0)
+            continue;
+
+        ComponenteConexo* c = &(todos [final [comp]]);
+        if (seq [k].y >= c->roi.b)
+            continue;
+
+        int fim = (seq [k].fim < c->roi.d)? seq [k].fim : c->roi.d-1;
+        float* linha = c->mascara->dados [0][seq [k].y - c->roi.c];
+        for (col = seq [k].inicio; col <= fim; col++)
+            linha [col - c->roi.e] = 1.0f;
+    }
+
+    // Só o vetor de saída é alocado a cada chamada, com o tamanho exato.
+    *componentes = malloc (sizeof (ComponenteConexo) * (n_mantidos+1));
+    memcpy (*componentes, todos, sizeof (ComponenteConexo) * n_mantidos);
+
+    if (temporario)
+        destroiBufferRotulaVermelho (temporario);
+    return (n_mantidos);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Cria a memória de trabalho da rotulaVermelho. Os vetores são alocados no
+ * primeiro uso.
+ *
+ * Parâmetros: nenhum.
+ *
+ * Valor de retorno: o buffer criado. */
+
+BufferRotulaVermelho* criaBufferRotulaVermelho ()
+{
+    BufferRotulaVermelho* buffer = (BufferRotulaVermelho*) malloc (sizeof (BufferRotulaVermelho));
+    buffer->sequencias = NULL;
+    buffer->pai = NULL;
+    buffer->capacidade_sequencias = 0;
+    buffer->componentes = NULL;
+    buffer->indice = NULL;
+    buffer->final = NULL;
+    buffer->labels = NULL;
+    buffer->capacidade_componentes = 0;
+    return (buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Destrói a memória de trabalho da rotulaVermelho.
+ *
+ * Parâmetros: BufferRotulaVermelho* buffer: o buffer a destruir.
+ *
+ * Valor de retorno: nenhum. */
+
+void destroiBufferRotulaVermelho (BufferRotulaVermelho* buffer)
+{
+    free (buffer->sequencias);
+    free (buffer->pai);
+    free (buffer->componentes);
+    free (buffer->indice);
+    free (buffer->final);
+    free (buffer->labels);
+    free (buffer);
+}
+
+/*----------------------------------------------------------------------------*/
+/** Funções auxiliares do union-find das sequências: a raiz de uma sequência
+ * (com compressão de caminho pela metade) e a união de duas árvores, sempre
+ * ligando a raiz maior à menor. */
+
+int _sequenciaRaiz (int* pai, int k)
+{
+    while (pai [k] != k)
+    {
+        pai [k] = pai [pai [k]];
+        k = pai [k];
+    }
+
+    return (k);
+}
+
+void _sequenciaUniao (int* pai, int a, int b)
+{
+    a = _sequenciaRaiz (pai, a);
+    b = _sequenciaRaiz (pai, b);
+
+    if (a < b)
+        pai [b] = a;
+    else if (b < a)
+        pai [a] = b;
+}
+
 
 /*============================================================================*/
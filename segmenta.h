@@ -21,18 +21,40 @@ typedef struct
     float label;
     Retangulo roi;
     int n_pixels;
+    Imagem* mascara; /* 1 nos pixels do componente, 0 nos demais, recortada pela roi. Pode ser NULL. */
 
 } ComponenteConexo;
 
+/* Memória de trabalho da rotulaVermelho. Os vetores só crescem, então uma
+ * thread que rotula um quadro atrás do outro pode reaproveitar o mesmo buffer
+ * sem alocar nada depois dos primeiros quadros. */
+typedef struct
+{
+    void* sequencias; /* Sequências horizontais de pixels. */
+    int* pai; /* Floresta do union-find das sequências. */
+    int capacidade_sequencias;
+    ComponenteConexo* componentes; /* Todos os componentes, antes da filtragem. */
+    int* indice; /* Posição do componente de cada sequência raiz. */
+    int* final; /* Posição de cada componente na saída, ou -1. */
+    float* labels;
+    int capacidade_componentes;
+} BufferRotulaVermelho;
+
 /*----------------------------------------------------------------------------*/
 
 void binariza (Imagem* in, Imagem* out, float threshold);
 void binarizaAdapt (Imagem* in, Imagem* out, int largura, float threshold, Imagem* buffer);
 float thresholdOtsu (Imagem* img);
+void binarizaU8 (ImagemU8* in, ImagemU8* out, int threshold);
+int thresholdOtsuU8 (ImagemU8* img);
 
-int rotulaFloodFill (Imagem* img, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min, int idx);
+int rotulaFloodFill (Imagem* img, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min);
 void floodFill (Imagem* img, Coordenada* pilha, ComponenteConexo* componente);
 int rotulaUnionFind (Imagem* img, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min);
+void destroiComponentes (ComponenteConexo* componentes, int n);
+BufferRotulaVermelho* criaBufferRotulaVermelho ();
+void destroiBufferRotulaVermelho (BufferRotulaVermelho* buffer);
+int rotulaVermelho (ImagemU8* img, int diferenca_min, ComponenteConexo** componentes, int largura_min, int altura_min, int n_pixels_min, Imagem* rotulos, BufferRotulaVermelho* buffer);
 
 /*============================================================================*/
 #endif /* __IMAGEM_H */